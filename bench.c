@@ -0,0 +1,509 @@
+/*
+ * Benchmark harness for the cs1550 filesystem.
+ *
+ * Builds the filesystem straight into this program and calls the operations in hello_oper the same way FUSE would,
+ * against a fresh .disk/.directories pair in a temporary directory. Nothing is mounted, so runs are quick and don't
+ * depend on the kernel.
+ *
+ *     gcc -Wall -O2 -DNDEBUG -o bench bench.c `pkg-config fuse --cflags --libs`
+ *     ./bench [-s seed] [-n scale] [-b block_size] [-m megabytes] [-k]
+ *
+ * -s picks the random seed (the same seed gives the same workload), -n multiplies the number of operations in each
+ * workload and -k keeps the temporary directory around afterwards. The disk is 5 MB without a superblock, like one made
+ * with dd; -b makes it the way mkfs would with blocks of that size instead, and -m changes its size.
+ */
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+/* * * * * * * * * * * * * * *
+
+           DEFINES
+
+ * * * * * * * * * * * * * * */
+//How big the files of the read and write workloads get
+#define    BENCH_FILE_SIZE (1024 * 1024)
+#define    BENCH_CHUNK 4096
+
+//How many files each directory of the create storm gets, enough for it to need a second record
+#define    BENCH_DIR_FILES 32
+
+/* * * * * * * * * * * * * * *
+
+            STRUCTS
+
+ * * * * * * * * * * * * * * */
+//Latencies of one kind of operation within a workload
+struct bench_series
+{
+    const char *name;
+    long long *latency; //nanoseconds, one per operation
+    int count;
+    int capacity;
+    long long bytes;    //how much data the operations moved, if any
+    int errors;         //operations that didn't return what we expected
+};
+
+typedef struct bench_series bench_series;
+
+/* * * * * * * * * * * * * * *
+
+            GLOBALS
+
+ * * * * * * * * * * * * * * */
+static unsigned int benchSeed = 1550;
+static int benchScale = 1;
+static int benchBlockSize;     //0 for a disk without a superblock, otherwise what mkfs would be given
+static int benchDiskSize = 5;  //megabytes
+static char benchBuffer[BENCH_FILE_SIZE];
+
+/* * * * * * * * * * * * * * *
+
+        MEASUREMENT
+
+ * * * * * * * * * * * * * * */
+
+
+static void seriesInit(bench_series *series, const char *name, int capacity)
+{
+    series->name = name;
+    series->latency = malloc(sizeof(long long) * capacity);
+    series->count = 0;
+    series->capacity = capacity;
+    series->bytes = 0;
+    series->errors = 0;
+
+    if(series->latency == NULL)
+    {
+        fprintf(stderr, "bench: out of memory\n");
+        exit(1);
+    }
+}
+
+
+static void seriesAdd(bench_series *series, long long elapsed, int ok, long long bytes)
+{
+    if(series->count < series->capacity) series->latency[series->count++] = elapsed;
+    if(!ok) series->errors++;
+    series->bytes += bytes;
+}
+
+
+static int compareLatency(const void *a, const void *b)
+{
+    long long x = *(const long long *) a;
+    long long y = *(const long long *) b;
+
+    return (x > y) - (x < y);
+}
+
+
+// The latency that fraction of the operations came in under
+static double percentile(const bench_series *series, double fraction)
+{
+    if(series->count == 0) return 0;
+
+    int i = (int) (fraction * series->count);
+    if(i >= series->count) i = series->count - 1;
+
+    return series->latency[i] / 1000.0;
+}
+
+
+// Prints one line of the report and frees the series
+static void seriesReport(bench_series *series)
+{
+    long long total = 0;
+    int i;
+
+    for(i = 0; i < series->count; i++) total += series->latency[i];
+
+    qsort(series->latency, series->count, sizeof(long long), compareLatency);
+
+    double seconds = total / 1e9;
+
+    printf("%-22s %8d %12.0f %10.2f %10.2f %10.2f %10.2f", series->name, series->count,
+           seconds > 0 ? series->count / seconds : 0, percentile(series, 0.5), percentile(series, 0.99),
+           percentile(series, 0.999), series->count > 0 ? series->latency[series->count - 1] / 1000.0 : 0);
+
+    if(series->bytes > 0 && seconds > 0) printf(" %8.1f MB/s", series->bytes / seconds / (1024 * 1024));
+    if(series->errors > 0) printf(" (%d errors)", series->errors);
+    printf("\n");
+
+    free(series->latency);
+}
+
+/* * * * * * * * * * * * * * *
+
+          WORKLOADS
+
+ * * * * * * * * * * * * * * */
+
+
+// Makes directories and fills every one of them up to BENCH_DIR_FILES files
+static void benchCreate(void)
+{
+    int dirs = 100 * benchScale;
+    int files = BENCH_DIR_FILES;
+    bench_series mkdirs, mknods;
+    char path[32];
+    int d, f;
+
+    seriesInit(&mkdirs, "mkdir", dirs);
+    seriesInit(&mknods, "mknod", dirs * files);
+
+    for(d = 0; d < dirs; d++)
+    {
+        snprintf(path, sizeof(path), "/c%d", d);
+
+        long long start = traceNow();
+        int res = hello_oper.mkdir(path, 0755);
+        long long elapsed = traceNow() - start;
+        seriesAdd(&mkdirs, elapsed, res == 0, 0);
+
+        for(f = 0; f < files; f++)
+        {
+            snprintf(path, sizeof(path), "/c%d/f%d.b", d, f);
+
+            start = traceNow();
+            res = hello_oper.mknod(path, S_IFREG | 0644, 0);
+            elapsed = traceNow() - start;
+            seriesAdd(&mknods, elapsed, res == 0, 0);
+        }
+    }
+
+    seriesReport(&mkdirs);
+    seriesReport(&mknods);
+}
+
+
+// Makes path a file of size bytes, written BENCH_CHUNK at a time
+static void benchFill(const char *path, int size, bench_series *series)
+{
+    int offset;
+
+    hello_oper.mknod(path, S_IFREG | 0644, 0);
+
+    for(offset = 0; offset < size; offset += BENCH_CHUNK)
+    {
+        int n = size - offset < BENCH_CHUNK ? size - offset : BENCH_CHUNK;
+
+        long long start = traceNow();
+        int res = hello_oper.write(path, benchBuffer + offset, n, offset, NULL);
+        long long elapsed = traceNow() - start;
+        if(series != NULL) seriesAdd(series, elapsed, res == n, n);
+    }
+}
+
+
+// Grows one file to BENCH_FILE_SIZE a chunk at a time, several times over
+static void benchAppend(void)
+{
+    int rounds = 4 * benchScale;
+    bench_series appends;
+    char path[32];
+    int r;
+
+    hello_oper.mkdir("/seq", 0755);
+    seriesInit(&appends, "sequential append 4K", rounds * (BENCH_FILE_SIZE / BENCH_CHUNK));
+
+    for(r = 0; r < rounds; r++)
+    {
+        snprintf(path, sizeof(path), "/seq/a%d.b", r);
+        benchFill(path, BENCH_FILE_SIZE, &appends);
+        hello_oper.unlink(path);
+    }
+
+    seriesReport(&appends);
+}
+
+
+// Overwrites small pieces of a file at random offsets
+static void benchRandomWrite(void)
+{
+    int count = 20000 * benchScale;
+    int size = 256 * 1024;
+    bench_series writes;
+    int i;
+
+    hello_oper.mkdir("/rnd", 0755);
+    benchFill("/rnd/r.b", size, NULL);
+    seriesInit(&writes, "random write 64-512", count);
+
+    for(i = 0; i < count; i++)
+    {
+        int n = 64 + rand() % 449;
+        int offset = rand() % (size - n);
+
+        long long start = traceNow();
+        int res = hello_oper.write("/rnd/r.b", benchBuffer + offset, n, offset, NULL);
+        long long elapsed = traceNow() - start;
+        seriesAdd(&writes, elapsed, res == n, n);
+    }
+
+    seriesReport(&writes);
+}
+
+
+// Reads a whole BENCH_FILE_SIZE file in one call, over and over
+static void benchRead(void)
+{
+    int count = 200 * benchScale;
+    static char out[BENCH_FILE_SIZE];
+    bench_series reads;
+    int i;
+
+    hello_oper.mkdir("/rd", 0755);
+    benchFill("/rd/big.b", BENCH_FILE_SIZE, NULL);
+    seriesInit(&reads, "full-file read 1M", count);
+
+    for(i = 0; i < count; i++)
+    {
+        long long start = traceNow();
+        int res = hello_oper.read("/rd/big.b", out, BENCH_FILE_SIZE, 0, NULL);
+        long long elapsed = traceNow() - start;
+        seriesAdd(&reads, elapsed, res == BENCH_FILE_SIZE && memcmp(out, benchBuffer, BENCH_FILE_SIZE) == 0, res);
+    }
+
+    seriesReport(&reads);
+
+    // The same reads as the low-level frontend does them when it can splice: only building the reply is timed, since
+    // the copy out of it happens in the kernel
+    seriesInit(&reads, "full-file read_buf 1M", count);
+
+    for(i = 0; i < count; i++)
+    {
+        struct fuse_bufvec *bufv = NULL;
+
+        spliceBegin();
+
+        long long start = traceNow();
+        int res = hello_oper.read_buf("/rd/big.b", &bufv, BENCH_FILE_SIZE, 0, NULL);
+        long long elapsed = traceNow() - start;
+
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(BENCH_FILE_SIZE);
+        size_t j;
+
+        dst.buf[0].mem = out;
+
+        int ok = res == 0 && fuse_buf_copy(&dst, bufv, 0) == BENCH_FILE_SIZE;
+
+        spliceEnd();
+
+        seriesAdd(&reads, elapsed, ok && memcmp(out, benchBuffer, BENCH_FILE_SIZE) == 0, BENCH_FILE_SIZE);
+
+        if(res != 0) continue;
+
+        for(j = 0; j < bufv->count; j++) free(bufv->buf[j].mem);
+        free(bufv);
+    }
+
+    seriesReport(&reads);
+
+    // The way cat reads a file: a chunk at a time through one open, which is what readahead is for
+    struct fuse_file_info fi;
+    unsigned long prefetched = statEvents[STAT_READAHEAD_BLOCKS];
+    unsigned long hits = statEvents[STAT_READAHEAD_HITS];
+    int offset;
+
+    seriesInit(&reads, "sequential read 4K", count / 10 * (BENCH_FILE_SIZE / BENCH_CHUNK));
+
+    for(i = 0; i < count / 10; i++)
+    {
+        memset(&fi, 0, sizeof(fi));
+        hello_oper.open("/rd/big.b", &fi);
+
+        for(offset = 0; offset < BENCH_FILE_SIZE; offset += BENCH_CHUNK)
+        {
+            long long start = traceNow();
+            int res = hello_oper.read("/rd/big.b", out + offset, BENCH_CHUNK, offset, &fi);
+            long long elapsed = traceNow() - start;
+            seriesAdd(&reads, elapsed, res == BENCH_CHUNK && memcmp(out + offset, benchBuffer + offset, res) == 0, res);
+        }
+
+        hello_oper.release("/rd/big.b", &fi);
+    }
+
+    seriesReport(&reads);
+
+    prefetched = statEvents[STAT_READAHEAD_BLOCKS] - prefetched;
+    hits = statEvents[STAT_READAHEAD_HITS] - hits;
+    printf("%-22s %8lu blocks read ahead, %.1f%% of them read\n", "", prefetched,
+           prefetched > 0 ? 100.0 * hits / prefetched : 0);
+
+    hello_oper.unlink("/rd/big.b");
+}
+
+
+// Creates, writes and removes small files so blocks keep getting allocated and freed
+static void benchUnlink(void)
+{
+    int count = 5000 * benchScale;
+    int files = BENCH_DIR_FILES;
+    bench_series unlinks;
+    char path[32];
+    int i;
+
+    hello_oper.mkdir("/churn", 0755);
+    seriesInit(&unlinks, "unlink churn", count);
+
+    for(i = 0; i < count; i++)
+    {
+        int n = 1 + rand() % (4 * blockSize);
+
+        snprintf(path, sizeof(path), "/churn/u%d.b", i % files);
+        hello_oper.mknod(path, S_IFREG | 0644, 0);
+        hello_oper.write(path, benchBuffer, n, 0, NULL);
+
+        long long start = traceNow();
+        int res = hello_oper.unlink(path);
+        long long elapsed = traceNow() - start;
+        seriesAdd(&unlinks, elapsed, res == 0, 0);
+    }
+
+    seriesReport(&unlinks);
+}
+
+
+// Times getattr on files of a directory as it fills up, and on directories as the root fills up
+static void benchLookup(void)
+{
+    int count = 2000 * benchScale;
+    int sizes[] = { 1, 10, 100, 1000 };
+    char path[32], name[32];
+    struct stat st;
+    int made = 0;
+    int k, i;
+
+    hello_oper.mkdir("/look", 0755);
+
+    for(k = 0; k < (int) (sizeof(sizes) / sizeof(sizes[0])); k++)
+    {
+        bench_series lookups;
+
+        for(; made < sizes[k]; made++)
+        {
+            snprintf(path, sizeof(path), "/look/l%d.b", made);
+            hello_oper.mknod(path, S_IFREG | 0644, 0);
+        }
+
+        snprintf(name, sizeof(name), "lookup %d files", made);
+        seriesInit(&lookups, name, count);
+
+        for(i = 0; i < count; i++)
+        {
+            snprintf(path, sizeof(path), "/look/l%d.b", rand() % made);
+
+            long long start = traceNow();
+            int res = hello_oper.getattr(path, &st);
+            long long elapsed = traceNow() - start;
+            seriesAdd(&lookups, elapsed, res == 0, 0);
+        }
+
+        seriesReport(&lookups);
+    }
+
+    bench_series dirs;
+    seriesInit(&dirs, "lookup directory", count);
+
+    for(i = 0; i < count; i++)
+    {
+        snprintf(path, sizeof(path), "/c%d", rand() % (100 * benchScale));
+
+        long long start = traceNow();
+        int res = hello_oper.getattr(path, &st);
+        long long elapsed = traceNow() - start;
+        seriesAdd(&dirs, elapsed, res == 0, 0);
+    }
+
+    seriesReport(&dirs);
+}
+
+/* * * * * * * * * * * * * * *
+
+             MAIN
+
+ * * * * * * * * * * * * * * */
+
+
+// Makes a temporary directory with an empty .disk in it and moves into it
+static int benchSetup(char *dir)
+{
+    cs1550_superblock sb;
+    off_t size = (off_t) benchDiskSize * 1024 * 1024;
+
+    if(mkdtemp(dir) == NULL || chdir(dir) != 0)
+    {
+        perror("bench: temporary directory");
+        return -1;
+    }
+
+    if(benchBlockSize != 0 && superblockLayout(&sb, benchBlockSize, size / benchBlockSize, 0) != 0)
+    {
+        fprintf(stderr, "bench: can't make a %d MB disk of %d byte blocks\n", benchDiskSize, benchBlockSize);
+        return -1;
+    }
+
+    int fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0 || ftruncate(fd, size) != 0 || (benchBlockSize != 0 && makeFilesystem(fd, &sb) != 0))
+    {
+        perror("bench: .disk");
+        return -1;
+    }
+
+    close(fd);
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/cs1550-bench-XXXXXX";
+    int keep = 0;
+    int c, i;
+
+    while((c = getopt(argc, argv, "s:n:b:m:k")) != -1)
+    {
+        switch(c)
+        {
+            case 's': benchSeed = (unsigned int) strtoul(optarg, NULL, 10); break;
+            case 'n': benchScale = atoi(optarg) > 0 ? atoi(optarg) : 1; break;
+            case 'b': benchBlockSize = atoi(optarg); break;
+            case 'm': benchDiskSize = atoi(optarg) > 0 ? atoi(optarg) : 5; break;
+            case 'k': keep = 1; break;
+            default:
+                fprintf(stderr, "usage: %s [-s seed] [-n scale] [-b block_size] [-m megabytes] [-k]\n", argv[0]);
+                return 2;
+        }
+    }
+
+    if(benchSetup(dir) != 0) return 1;
+
+    srand(benchSeed);
+    for(i = 0; i < BENCH_FILE_SIZE; i++) benchBuffer[i] = (char) rand();
+
+    hello_oper.init(NULL);
+
+    printf("seed %u, scale %d, %d blocks of %d bytes, %d files per directory, in %s\n", benchSeed, benchScale,
+           blockCount, blockSize, BENCH_DIR_FILES, dir);
+    printf("%-22s %8s %12s %10s %10s %10s %10s\n", "operation", "ops", "ops/s", "p50 us", "p99 us", "p999 us",
+           "max us");
+
+    benchCreate();
+    benchAppend();
+    benchRandomWrite();
+    benchRead();
+    benchUnlink();
+    benchLookup();
+
+    hello_oper.destroy(NULL);
+
+    if(!keep)
+    {
+        unlink(".disk");
+        unlink(".directories");
+        if(chdir("/") == 0) rmdir(dir);
+    }
+
+    return 0;
+}
@@ -1,996 +1,7245 @@
 #define FUSE_USE_VERSION 26
+#define _GNU_SOURCE //for fallocate()
 
 #include <fuse.h>
 #include <stdio.h>
+#include <assert.h>
 #include <string.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
 #import <math.h>
 /* * * * * * * * * * * * * * *
 
            DEFINES
 
  * * * * * * * * * * * * * * */
-//size of a disk block
-#define    BLOCK_SIZE 512
+//Block sizes a disk can be made with. How big the blocks of a particular disk are, how many of them there are and
+//where everything is comes from its superblock; see blockSize and blockCount.
+#define    MIN_BLOCK_SIZE 512
+#define    MAX_BLOCK_SIZE 65536
 
-//we'll use 8.3 filenames
-#define    MAX_FILENAME 8
-#define    MAX_EXTENSION 3
+//Block 0 of a disk made by mkfs holds a cs1550_superblock
+#define    SUPERBLOCK_MAGIC 0x15505342
+#define    SUPERBLOCK_VERSION 1
+
+//Disks made with dd before there was a superblock have 10240 blocks of 512 bytes, with the bitmap in blocks 0 to 2
+//and 512 blocks of journal starting at block 4
+#define    LEGACY_BLOCK_SIZE 512
+#define    LEGACY_BLOCK_COUNT 10240
+#define    LEGACY_BITMAP_BLOCKS 3
+#define    LEGACY_JOURNAL_START 4
+#define    LEGACY_JOURNAL_BLOCKS 512
 
-//How many files can there be in one directory?
-#define    MAX_FILES_IN_DIR (BLOCK_SIZE - (MAX_FILENAME + 1) - sizeof(int)) / \
-    ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))
+//Block numbers are ints, and the free extent index needs twice as many nodes as there are blocks
+#define    MAX_BLOCK_COUNT (1 << 30)
 
-//How much data can one block hold?
-#define    MAX_DATA_IN_BLOCK BLOCK_SIZE
+//How big a .directories record is. It doesn't depend on the block size, since records never go on .disk.
+#define    DIRECTORY_SIZE 512
 
-//How many pointers in an inode?
-#define NUM_POINTERS_IN_INODE ((BLOCK_SIZE - sizeof(unsigned int) - sizeof(unsigned long)) / sizeof(unsigned long))
+//we'll use 8.3 filenames
+#define    MAX_FILENAME 8
+#define    MAX_EXTENSION 3
 
-#define    BLOCK_SIZE 512
-#define    SIZE_OF_BITMAP 3
-#define    NUM_OF_BLOCKS 10240
+//How many files fit in one .directories record. A directory that needs more gets more records, each carrying its name.
+#define    FILES_PER_RECORD ((int) ((DIRECTORY_SIZE - (MAX_FILENAME + 1) - sizeof(int)) / \
+    ((MAX_FILENAME + 1) + (MAX_EXTENSION + 1) + sizeof(size_t) + sizeof(long))))
+
+//The last two pointers of an inode point at a single and a double indirect block, the rest point straight at data.
+//How many pointers an inode and an indirect block hold depends on the block size; see inodePointers and indexPointers.
+#define NUM_DIRECT_POINTERS (inodePointers - 2)
+#define SINGLE_INDIRECT_POINTER (inodePointers - 2)
+#define DOUBLE_INDIRECT_POINTER (inodePointers - 1)
+//How many blocks a file can have at most
+#define MAX_FILE_BLOCKS (NUM_DIRECT_POINTERS + indexPointers + (long) indexPointers * indexPointers)
+
+//Marks a block as an inode
+#define INODE_MAGIC 0x15500001
+
+//Set in an inode's flags while the file is small enough for its data to sit in the inode, where the pointers would
+//otherwise be. How many bytes that is depends on the block size.
+#define INODE_INLINE 1
+#define INLINE_CAPACITY ((size_t) blockSize - offsetof(cs1550_inode, pointers))
+
+//Set in an inode's flags while the file may have blocks past its end that were preallocated on speculation. Nothing
+//but memory says where they are, so after a crash everything past the end of such a file can go. A file that
+//fallocate has given blocks past its end gets INODE_KEEP_SIZE instead, and is never preallocated for.
+#define INODE_PREALLOC 2
+#define INODE_KEEP_SIZE 4
+
+//How the bitmap is held in memory
+#define    BITMAP_BYTES ((blockCount + 7) / 8)
+#define    BITMAP_WORDS ((blockCount + 63) / 64)
+
+//How many blocks the block cache holds unless -o cache_blocks says otherwise
+#define    DEFAULT_CACHE_BLOCKS 1024
+#define    CACHE_SHARDS 16
+
+//Files are locked by hashing their path onto one of this many locks
+#define    FILE_LOCK_STRIPES 256
+
+//The lookup cache remembers what this many paths resolved to, each in a slot picked by hashing the path
+#define    LOOKUP_CACHE_SIZE 4096
+#define    LOOKUP_STRIPES 64
+
+//The longest path that can name anything: /directory/filename.extension
+#define    LOOKUP_PATH (1 + MAX_FILENAME + 1 + MAX_FILENAME + 1 + MAX_EXTENSION + 1)
+
+//What a path resolved to, when it isn't a file's slot
+#define    LOOKUP_DIRECTORY -1
+#define    LOOKUP_MISSING -2
+
+//The journal sits right after the bitmap: one header block, then a ring of blocks that transactions are written into.
+//The superblock says where it is. mkfs makes it DEFAULT_JOURNAL_BYTES long, but at least MIN_JOURNAL_BLOCKS blocks,
+//unless told otherwise.
+#define    DEFAULT_JOURNAL_BYTES (256 * 1024)
+#define    MIN_JOURNAL_BLOCKS 64
+#define    JOURNAL_START ((long) superblock.journalStart)
+#define    JOURNAL_RING_START (JOURNAL_START + 1)
+#define    JOURNAL_RING_BLOCKS ((unsigned long) superblock.journalBlocks - 1)
+#define    JOURNAL_MAGIC 0x15501041
+#define    JOURNAL_TXN_MAGIC 0x15501042
+
+//A transaction commits on its own once it holds this much, so it always fits in the ring
+#define    JOURNAL_COMMIT_BYTES (JOURNAL_RING_BLOCKS * blockSize / 4)
+
+//Seconds between the commits made for changes nobody has asked to be synced, unless -o commit_interval says otherwise
+#define    DEFAULT_COMMIT_INTERVAL 5
+
+//Which file a journal record is for
+#define    JOURNAL_DISK 0
+#define    JOURNAL_DIRECTORIES 1
+
+//Readahead: once a file is being read sequentially, the blocks after each read are loaded into the block cache in
+//the background. The window starts at READAHEAD_MIN_BLOCKS, doubles on every read that readahead had already covered
+//and halves on every read it hadn't.
+#define    READAHEAD_MIN_BLOCKS 8
+#define    READAHEAD_MAX_BLOCKS 512
+#define    READAHEAD_QUEUE 64
+
+//Defragmentation: once no file has been read or written for DEFRAG_IDLE_MS, a background thread moves the data of
+//files that are in pieces, or that would fit in a free run lower down the disk, into one run of free blocks. It moves
+//DEFAULT_DEFRAG_RATE blocks a second at most unless -o defrag_rate says otherwise, and rests for DEFRAG_REST seconds
+//after going through every file without moving anything.
+#define    DEFAULT_DEFRAG_RATE 1024
+#define    DEFRAG_IDLE_MS 1000
+#define    DEFRAG_REST 30
+#define    DEFRAG_MAX_BLOCKS 4096 //bigger files stay where they are
+
+//Delayed allocation: the blocks of a file that are written for the first time are held in memory, and only get
+//blocks of .disk at flush, fsync or release, once the file has stopped growing, so they can all go in one run. A file
+//holds DELALLOC_MAX_BYTES at most, and all files together DELALLOC_TOTAL_BYTES; past that, blocks are placed early.
+#define    DELALLOC_MAX_BYTES (4 << 20)
+#define    DELALLOC_TOTAL_BYTES (64 << 20)
+#define    DELALLOC_BUCKETS 256
+
+//What delallocFlush() does besides placing the blocks a file holds: DELALLOC_GROW preallocates blocks after them if
+//they are at the end of the file, DELALLOC_TRIM gives back the blocks preallocated past its end
+#define    DELALLOC_GROW 1
+#define    DELALLOC_TRIM 2
+
+//Speculative preallocation: when the blocks a file holds are placed at its end while it is still being written, the
+//file is given as many blocks again past its end, so the blocks it grows into next are already there. Files under
+//PREALLOC_MIN_BYTES get none, and no file gets more than PREALLOC_MAX_BYTES at a time, nor more than a
+//PREALLOC_FREE_SHARE-th of the free blocks. What the file doesn't grow into is given back at release, or as soon as
+//somebody else needs the space.
+#define    PREALLOC_MIN_BYTES (64 << 10)
+#define    PREALLOC_MAX_BYTES (16 << 20)
+#define    PREALLOC_FREE_SHARE 16
+
+//What inodeBlockFor() is given as allocate to take blocks delallocReserve() set aside, rather than ones anybody may
+//have
+#define    ALLOCATE_RESERVED 2
+
+//Pending states in the free extent index
+#define    EXTENT_FREE 1
+#define    EXTENT_TAKEN 2
+
+//How much gets logged: 0 nothing, 1 errors, 2 mount and unmount info, 3 a trace record for every operation, 4 debug
+//messages as well. Build with -DCS1550_LOG_LEVEL=n to pick one; anything above the level compiles to nothing.
+#ifndef CS1550_LOG_LEVEL
+#ifdef NDEBUG
+#define    CS1550_LOG_LEVEL 1
+#else
+#define    CS1550_LOG_LEVEL 3
+#endif
+#endif
+
+#define    LOG_LEVEL_ERROR 1
+#define    LOG_LEVEL_INFO 2
+#define    LOG_LEVEL_TRACE 3
+#define    LOG_LEVEL_DEBUG 4
+
+//How many records the trace ring keeps (must be a power of two) and how much text each one holds
+#define    TRACE_RING_SIZE 4096
+#define    TRACE_TEXT 64
+
+#if CS1550_LOG_LEVEL >= LOG_LEVEL_ERROR
+#define    LOG_ERROR(...) logMessage(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define    LOG_ERROR(...) ((void) 0)
+#endif
+
+#if CS1550_LOG_LEVEL >= LOG_LEVEL_INFO
+#define    LOG_INFO(...) logMessage(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define    LOG_INFO(...) ((void) 0)
+#endif
+
+#if CS1550_LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define    LOG_DEBUG(...) logMessage(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define    LOG_DEBUG(...) ((void) 0)
+#endif
+
+//Every traced_* wrapper is TRACE_BEGIN(), the call, then TRACE_END(). The operation always gets counted in the stats;
+//whether it also goes into the trace ring depends on the log level.
+#define    TRACE_BEGIN() long long traceStart = traceNow()
+#define    TRACE_END(op, path, offset, size, result) opFinished(op, path, offset, size, result, traceStart)
+
+//The read-only file that shows the stats
+#define    STATS_PATH "/.stats"
+#define    STATS_TEXT_SIZE 32768
+
+//How many latency buckets each operation has. Bucket i counts latencies under 2^i nanoseconds.
+#define    STATS_BUCKETS 32
+
+//Counts an internal event, see enum cs1550_stat_event
+#define    STAT_ADD(event, n) __atomic_fetch_add(&statEvents[event], (unsigned long) (n), __ATOMIC_RELAXED)
 /* * * * * * * * * * * * * * *
 
             STRUCTS
 
  * * * * * * * * * * * * * * */
+//One record of .directories. A directory is its first record plus however many more with the same dname it has
+//grown, in the order they appear in the file.
 struct cs1550_directory_entry
 {
     char dname[MAX_FILENAME + 1]; //the directory name (plus space for a null)
-    int nFiles; //How many files are in this directory (needs to be less than MAX_FILES_IN_DIR)
+    int nFiles; //Slots from here on are unused (no more than FILES_PER_RECORD)
 
     struct cs1550_file_directory
     {
         char fname[MAX_FILENAME + 1];   //filename (plus space for nul)
         char fext[MAX_EXTENSION + 1];   //extension (plus space for nul)
         size_t fsize;                   //file size
-        long nStartBlock;               //where the first block is on disk
-    } files[MAX_FILES_IN_DIR];          //There is an array of these
+        long nStartBlock;               //where the file's inode is on disk, 0 if the slot is unused
+    } files[FILES_PER_RECORD];          //There is an array of these
 };
 
 typedef struct cs1550_directory_entry cs1550_directory_entry;
 
-struct cs1550_disk_block
+//Block 0 of .disk, written by mkfs. Everything is counted in blocks.
+struct cs1550_superblock
 {
-    //And all of the space in the block can be used for actual data
-    //storage.
-    char data[MAX_DATA_IN_BLOCK];
+    uint32_t magic;         //SUPERBLOCK_MAGIC
+    uint32_t version;       //SUPERBLOCK_VERSION
+    uint32_t blockSize;     //bytes, a power of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE
+    uint32_t reserved;
+    uint64_t blockCount;    //how many blocks .disk holds, this one included
+    uint64_t bitmapStart;   //the free block bitmap, one bit per block
+    uint64_t bitmapBlocks;
+    uint64_t journalStart;  //the journal's header block, followed by its ring
+    uint64_t journalBlocks; //header and ring together
+    uint64_t dataStart;     //the first block that can be given to a file; everything before it is taken
+    uint64_t freeBlocks;    //how many blocks are free, as of the last commit
+    uint64_t files;         //how many files there are, as of the last commit
 };
 
-typedef struct cs1550_disk_block cs1550_disk_block;
+typedef struct cs1550_superblock cs1550_superblock;
 
+//Every file has one inode, pointed to by nStartBlock in its directory entry. A pointer of 0 means the block hasn't been
+//allocated yet (block 0 holds the superblock or the bitmap so it can never belong to a file). The pointers fill the
+//rest of the block, unless the file is inline: then its data is there instead and it owns no other blocks. An
+//indirect block is nothing but pointers.
+struct cs1550_inode
+{
+    unsigned int magic;        //INODE_MAGIC
+    unsigned int flags;        //INODE_INLINE, INODE_PREALLOC, INODE_KEEP_SIZE (inodes from before flags have 0)
+    unsigned long nBlocks;     //how many blocks the file owns, not counting the inode
+    unsigned long pointers[];  //inodePointers of them: direct pointers, then the single and double indirect pointers
+};
 
+typedef struct cs1550_inode cs1550_inode;
 
-/* * * * * * * * * * * * * * *
+//A node of the free extent index. The index is a segment tree over the block numbers where every node
+//summarises the free runs inside its range, so runs that touch merge on their own when blocks are freed.
+struct cs1550_extent_node
+{
+    int prefix;  //free blocks at the start of the range
+    int suffix;  //free blocks at the end of the range
+    int longest; //longest free run anywhere in the range
+    char pending; //EXTENT_FREE/EXTENT_TAKEN still to be pushed to the children, or 0
+};
 
-      FUNCTION PROTOTYPES
+typedef struct cs1550_extent_node cs1550_extent_node;
 
-* * * * * * * * * * * * * * */
-int markFree(int);
-int markTaken(int);
-int blockStatus(int);
-void blockToByteTranslation(int, int *, int *);
-unsigned int getBitFromByte(char, int);
-int moveFileToMemory(void *, int);
-void removeFileFromMemory(int, int);
-int countFreeRun(int);
-int nextFreeRunFit(int);
-int getBlockSize(size_t);
-char getDir(const char *, cs1550_directory_entry *);
-void format(struct cs1550_file_directory *, int, int);
-/* * * * * * * * * * * * * * *
+//A run of blocks freed by a transaction that hasn't committed yet
+struct cs1550_free_run
+{
+    int start;
+    int count;
+};
 
-        HELPER FUNCTIONS
+typedef struct cs1550_free_run cs1550_free_run;
 
- * * * * * * * * * * * * * * */
+//An in-memory copy of one .directories record
+struct cs1550_dir_record
+{
+    cs1550_directory_entry entry; //the record exactly as it is on disk
+    long offset;                  //where the record lives in .directories
+    int dirty;                    //changed since the running journal transaction began
+    int sizesDirty;               //a file in it grew without dirty being set; see writeSizes()
+};
 
+typedef struct cs1550_dir_record cs1550_dir_record;
 
-// Given a block, mark said block as taken
-int markTaken(int blockNum)
+//An in-memory copy of one directory, kept for as long as the filesystem is mounted. Its files are numbered by slot:
+//slot i is file i % FILES_PER_RECORD of record i / FILES_PER_RECORD. Files never move, so a slot stays the file's until
+//it is removed.
+struct cs1550_cached_dir
 {
-    FILE *fp;
-    fp = fopen(".disk", "r+");
+    char dname[MAX_FILENAME + 1];
+    long offset;                  //where the directory's first record lives in .directories
+    cs1550_dir_record **records;  //every record of the directory, first one first
+    int recordCount;
+    int recordCapacity;
+    int *fileHash;                //open addressed table of slots (-1 == empty), keyed by file name
+    int fileHashSize;             //always a power of two
+    int fileCount;                //how many slots are in use
+    int *freeSlots;               //stack of unused slots, the lowest on top
+    int freeCount;
+    int *dirtyRecords;            //the records that have dirty set
+    int dirtyCount;
+    int *grownRecords;            //the records that have sizesDirty set
+    int grownCount;
+    pthread_rwlock_t lock;        //held for reading to look at the records, for writing to change them
+    unsigned long generation;     //bumped whenever a file is added or removed, which makes older lookups stale
+};
 
-    int byteToSeekTo;
-    int indexIntoByte;
+typedef struct cs1550_cached_dir cs1550_cached_dir;
 
-    blockToByteTranslation(blockNum, &byteToSeekTo, &indexIntoByte);
+//One slot of the lookup cache: what a path resolved to, and when
+struct cs1550_lookup
+{
+    char path[LOOKUP_PATH];   //"" if the slot is unused
+    cs1550_cached_dir *dir;   //the directory the path is in, or NULL if there is no such directory
+    int slot;                 //the file's slot in dir, LOOKUP_DIRECTORY for dir itself, or LOOKUP_MISSING
+    unsigned long generation; //dir->generation, or namespaceGeneration if dir is NULL, when the path was resolved
+};
 
-    char orMask = 0x80;
+typedef struct cs1550_lookup cs1550_lookup;
 
-    orMask = orMask >> indexIntoByte;
+//How an open file is being read, kept in its fuse_file_info's fh
+struct cs1550_readahead
+{
+    pthread_mutex_t lock;
+    off_t next;  //where the next read starts if the file is being read sequentially
+    long window; //how many blocks to read ahead
+    long end;    //the file block readahead has been asked to load up to (but not including), 0 if none
+};
 
-    char byteFromFile;
+typedef struct cs1550_readahead cs1550_readahead;
 
-    fseek(fp, byteToSeekTo, SEEK_SET);
-    fread(&byteFromFile, 1, 1, fp);
+//Blocks of a file for the readahead thread to load into the block cache
+struct cs1550_prefetch
+{
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    long inode; //the file's inode when the blocks were asked for, so they are skipped if it has gone since
+    long from;  //file blocks, from up to (but not including) to
+    long to;
+};
 
-    byteFromFile = byteFromFile | orMask;
+typedef struct cs1550_prefetch cs1550_prefetch;
 
-    fseek(fp, byteToSeekTo, SEEK_SET);
-    fwrite(&byteFromFile, 1, 1, fp);
+//The blocks of a file that have been written but have no blocks of .disk yet, which are always next to each other in
+//the file, and the blocks it was given past its end in case it kept growing. Everything but next is guarded by the
+//file's lock.
+struct cs1550_delalloc
+{
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    long inode;                   //the file's inode, which delallocTable is keyed by
+    long first;                   //the first block of the file held here
+    long count;                   //how many blocks are held
+    long capacity;                //how many blocks data has room for
+    long reserved;                //how many blocks of reservedBlocks are set aside for this file
+    long preallocFirst;           //file blocks from here up to preallocEnd were preallocated past the end of the
+    long preallocEnd;             //file, and it hasn't grown into them yet
+    char *data;                   //count blocks, one after the other
+    struct cs1550_delalloc *next; //chain of files in the same bucket of delallocTable
+};
 
-    fclose(fp);
+typedef struct cs1550_delalloc cs1550_delalloc;
 
-    return 0;
-}
+//One block of .disk held in the block cache
+struct cs1550_cache_block
+{
+    long block;                         //which block of .disk this is, or -1 if the slot is unused
+    int dirty;                          //does data differ from what is on disk?
+    struct cs1550_cache_block *prev;    //LRU list, most recently used first
+    struct cs1550_cache_block *next;
+    struct cs1550_cache_block *hashNext; //chain of blocks in the same hash bucket
+    unsigned long journalTid;           //metadata waiting for this journal transaction to commit, or 0
+    int extra;                          //allocated because every slot was pinned by the journal
+    int prefetched;                     //loaded by readahead and not read since
+    char *data;                         //blockSize bytes
+};
 
+typedef struct cs1550_cache_block cs1550_cache_block;
 
-// Given a block, marks said block as free
-int markFree(int blockNum)
+//The block cache is split into shards, each with its own lock and LRU list, so threads working on different blocks
+//don't wait for each other.
+struct cs1550_cache_shard
 {
-    FILE *fp;
-    fp = fopen(".disk", "r+");
+    pthread_mutex_t lock;
+    cs1550_cache_block *blocks;   //every slot of this shard
+    char *data;                   //the slots' data, blockSize bytes each
+    cs1550_cache_block **buckets; //hash table of cached blocks keyed by block number
+    int bucketCount;              //always a power of two
+    cs1550_cache_block *head;     //most recently used block
+    cs1550_cache_block *tail;     //least recently used block, the next one to be evicted
+    unsigned long hits;
+    unsigned long misses;
+};
 
-    int byteToSeekTo;
-    int indexIntoByte;
+typedef struct cs1550_cache_shard cs1550_cache_shard;
 
-    blockToByteTranslation(blockNum, &byteToSeekTo, &indexIntoByte);
+//The first block of the journal. Replay starts at tail.
+struct cs1550_journal_header
+{
+    unsigned int magic;    //JOURNAL_MAGIC
+    unsigned long tail;    //block of the ring holding the oldest transaction that may not be in place yet
+    unsigned long tailSeq; //the sequence number that transaction has
+};
 
-    char byteFromFile;
+typedef struct cs1550_journal_header cs1550_journal_header;
 
-    fseek(fp, byteToSeekTo, SEEK_SET);
-    fread(&byteFromFile, 1, 1, fp);
-    unsigned char orMask = 0x80;
+//Starts every transaction in the ring. The records follow straight after it.
+struct cs1550_journal_txn
+{
+    unsigned int magic;    //JOURNAL_TXN_MAGIC
+    unsigned int checksum; //CRC-32 of the whole transaction, taken with this field set to 0
+    unsigned long seq;     //one more than the transaction before it
+    unsigned long nBlocks; //how much of the ring the transaction takes up
+    unsigned long length;  //bytes, this header included
+};
 
-    orMask = orMask >> indexIntoByte;
+typedef struct cs1550_journal_txn cs1550_journal_txn;
 
-    orMask = ~orMask;
+//One change inside a transaction: length bytes that go at offset of .disk or .directories
+struct cs1550_journal_record
+{
+    int target; //JOURNAL_DISK or JOURNAL_DIRECTORIES
+    int length;
+    long offset;
+};
 
-    byteFromFile = byteFromFile&orMask;
+typedef struct cs1550_journal_record cs1550_journal_record;
 
-    fseek(fp, byteToSeekTo, SEEK_SET);
-    fwrite(&byteFromFile, 1, 1, fp);
+//A transaction being put together in memory, starting with its cs1550_journal_txn
+struct cs1550_journal_buffer
+{
+    char *data;
+    size_t length;
+    size_t capacity;
+};
 
-    fclose(fp);
+typedef struct cs1550_journal_buffer cs1550_journal_buffer;
 
-    return 0;
-}
+//Options given on the command line with -o
+struct cs1550_options
+{
+    int mmap;        //map .disk into memory instead of using pread/pwrite on it
+    int cacheBlocks; //how many blocks the block cache may hold
+    char *traceFile; //where to dump the trace ring at unmount or on SIGUSR1, stderr if not given
+    int commitInterval; //seconds between checkpoint commits
+    int defragRate;     //blocks per second the defragmenter may move
+    int noDefrag;       //don't start the defragmenter at all
+};
 
+//What a trace record describes
+enum cs1550_trace_op
+{
+    OP_MESSAGE, //a LOG_* message rather than an operation; result holds the level
+    OP_GETATTR,
+    OP_READDIR,
+    OP_MKDIR,
+    OP_RMDIR,
+    OP_MKNOD,
+    OP_UNLINK,
+    OP_READ,
+    OP_WRITE,
+    OP_TRUNCATE,
+    OP_OPEN,
+    OP_FLUSH,
+    OP_FSYNC,
+    OP_RELEASE,
+    OP_STATFS,
+    OP_FALLOCATE,
+    OP_COUNT
+};
 
-// Determines if the given block is free or taken
-int blockStatus(int blockNum)
+//Things that happen inside the filesystem that are worth counting
+enum cs1550_stat_event
 {
-    FILE *fp;
-    fp = fopen(".disk", "r+");
+    STAT_BITMAP_LOOKUPS,      //free block searches and single block checks
+    STAT_DIR_LOOKUPS,         //directories looked up by name
+    STAT_DIR_SCANS,           //directories searched for a file
+    STAT_DIR_ENTRIES_SCANNED, //file entries compared during those searches
+    STAT_DIR_WRITES,          //directory records written back
+    STAT_BLOCKS_ALLOCATED,    //blocks a file grew by, index blocks included
+    STAT_BLOCKS_FREED,
+    STAT_BYTES_COPIED,        //bytes copied into or out of the block cache
+    STAT_BYTES_SPLICED,       //file data handed over as ranges of .disk instead of being copied
+    STAT_READAHEAD_BLOCKS,    //blocks readahead loaded into the block cache
+    STAT_READAHEAD_HITS,      //of those, blocks that were read before being evicted
+    STAT_READAHEAD_WASTED,    //and blocks that were evicted without being read
+    STAT_LOOKUP_HITS,         //paths the lookup cache resolved on its own
+    STAT_LOOKUP_MISSES,
+    STAT_DEFRAG_FILES,        //files the defragmenter moved
+    STAT_DEFRAG_BLOCKS,       //and the blocks it moved for them
+    STAT_DELALLOC_BLOCKS,     //blocks held back from .disk until flush, and then placed
+    STAT_DELALLOC_RUNS,       //runs of free blocks they were placed in
+    STAT_PREALLOC_BLOCKS,     //blocks preallocated past the end of growing files
+    STAT_PREALLOC_TRIMMED,    //of those, blocks given back because the file never grew into them
+    STAT_EVENT_COUNT
+};
 
-    int byteToSeekTo;
-    int indexIntoByte;
+//Counters for one kind of operation. They are bumped with relaxed atomics, so a reader may see one a moment before
+//another.
+struct cs1550_op_stats
+{
+    unsigned long calls;
+    unsigned long errors;                   //calls that returned a negative errno
+    unsigned long bytes;                    //read or written
+    unsigned long latency;                  //total nanoseconds
+    unsigned long histogram[STATS_BUCKETS]; //latencies, see STATS_BUCKETS
+};
 
-    blockToByteTranslation(blockNum, &byteToSeekTo, &indexIntoByte);
+typedef struct cs1550_op_stats cs1550_op_stats;
 
-    char byteFromFile;
+//What open hands to read for /.stats, so one reader sees a single snapshot however many reads it takes
+struct cs1550_stats_snapshot
+{
+    size_t length;
+    char text[STATS_TEXT_SIZE];
+};
 
-    fseek(fp, byteToSeekTo, SEEK_SET);
-    fread(&byteFromFile, 1, 1, fp);
+typedef struct cs1550_stats_snapshot cs1550_stats_snapshot;
 
-    int bit = getBitFromByte(byteFromFile, indexIntoByte);
+//One entry of the trace ring. seq is written last, so a reader that sees the same non-zero seq before and after
+//copying the record knows it got all of it.
+struct cs1550_trace_record
+{
+    unsigned long seq;     //position in the ring plus one, 0 while being written
+    long long time;        //nanoseconds since mount
+    long long latency;     //how long the operation took, in nanoseconds
+    long long offset;
+    long long size;
+    int op;                //enum cs1550_trace_op
+    int result;            //what the operation returned
+    char text[TRACE_TEXT]; //the path, or the message
+};
 
-    fclose(fp);
+typedef struct cs1550_trace_record cs1550_trace_record;
 
-    return bit;
-}
 
+/* * * * * * * * * * * * * * *
 
-// Given a block number will return which byte that block can be found at in our file (and the index into our byte)
-void blockToByteTranslation(int blockNum, int *byteIndex, int *indexIntoByte)
-{
-    int i = 0;
-    int byte = 0;
-    int offset = 0;
+            GLOBALS
 
-    for(i = 0; i < blockNum; i++)
-    {
-        if(offset == 7)
-        {
-            byte++;
-            offset = 0;
-        }
-        else offset++;
-    }
+ * * * * * * * * * * * * * * */
+static cs1550_superblock superblock; //how .disk is laid out, read at mount
+static int blockSize;                //superblock.blockSize
+static int blockCount;               //superblock.blockCount
+static int inodePointers;            //how many pointers fit in an inode
+static int indexPointers;            //how many pointers fit in an indirect block
+static uint64_t *bitmap;             //the free block bitmap, loaded at mount (bit set == block taken)
+static unsigned char *bitmapDirty;   //which on-disk bitmap blocks need to be written back
+static cs1550_extent_node *extentTree; //free extent index, rebuilt from the bitmap at mount
+static long freeBlocks;              //how many bits of the bitmap are clear, kept up to date by markRun()
+static long reservedBlocks;          //of those, how many are set aside for blocks files hold; guarded by allocLock
+static cs1550_free_run *freeingRuns; //blocks the running transaction freed, still taken until it commits
+static int freeingCount;             //how many of freeingRuns are in use; guarded by allocLock, like freeingRuns
+static int freeingCapacity;
+static long freeingBlocks;           //how many blocks wait in freeingRuns and committingRuns together
+static long fileTotal;               //how many files all the directories hold, changed atomically
+static cs1550_cached_dir **dirCache; //every directory, in the order their first records appear in .directories
+static int dirCount;                 //how many of dirCache are in use
+static int dirCapacity;              //how many dirCache has room for
+static int *dirHash;                 //open addressed table of indexes into dirCache (-1 == empty), keyed by name
+static int dirHashSize;              //always a power of two
+static pthread_rwlock_t namespaceLock = PTHREAD_RWLOCK_INITIALIZER; //guards dirCache, dirHash and dirCount themselves
+static pthread_mutex_t allocLock = PTHREAD_MUTEX_INITIALIZER;       //guards the bitmap and the free extent index
+static pthread_rwlock_t fileLocks[FILE_LOCK_STRIPES];               //held while a file's data is read or written
+static unsigned long namespaceGeneration; //bumped by every mkdir, which makes lookups of missing directories stale
+static cs1550_lookup lookupCache[LOOKUP_CACHE_SIZE];
+static pthread_mutex_t lookupLocks[LOOKUP_STRIPES]; //lookupCache slot i is guarded by lookupLocks[i % LOOKUP_STRIPES]
+static struct cs1550_options options;
+static char diskPath[PATH_MAX] = ".disk";
+static char directoriesPath[PATH_MAX] = ".directories";
+static int diskFd = -1;              //.disk, open for as long as we are mounted
+static int directoriesFd = -1;       //.directories, open for as long as we are mounted
+static off_t directoriesSize;        //where the next directory record gets appended
+static char *diskMap;                //all of .disk when mounted with -o mmap, otherwise NULL
+static off_t diskSize;
+static cs1550_cache_shard cacheShards[CACHE_SHARDS];
+static pthread_mutex_t journalLock = PTHREAD_MUTEX_INITIALIZER;  //guards journalUpdates, journalFrozen and journalTid
+static pthread_cond_t journalCond = PTHREAD_COND_INITIALIZER;    //signalled when either of them changes
+static int journalUpdates;           //operations inside journalBegin()/journalEnd()
+static int journalFrozen;            //set while a commit copies the running transaction
+static unsigned long journalTid = 1; //the running transaction, which every metadata change goes into
+static unsigned long journalPending; //roughly how many bytes the running transaction holds
+static pthread_mutex_t commitLock = PTHREAD_MUTEX_INITIALIZER;   //one commit at a time; guards everything below
+static unsigned long committedTid;   //the last transaction that is safely on disk
+static cs1550_free_run *committingRuns; //the freeingRuns of the transaction being committed
+static int committingCount;
+static cs1550_journal_buffer journalRetry; //a transaction that couldn't be committed, to be tried again first
+static unsigned long journalRetryTid;      //its id, or 0 if there is none
+static pthread_mutex_t spliceLock = PTHREAD_MUTEX_INITIALIZER; //guards spliceEpoch and spliceReplies
+static pthread_cond_t spliceCond = PTHREAD_COND_INITIALIZER;   //signalled when the last reply of an epoch is sent
+static int spliceEpoch;              //replies that start now count against spliceReplies[spliceEpoch]
+static long spliceReplies[2];        //read replies on their way that may point at blocks of .disk
+static __thread int splicePin = -1;  //the epoch this thread's reply counts against, or -1 if it has none
+static unsigned long journalHead;    //ring blocks ever written
+static unsigned long journalTail;    //ring blocks ever released; the ring holds journalHead - journalTail of them
+static unsigned long journalSeq;     //sequence number of the next transaction
+static unsigned long journalTailSeq; //sequence number of the transaction at journalTail
+static int mountLoaded;              //did the mount get as far as replaying the journal and loading everything?
+static pthread_t checkpointThread;   //commits every options.commitInterval seconds
+static pthread_mutex_t checkpointLock = PTHREAD_MUTEX_INITIALIZER; //guards checkpointStop
+static pthread_cond_t checkpointCond = PTHREAD_COND_INITIALIZER;   //signalled to stop the checkpoint thread
+static int checkpointStop;
+static int checkpointRunning;        //was the checkpoint thread started?
+static pthread_t readaheadThread;    //loads the blocks readaheadNote() asks for
+static pthread_mutex_t readaheadLock = PTHREAD_MUTEX_INITIALIZER; //guards readaheadQueue and everything below it
+static pthread_cond_t readaheadCond = PTHREAD_COND_INITIALIZER;   //signalled when there is work or it's time to stop
+static cs1550_prefetch readaheadQueue[READAHEAD_QUEUE];
+static int readaheadHead;            //the oldest request in readaheadQueue
+static int readaheadCount;           //how many requests readaheadQueue holds
+static int readaheadStop = 1;        //also keeps requests out while the thread isn't running
+static int readaheadRunning;         //was the readahead thread started?
+static long long lastActivity;       //traceNow() of the last read or write of a file
+static pthread_t defragThread;       //moves files into one piece while nothing else is going on
+static pthread_mutex_t defragLock = PTHREAD_MUTEX_INITIALIZER; //goes with defragCond
+static pthread_cond_t defragCond = PTHREAD_COND_INITIALIZER;   //signalled to stop the defrag thread
+static int defragStop;
+static int defragRunning;            //was the defrag thread started?
+static int defragNextDir;            //where in .directories the defrag thread is; only it touches these two
+static int defragNextFile;
+static unsigned long defragSeen;     //files in pieces found so far this pass
+static unsigned long defragFragmented; //files in pieces found by the last full pass
+static cs1550_delalloc *delallocTable[DELALLOC_BUCKETS]; //every file holding blocks, hashed by inode
+static pthread_mutex_t delallocLock = PTHREAD_MUTEX_INITIALIZER; //guards delallocTable and the next links
+static long delallocBytes;           //how much all files hold together, changed atomically
+static long preallocBlocks;          //how many blocks are preallocated past the end of files, changed atomically
+static cs1550_op_stats opStats[OP_COUNT];
+static unsigned long statEvents[STAT_EVENT_COUNT];
+#if CS1550_LOG_LEVEL > 0
+static cs1550_trace_record traceRing[TRACE_RING_SIZE];
+static unsigned long traceHead;                       //how many records have ever been claimed
+static long long traceEpoch;                          //traceNow() at mount
+static volatile sig_atomic_t traceDumpRequested;      //set by SIGUSR1
+#endif
 
-    *byteIndex = byte;
-    *indexIntoByte = offset;
-}
 
 
-// Return a specific bit from a given byte.
-unsigned int getBitFromByte(char byte, int indexInByte) // NOTE: index left to right
-{
-    byte = byte << indexInByte;
-    unsigned char mask = 0x80;
+/* * * * * * * * * * * * * * *
 
-    unsigned int bit = mask & byte;
+      FUNCTION PROTOTYPES
 
-    if(bit == 128) return 1;
-    else return 0;
-}
+* * * * * * * * * * * * * * */
+void logMessage(int, const char *, ...) __attribute__((format(printf, 2, 3)));
+long long traceNow(void);
+void traceOp(int, const char *, long long, long long, int, long long);
+void traceDump(FILE *);
+void traceDumpIfRequested(void);
+void statsRecord(int, int, long long);
+int statsRender(char *, size_t);
+int storageOpen(void);
+void storageClose(void);
+int storageSync(void);
+int diskRead(void *, size_t, off_t);
+int diskWrite(const void *, size_t, off_t);
+int diskZero(size_t, off_t);
+int directoriesRead(void *, size_t, off_t);
+int directoriesWrite(const void *, size_t, off_t);
+int superblockLayout(cs1550_superblock *, int, uint64_t, uint64_t);
+int superblockLoad(void);
+int makeFilesystem(int, const cs1550_superblock *);
+int cacheInit(int);
+void cacheDestroy(void);
+int cacheRead(void *, size_t, off_t);
+int cacheWrite(const void *, size_t, off_t);
+int cacheFlush(void);
+int cacheWriteMeta(const void *, size_t, off_t);
+int cacheJournal(unsigned long, cs1550_journal_buffer *);
+void cacheUnpin(long, unsigned long, const char *);
+int cacheHolds(long);
+int cacheDiscard(long, long);
+void cachePrefetch(long);
+int journalAppend(cs1550_journal_buffer *, int, off_t, const void *, size_t);
+void journalAddPending(unsigned long);
+unsigned long journalRunningTid(void);
+void journalBegin(void);
+void journalEnd(void);
+int journalCommit(void);
+int journalSync(void);
+int journalReplay(void);
+int journalClose(void);
+int checkpointStart(void);
+void checkpointEnd(void);
+cs1550_readahead *readaheadOpen(void);
+void readaheadClose(cs1550_readahead *);
+void readaheadNote(cs1550_readahead *, const char *, const char *, long, size_t, off_t, size_t);
+int readaheadStart(void);
+void readaheadEnd(void);
+void noteActivity(void);
+int defragStart(void);
+void defragEnd(void);
+void cacheCounters(unsigned long *, unsigned long *);
+int markFree(int);
+int markTaken(int);
+void markRun(int, int, int);
+int blockStatus(int);
+void blockToByteTranslation(int, int *, int *);
+int nextBlockWithStatus(int, int);
+int loadBitmap(void);
+void unloadBitmap(void);
+int bitmapBlockBytes(int, unsigned char *);
+void freeingShow(int);
+void freeingHandOver(void);
+void freeingRelease(int);
+void spliceBegin(void);
+void spliceEnd(void);
+int moveFileToMemory(void *, int);
+void removeFileFromMemory(int, int);
+int allocateBlockNear(long, int);
+int allocateRun(long, long *);
+long inodeCreate(void);
+int inodeValid(long);
+int inodeInline(long);
+int inodeFlags(long);
+int inodeMark(long, unsigned int, unsigned int);
+long inodeBlockFor(long, long, int);
+int inodeSetBlock(long, long, long);
+int inodeAllocate(long, long, long, long *);
+int inodeZeroTail(long, size_t);
+long inodeFreeRange(long, long, long);
+void inodeFree(long);
+int inodeRead(long, char *, size_t, off_t);
+int inodeReadBuf(long, size_t, off_t, struct fuse_bufvec **);
+int inodeWrite(long, cs1550_delalloc *, struct fuse_bufvec *, size_t, off_t);
+cs1550_delalloc *delallocFind(long);
+cs1550_delalloc *delallocGet(const char *, const char *, long);
+void delallocPut(cs1550_delalloc *);
+void delallocDrop(long);
+int delallocHold(cs1550_delalloc *, long, int, const char *, size_t);
+void delallocRead(const cs1550_delalloc *, long, int, char *, size_t);
+void delallocTruncate(cs1550_delalloc *, size_t);
+int delallocPlace(cs1550_delalloc *, int);
+int delallocFlush(const char *, int);
+void preallocGrow(cs1550_delalloc *, long);
+void preallocKeep(cs1550_delalloc *, long, long);
+long preallocTrim(cs1550_delalloc *);
+long preallocReclaim(void);
+long preallocRecover(long, size_t);
+void makeRoom(size_t);
+int nextFreeRunFit(int);
+int largestFreeRun(void);
+unsigned long freeRunCount(void);
+void extentIndexBuild(int, int, int);
+void extentIndexSet(int, int, int, int, int, int);
+int extentIndexFirstFit(int, int, int, int);
+int getBlockSize(size_t);
+int getFile(const char *, const char *, struct cs1550_file_directory *);
+unsigned int hashName(const char *);
+int findDir(const char *);
+cs1550_cached_dir *lockDir(const char *, int);
+void unlockDir(cs1550_cached_dir *);
+struct cs1550_file_directory *dirFile(const cs1550_cached_dir *, int);
+int findFile(const cs1550_cached_dir *, const char *);
+pthread_rwlock_t *fileLock(const char *, const char *);
+int addDir(const char *);
+int writeDir(cs1550_cached_dir *, int);
+void writeSizes(cs1550_cached_dir *);
+void writeBackSizes(const char *);
+int loadDirectories(void);
+int makeFile(const char *, const char *, const char *);
+int removeFile(const char *, const char *);
+int readFile(const char *, char *, struct fuse_bufvec **, size_t, off_t, cs1550_readahead *);
+int writeToFile(const char *, const char *, struct fuse_bufvec *, size_t, off_t);
+void growFile(const char *, const char *, size_t);
+void shrinkFile(const char *, const char *, size_t);
+int truncateFile(const char *, const char *, off_t);
+int allocateToFile(const char *, const char *, int, off_t, off_t);
+int parsePath(const char *, char *, char *, char *);
+int resolvePath(const char *, cs1550_cached_dir **, int *, size_t *);
+int mountFilesystem(void);
+void unmountFilesystem(void);
+void locateBackingFiles(void);
+/* * * * * * * * * * * * * * *
+
+            LOGGING
+
+ * * * * * * * * * * * * * * */
 
 
-// Given a block will return how many consecutive free blocks can be found after this block.
-int countFreeRun(int blockNum)
+// Nanoseconds on a clock that never jumps
+long long traceNow(void)
 {
-    if(blockStatus(blockNum) == 1) return -1;
-    if(blockNum <= SIZE_OF_BITMAP) return -1; // Don't allow allocation over our bitmap.
+    struct timespec ts;
 
-    int i;
-    int freeBlocksSoFar = 0;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    for(i = blockNum; i < NUM_OF_BLOCKS; i++)
-    {
-        if(blockStatus(i) == 0) freeBlocksSoFar++;
-        else return freeBlocksSoFar;
-    }
-    return freeBlocksSoFar;
+    return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
 }
 
 
-// Detects the next sequence of blocks that a file of the given size can fit in, then returns the first block number in that run.
-int nextFreeRunFit(int sizeOfTargetRun)
+static const char *opNames[OP_COUNT] = {
+        "message", "getattr", "readdir", "mkdir", "rmdir", "mknod", "unlink",
+        "read", "write", "truncate", "open", "flush", "fsync", "release", "statfs",
+        "fallocate"
+};
+
+#if CS1550_LOG_LEVEL > 0
+
+
+// Claims the next slot of the ring. Writers never wait for each other: each one takes its own slot with one atomic
+// add, and a writer that laps a slow one only costs the reader that record.
+static cs1550_trace_record *traceClaim(unsigned long *seq)
 {
-    int i;
+    unsigned long slot = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+    cs1550_trace_record *rec = &traceRing[slot & (TRACE_RING_SIZE - 1)];
 
-    for(i = SIZE_OF_BITMAP; i < NUM_OF_BLOCKS; i++)
-    {
-        if(countFreeRun(i) >= sizeOfTargetRun) return i;
-    }
+    __atomic_store_n(&rec->seq, 0, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
 
-    return -1;
+    *seq = slot + 1;
+    return rec;
 }
 
 
-// Given a file, will move said file into memory and mark the bitmap appropriately. Returns startblock.
-int moveFileToMemory(void * data, int size)
+// Makes a claimed record visible to traceDump
+static void tracePublish(cs1550_trace_record *rec, unsigned long seq)
 {
-    int tempSize = size;
-    int blockCount = 0;
+    __atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+}
 
-    while(tempSize > 0)
-    {
-        tempSize = tempSize - BLOCK_SIZE;
-        blockCount++;
-    }
 
-    int startBlock = nextFreeRunFit(blockCount);
+// Copies as much of text as fits into the record
+static void traceText(cs1550_trace_record *rec, const char *text)
+{
+    size_t length = strnlen(text, TRACE_TEXT - 1);
 
-    if(startBlock == -1)
-    {
-        printf("No more space left!!!\n");
-        return -1;
-    }
+    memcpy(rec->text, text, length);
+    rec->text[length] = '\0';
+}
 
-    int offsetInBytes = startBlock * BLOCK_SIZE;
 
-    FILE *fp;
+// Backs LOG_ERROR, LOG_INFO and LOG_DEBUG. Every message goes into the ring; errors and info also go to stderr.
+void logMessage(int level, const char *fmt, ...)
+{
+    char message[256];
+    va_list ap;
 
-    fp = fopen(".disk", "r+");
+    va_start(ap, fmt);
+    vsnprintf(message, sizeof(message), fmt, ap);
+    va_end(ap);
 
-    fseek(fp, offsetInBytes, SEEK_SET);
-    if(data != 0)
-    {
-        printf("Writing data to .disk\n");
-        fwrite(data, 1, size, fp);
-    }
-    fclose(fp);
+    if(level <= LOG_LEVEL_INFO) fprintf(stderr, "cs1550: %s\n", message);
 
-    int i;
+    unsigned long seq;
+    cs1550_trace_record *rec = traceClaim(&seq);
 
-    for(i = startBlock; i < startBlock + blockCount; i++)
-    {
-        markTaken(i);
-    }
+    rec->time = traceNow() - traceEpoch;
+    rec->latency = 0;
+    rec->offset = 0;
+    rec->size = 0;
+    rec->op = OP_MESSAGE;
+    rec->result = level;
+    traceText(rec, message);
 
-    return startBlock;
+    tracePublish(rec, seq);
 }
 
 
-// Marks a given region in memory as free
-void removeFileFromMemory(int startBlockNum, int blockCount)
+// Records one finished operation. start is what TRACE_BEGIN() got from traceNow().
+void traceOp(int op, const char *path, long long offset, long long size, int result, long long start)
 {
-    int i;
-
-    for(i = startBlockNum; i < startBlockNum + blockCount; i++)
-    {
-        markFree(i);
-    }
+    long long now = traceNow();
+    unsigned long seq;
+    cs1550_trace_record *rec = traceClaim(&seq);
+
+    rec->time = start - traceEpoch;
+    rec->latency = now - start;
+    rec->offset = offset;
+    rec->size = size;
+    rec->op = op;
+    rec->result = result;
+    traceText(rec, path != NULL ? path : "");
+
+    tracePublish(rec, seq);
 }
 
 
-// Give a path, returns that path's directory.
-char getDir(const char *path, cs1550_directory_entry *d)
+// Writes out whatever the ring still holds, oldest first, one line per record. Records that are being written while
+// we look at them are skipped rather than waited for.
+void traceDump(FILE *out)
 {
-    printf("===============GET DIR START=====================\n");
-    FILE * fp;
-    fp = fopen (".directories", "r");
+    unsigned long head = __atomic_load_n(&traceHead, __ATOMIC_ACQUIRE);
+    unsigned long i = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
 
-    if(fp != NULL)
+    fprintf(out, "# seq time_us op path/message offset size result latency_us\n");
+
+    for(; i < head; i++)
     {
-        cs1550_directory_entry ret;
-        while(fread(&ret, 1, sizeof(cs1550_directory_entry), fp) != 0)
+        cs1550_trace_record *slot = &traceRing[i & (TRACE_RING_SIZE - 1)];
+        cs1550_trace_record rec;
+
+        if(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != i + 1) continue;
+        memcpy(&rec, slot, sizeof(rec));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if(__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != i + 1) continue;
+
+        rec.text[TRACE_TEXT - 1] = '\0';
+
+        if(rec.op == OP_MESSAGE)
         {
-            if(strcmp(path, ret.dname) == 0)
-            { // If you've found a directory with a name that matches the one passed in.
-                *d = ret;
-                printf("===============GET DIR END=====================\n");
-                return 1;
-            }
+            fprintf(out, "%lu %lld log%d %s\n", rec.seq, rec.time / 1000, rec.result, rec.text);
+        }
+        else
+        {
+            fprintf(out, "%lu %lld %s %s %lld %lld %d %lld\n", rec.seq, rec.time / 1000,
+                    rec.op >= 0 && rec.op < OP_COUNT ? opNames[rec.op] : "?", rec.text, rec.offset, rec.size,
+                    rec.result, rec.latency / 1000);
         }
     }
 
-    printf("Sorry, we couldn't find your file.\n");
-    printf("===============GET DIR END=====================\n");
-
-    return 0;
+    fflush(out);
 }
 
 
-// find out how many blocks you'll need to store a file of a given size.
-int getBlockSize(size_t fsize)
+// Dumps the ring to -o trace_file, or to stderr when there isn't one
+static void traceDumpToFile(void)
 {
-    if(fsize == 0) return 1;
-    else
-    {
-        int blockSize = fsize / BLOCK_SIZE;
-        int remainder = fsize % BLOCK_SIZE;
+    FILE *out = options.traceFile != NULL ? fopen(options.traceFile, "a") : NULL;
 
-        if(remainder != 0) blockSize++;
+    traceDump(out != NULL ? out : stderr);
 
-        return blockSize;
-    }
+    if(out != NULL) fclose(out);
 }
 
 
-// Will remove a specified file from the directory and then realign the files so that there are no gaps
-void format(struct cs1550_file_directory *a, int size, int indexToDelete)
+// The dump itself can't happen inside the signal handler, so the handler only raises a flag and the next operation
+// to finish does the work.
+void traceDumpIfRequested(void)
 {
-    int i = 0;
-    for(i = indexToDelete; i < size - 1; i++)
+    if(traceDumpRequested && __atomic_exchange_n(&traceDumpRequested, 0, __ATOMIC_ACQ_REL))
     {
-        a[i] = a[i+1];
+        traceDumpToFile();
     }
 }
 
 
+static void traceSignal(int sig)
+{
+    (void) sig;
 
-/* * * * * * * * * * * * * * *
-
-     FILESYSTEM FUNCTIONS
-
- * * * * * * * * * * * * * * */
-
+    traceDumpRequested = 1;
+}
 
 
-static int cs1550_getattr(const char *path, struct stat *stbuf)
+// Called at mount: starts the clock and lets SIGUSR1 ask for a dump
+static void traceInit(void)
 {
-    int res = 0;
+    struct sigaction sa;
 
-    printf("==========GETATTR START==========\n");
-    printf("%s\n", path);
-    //printf("PATH: %s\n", path);
+    traceEpoch = traceNow();
 
-    memset(stbuf, 0, sizeof(struct stat));
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = traceSignal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+}
 
-    //is path the root dir?
-    if (strcmp(path, "/") == 0)
-    {
-        printf("FOUND ROOT\n");
-        //Check if name is subdirectory
-        stbuf->st_mode = S_IFDIR | 0755;
-        stbuf->st_nlink = 2;
-        res = 0;
-    }
-    else
-    {
-        char directory[MAX_FILENAME + 1] = {0};
-        char filename[MAX_FILENAME + 1] = {0};
-        char extension[MAX_EXTENSION] = {0};
+#endif
 
-        sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
 
-        printf("Directory: %s\n", directory);
-        printf("File Name: %s\n", filename);
-        printf("Extension: %s\n", extension);
 
-        if(strcmp(filename, "")) // If the filename isn't empty
-        {
-            printf("fIlE sTuFf\n");
+/* * * * * * * * * * * * * * *
 
-            cs1550_directory_entry targetDir;
-            if(getDir(directory, &targetDir))
-            {
-                int i;
-                for(i = 0; i < targetDir.nFiles; i++)
-                {
-                    if(!strcmp(filename, targetDir.files[i].fname))
-                    {
-                        //regular file, probably want to be read and write
-                        stbuf->st_mode = S_IFREG | 0666;
-                        stbuf->st_nlink = 1; //file links
-                        stbuf->st_size = targetDir.files[i].fsize;
-                        printf("==========GETATTR END==========\n");
-                        return 0;
-                    }
-                }
-                printf("==========GETATTR END (FAIL 1)==========\n");
-                return -ENOENT;
-            }
-        }
+             STATS
 
-        if(strcmp(directory, ""))
-        {
-            printf("GETTING DIRECTORY\n");
-            cs1550_directory_entry targetDir;
-            if(getDir(directory, &targetDir))
-            { // If the file could be found...
-                printf("Found Directory. Name is %s\n", directory);
-                stbuf->st_mode = S_IFDIR | 0755;
-                stbuf->st_nlink = 2;
-                res = 0; // no error
-            }
-            else
-            { // If the file could NOT be found...
-                printf("%s could not be found \n", directory);
-                printf("==========GETATTR END (FAIL 1)==========\n");
-                return -ENOENT;
-            }
-        }
-    }
-    printf("==========GETATTR END==========\n");
-    return res;
-}
+ * * * * * * * * * * * * * * */
 
+static const char *statEventNames[STAT_EVENT_COUNT] = {
+        "bitmap_lookups", "dir_lookups", "dir_scans", "dir_entries_scanned", "dir_writes",
+        "blocks_allocated", "blocks_freed", "bytes_copied", "bytes_spliced", "readahead_blocks",
+        "readahead_hits", "readahead_wasted", "lookup_hits", "lookup_misses", "defrag_files", "defrag_blocks",
+        "delalloc_blocks", "delalloc_runs", "prealloc_blocks", "prealloc_trimmed"
+};
 
-/* 
- * Called whenever the contents of a directory are desired. Could be from an 'ls'
- * or could even be when a user hits TAB to do autocompletion
- */
-static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+
+// Counts one finished operation. result is what it returned to FUSE.
+void statsRecord(int op, int result, long long latency)
 {
-    (void) offset;
-    (void) fi;
+    cs1550_op_stats *stats = &opStats[op];
+    int bucket = 0;
 
-    printf("===================================== READDIR START =====================================\n");
+    if(latency < 0) latency = 0;
+    if(latency > 0) bucket = 64 - __builtin_clzll((unsigned long long) latency);
+    if(bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
 
-    char directory[MAX_FILENAME + 1] = {0};
-    char filename[MAX_FILENAME + 1] = {0};
-    char extension[MAX_EXTENSION] = {0};
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->latency, (unsigned long) latency, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->histogram[bucket], 1, __ATOMIC_RELAXED);
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+    if(result < 0) __atomic_fetch_add(&stats->errors, 1, __ATOMIC_RELAXED);
+    else if(op == OP_READ || op == OP_WRITE) __atomic_fetch_add(&stats->bytes, (unsigned long) result, __ATOMIC_RELAXED);
+}
 
-    printf("Reading from Directory: %s\n", directory);
 
-    filler(buf, ".", NULL, 0);
-    filler(buf, "..", NULL, 0);
+// Writes the stats out as "name value" lines, which is what /.stats holds. Returns how long the text is.
+int statsRender(char *buf, size_t size)
+{
+    size_t length = 0;
+    int op, i;
 
-    printf("PATH: %s\n", path);
+#define STATS_PRINT(...) \
+    do { if(length < size) length += snprintf(buf + length, size - length, __VA_ARGS__); } while(0)
 
+    for(op = OP_GETATTR; op < OP_COUNT; op++)
+    {
+        cs1550_op_stats *stats = &opStats[op];
 
-    if (strcmp(path, "/") == 0)
-    { // If we're in the root, fill in the directories
-        FILE *fp;
-        fp = fopen(".directories", "r");
+        STATS_PRINT("op.%s.calls %lu\n", opNames[op], __atomic_load_n(&stats->calls, __ATOMIC_RELAXED));
+        STATS_PRINT("op.%s.errors %lu\n", opNames[op], __atomic_load_n(&stats->errors, __ATOMIC_RELAXED));
+        STATS_PRINT("op.%s.bytes %lu\n", opNames[op], __atomic_load_n(&stats->bytes, __ATOMIC_RELAXED));
+        STATS_PRINT("op.%s.latency_ns %lu\n", opNames[op], __atomic_load_n(&stats->latency, __ATOMIC_RELAXED));
+        STATS_PRINT("op.%s.latency_hist", opNames[op]);
 
-        if(fp)
+        for(i = 0; i < STATS_BUCKETS; i++)
         {
-            cs1550_directory_entry dir;
-            while(fread(&dir, 1, sizeof(cs1550_directory_entry), fp) != 0)
-            {
-                filler(buf, dir.dname, NULL, 0);
-            }
+            STATS_PRINT(" %lu", __atomic_load_n(&stats->histogram[i], __ATOMIC_RELAXED));
         }
 
-        printf("===================================== READDIR END =====================================\n");
-
-        return 0;
+        STATS_PRINT("\n");
     }
-    else
-    { // Otherwise display the files in the current dir
-        printf("HEREHE %s\n", path);
-        cs1550_directory_entry mydir;
 
-        if(getDir(directory, &mydir))
-        { // Go to our dir
-            int i;
-            for (i = 0; i < mydir.nFiles; i++)
-            { // And add all the files
-                filler(buf, mydir.files[i].fname, NULL, 0);
-            }
-        }
-        else
-        {
-            printf("We could find your dir... SORRY!\n");
-        }
+    for(i = 0; i < STAT_EVENT_COUNT; i++)
+    {
+        STATS_PRINT("event.%s %lu\n", statEventNames[i], __atomic_load_n(&statEvents[i], __ATOMIC_RELAXED));
     }
-    printf("===================================== READDIR END =====================================\n");
-    return 0;
-}
 
+    unsigned long hits, misses;
+    cacheCounters(&hits, &misses);
 
-/* 
- * Creates a directory. We can ignore mode since we're not dealing with
- * permissions, as long as getattr returns appropriate ones for us.
- */
-static int cs1550_mkdir(const char *path, mode_t mode)
-{
-    (void) mode;
+    STATS_PRINT("cache.hits %lu\ncache.misses %lu\n", hits, misses);
 
-    printf("==========MKDIR START==========\n");
+    pthread_mutex_lock(&allocLock);
+    long free = freeBlocks;
+    long reserved = reservedBlocks;
+    unsigned long freeRuns = freeRunCount();
+    int largest = largestFreeRun();
+    pthread_mutex_unlock(&allocLock);
 
-    FILE *fp;
-    fp = fopen(".directories", "a");
+    STATS_PRINT("space.free_blocks %ld\nspace.free_runs %lu\n", free, freeRuns);
+    STATS_PRINT("space.reserved_blocks %ld\n", reserved);
+    STATS_PRINT("space.preallocated_blocks %ld\n", __atomic_load_n(&preallocBlocks, __ATOMIC_RELAXED));
+    STATS_PRINT("space.largest_free_run %d\n", largest);
+    STATS_PRINT("space.files %ld\n", __atomic_load_n(&fileTotal, __ATOMIC_RELAXED));
+    STATS_PRINT("defrag.fragmented_files %lu\n", __atomic_load_n(&defragFragmented, __ATOMIC_RELAXED));
 
-    cs1550_directory_entry *dirs = (cs1550_directory_entry *) malloc(sizeof(cs1550_directory_entry));
+#undef STATS_PRINT
 
-    strcpy(dirs->dname, path + 1);
-    dirs->nFiles = 0;
+    return length < size ? (int) length : (int) size - 1;
+}
 
-    fwrite(dirs, 1, sizeof(cs1550_directory_entry), fp);
 
-    fclose(fp);
 
-    printf("==========MKDIR END==========\n");
-    return 0;
-}
+// Takes the snapshot of /.stats that reads of this open file are served from. The text changes from one moment to
+// the next, so the kernel is told not to cache it or trust the size getattr gave.
+static int openStats(struct fuse_file_info *fi)
+{
+    if((fi->flags & O_ACCMODE) != O_RDONLY) return -EACCES;
 
+    cs1550_stats_snapshot *snapshot = malloc(sizeof(cs1550_stats_snapshot));
+
+    if(snapshot == NULL) return -ENOMEM;
+
+    snapshot->length = statsRender(snapshot->text, sizeof(snapshot->text));
+
+    fi->fh = (uintptr_t) snapshot;
+    fi->direct_io = 1;
 
-/* 
- * Removes a directory.
- */
-static int cs1550_rmdir(const char *path)
-{
-    (void) path;
     return 0;
 }
 
 
-/* 
- * Does the actual creation of a file. Mode and dev can be ignored.
- */
-static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+// Reads /.stats, from the snapshot taken at open if there is one.
+static int readStats(char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
-    (void) mode;
-    (void) dev;
+    cs1550_stats_snapshot local;
+    cs1550_stats_snapshot *snapshot = &local;
 
-    printf("===================================== MKNOD START =====================================\n");
+    if(fi != NULL && fi->fh != 0) snapshot = (cs1550_stats_snapshot *) (uintptr_t) fi->fh;
+    else local.length = statsRender(local.text, sizeof(local.text));
 
-    char directory[MAX_FILENAME + 1] = {0};
-    char filename[MAX_FILENAME + 1] = {0};
-    char extension[MAX_EXTENSION] = {0};
+    if(offset >= (off_t) snapshot->length) return 0;
+    if(offset + size > snapshot->length) size = snapshot->length - offset;
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+    memcpy(buf, snapshot->text + offset, size);
 
-    printf("DIRECTORY: %s\n", directory);
-    printf("FILENAME: %s\n", filename);
-    printf("EXTENSION: %s\n", extension);
+    return size;
+}
 
-    // Give a file a single block to start with.
-    int startBlock = moveFileToMemory(0, 1);
 
-    if(strcmp("/", directory) == 0)
+
+/* * * * * * * * * * * * * * *
+
+         BACKING STORE
+
+ * * * * * * * * * * * * * * */
+
+
+// Opens .disk and .directories. Called once at mount; every other read and write goes through the handles opened here.
+int storageOpen(void)
+{
+    struct stat st;
+
+    diskFd = open(diskPath, O_RDWR);
+
+    if(diskFd == -1 || fstat(diskFd, &st) == -1)
     {
-        printf("I'm sorry, but you can't create files in the root directory.\n");
+        LOG_ERROR("Couldn't open %s: %s", diskPath, strerror(errno));
         return -1;
     }
 
-    FILE *fp;
+    diskSize = st.st_size;
 
-    fp = fopen(".directories", "r+");
+    directoriesFd = open(directoriesPath, O_RDWR | O_CREAT, 0644);
 
-    if(fp)
+    if(directoriesFd == -1 || fstat(directoriesFd, &st) == -1)
     {
-        cs1550_directory_entry searchDir;
-        while(fread(&searchDir, 1, sizeof(cs1550_directory_entry), fp))
-        {
-            if(!strcmp(searchDir.dname, directory))
-            {
+        LOG_ERROR("Couldn't open %s: %s", directoriesPath, strerror(errno));
+        return -1;
+    }
 
-                strcpy(searchDir.files[searchDir.nFiles].fname, filename);
-                strcpy(searchDir.files[searchDir.nFiles].fext, extension);
-                searchDir.files[searchDir.nFiles].fsize = 0;
-                searchDir.files[searchDir.nFiles].nStartBlock = startBlock;
+    // Only whole records count; anything after the last one is the remains of a write that never finished.
+    directoriesSize = st.st_size - st.st_size % sizeof(cs1550_directory_entry);
 
-                if(searchDir.nFiles >= MAX_FILES_IN_DIR)
-                {
-                    printf("You can't add any more files to this directory... Sorry!\n");
-                    return -1;
-                }
-                searchDir.nFiles++;
+    if(options.mmap)
+    {
+        diskMap = mmap(NULL, diskSize, PROT_READ | PROT_WRITE, MAP_SHARED, diskFd, 0);
 
-                fseek(fp, -sizeof(cs1550_directory_entry), SEEK_CUR);
-                fwrite(&searchDir, 1, sizeof(cs1550_directory_entry), fp);
-                fclose(fp);
-                printf("===================================== MKNOD END =====================================\n");
-                return 0;
-            }
+        if(diskMap == MAP_FAILED)
+        {
+            LOG_ERROR("Couldn't map %s, falling back to pread/pwrite: %s", diskPath, strerror(errno));
+            diskMap = NULL;
         }
     }
 
-    fclose(fp);
-    printf("===================================== MKNOD END (FAIL) =====================================\n");
-    return -1;
+    return 0;
 }
 
 
-/*
- * Deletes a file
- */
-static int cs1550_unlink(const char *path)
+// Closes everything storageOpen() opened. Call storageSync() first if the data has to be on disk.
+void storageClose(void)
 {
-    printf("===================================== UNLINK START =====================================\n");
+    if(diskMap != NULL) munmap(diskMap, diskSize);
+    if(diskFd != -1) close(diskFd);
+    if(directoriesFd != -1) close(directoriesFd);
 
-    char directory[MAX_FILENAME + 1] = {0};
-    char filename[MAX_FILENAME + 1] = {0};
-    char extension[MAX_EXTENSION] = {0};
+    diskMap = NULL;
+    diskFd = -1;
+    directoriesFd = -1;
+}
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
 
-    cs1550_directory_entry dir;
-    getDir(directory, &dir);
+// Makes sure everything written so far is on stable storage.
+int storageSync(void)
+{
+    int ret = 0;
 
-    int i;
-    for(i = 0; i < dir.nFiles; i++)
+    if(diskMap != NULL && msync(diskMap, diskSize, MS_SYNC) == -1) ret = -1;
+    if(diskFd != -1 && fsync(diskFd) == -1) ret = -1;
+    if(directoriesFd != -1 && fsync(directoriesFd) == -1) ret = -1;
+
+    return ret;
+}
+
+
+// Reads size bytes at offset from a backing file, retrying short reads. Returns how many bytes were read, or -1.
+static int readFully(int fd, void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
+
+    while(done < size)
     {
-        if (strcmp(dir.files[i].fname, filename) == 0)
+        ssize_t ret = pread(fd, (char *) buf + done, size - done, offset + done);
+
+        if(ret == -1)
         {
-            int startBlock = dir.files[i].nStartBlock;
-            int sizeInBlocks = getBlockSize(dir.files[i].fsize);
+            if(errno == EINTR) continue;
+            return -1;
+        }
+        if(ret == 0) break; // end of file
+
+        done += ret;
+    }
 
-            removeFileFromMemory(startBlock, sizeInBlocks);
+    return done;
+}
 
-            format(dir.files, dir.nFiles, i);
-            dir.nFiles--;
 
-            FILE *fp;
-            fp = fopen(".directories", "r+");
+// Writes size bytes at offset to a backing file, retrying short writes. Returns size, or -1.
+static int writeFully(int fd, const void *buf, size_t size, off_t offset)
+{
+    size_t done = 0;
 
-            if(fp)
-            {
-                cs1550_directory_entry searchDir;
-                while(fread(&searchDir, 1, sizeof(cs1550_directory_entry), fp))
-                {
-                    if(!strcmp(searchDir.dname, directory))
-                    {
-                        fseek(fp, -sizeof(cs1550_directory_entry), SEEK_CUR);
-                        fwrite(&dir, 1, sizeof(cs1550_directory_entry), fp);
-                        fclose(fp);
-                        printf("===================================== UNLINK END =====================================\n");
-                        return 0;
-                    }
-                }
-            }
-            printf("===================================== UNLINK END =====================================\n");
-            return 0;
+    while(done < size)
+    {
+        ssize_t ret = pwrite(fd, (const char *) buf + done, size - done, offset + done);
+
+        if(ret == -1)
+        {
+            if(errno == EINTR) continue;
+            return -1;
         }
+
+        done += ret;
     }
-    printf("===================================== UNLINK END (FAIL) =====================================\n");
-    return -1;
+
+    return done;
 }
 
 
-/* 
- * Read size bytes from file into buf starting from offset
- *
- */
-static int cs1550_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Reads from .disk. Returns how many bytes were read, or -1.
+int diskRead(void *buf, size_t size, off_t offset)
 {
-    (void) fi;
+    if(diskMap == NULL) return readFully(diskFd, buf, size, offset);
 
-    memset(buf, 0, size);
+    if(offset >= diskSize) return 0;
+    if(offset + (off_t) size > diskSize) size = diskSize - offset;
 
-    printf("===================================== READ START =====================================\n");
+    memcpy(buf, diskMap + offset, size);
 
-    if(size <= 0)
-    {
-        printf("Size too small.\n");
-        printf("===================================== READ END (FAIL 1) =====================================\n");
-        return -1;
-    }
-    if(offset > size)
+    return size;
+}
+
+
+// Writes to .disk. Returns size, or -1.
+int diskWrite(const void *buf, size_t size, off_t offset)
+{
+    if(diskMap == NULL) return writeFully(diskFd, buf, size, offset);
+
+    if(offset + (off_t) size > diskSize)
     {
-        printf("Your offset is larger than the file.\n");
-        printf("===================================== READ END (FAIL 2) =====================================\n");
+        errno = ENOSPC;
         return -1;
     }
 
-    char directory[MAX_FILENAME + 1] = {0};
-    char filename[MAX_FILENAME + 1] = {0};
-    char extension[MAX_EXTENSION] = {0};
+    memcpy(diskMap + offset, buf, size);
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+    return size;
+}
 
-    cs1550_directory_entry dir;
 
-    //check to make sure path exists
-    if(!getDir(directory, &dir))
-    {
-        printf("Cannot find specified directory.\n");
-        printf("===================================== READ END (FAIL 3) =====================================\n");
-        return -1;
-    }
+// Zeroes size bytes of .disk at offset. Punching a hole there writes nothing, so that is tried first; if the
+// filesystem under .disk can't, zeros are written instead. Returns size, or -1.
+int diskZero(size_t size, off_t offset)
+{
+    static const char zeros[MAX_BLOCK_SIZE];
+    size_t done = 0;
 
-    int i;
-    for(i = 0; i < dir.nFiles; i++)
+    if(fallocate(diskFd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, size) == 0) return size;
+
+    while(done < size)
     {
-        if(strcmp(dir.files[i].fname, filename) == 0)
-        {
-            FILE *fp;
-            fp = fopen(".disk", "r");
+        size_t count = size - done < sizeof(zeros) ? size - done : sizeof(zeros);
 
-            if(offset + size > dir.files[i].fsize)
-            {
-                printf("You tried reading past what we've got to offer.\n");
-                size = dir.files[i].fsize - offset;
-            }
+        if(diskWrite(zeros, count, offset + done) == -1) return -1;
 
-            int startBlock = dir.files[i].nStartBlock;
+        done += count;
+    }
 
-            int offsetInBytes = startBlock * BLOCK_SIZE;
+    return size;
+}
 
-            fseek(fp, offsetInBytes + offset, SEEK_SET);
-            int ret = fread(buf, 1, size, fp);
 
-            printf("%d == %d\n", ret, size);
-            printf("READ: %s\n", buf);
+// Reads from .directories. Returns how many bytes were read, or -1.
+int directoriesRead(void *buf, size_t size, off_t offset)
+{
+    return readFully(directoriesFd, buf, size, offset);
+}
 
-            fclose(fp);
-            printf("===================================== READ END =====================================\n");
-            return ret;
-        }
-    }
-    printf("===================================== READ END (FAIL 4) =====================================\n");
-    return -1;
+
+// Writes to .directories. Returns size, or -1.
+int directoriesWrite(const void *buf, size_t size, off_t offset)
+{
+    return writeFully(directoriesFd, buf, size, offset);
 }
 
 
-/* 
- * Write size bytes from buf into file starting from offset
- *
- */
-static int cs1550_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+// Lays out a disk of count blocks of size bytes with a journal of journalBlocks blocks (0 for the default size): the
+// superblock, then the bitmap, then the journal, then data. Returns 0, or -1 if there is no such disk.
+int superblockLayout(cs1550_superblock *sb, int size, uint64_t count, uint64_t journalBlocks)
 {
+    if(size < MIN_BLOCK_SIZE || size > MAX_BLOCK_SIZE || (size & (size - 1)) != 0) return -1;
 
-    (void) fi;
+    if(journalBlocks == 0)
+    {
+        journalBlocks = DEFAULT_JOURNAL_BYTES / size;
+        if(journalBlocks < MIN_JOURNAL_BLOCKS) journalBlocks = MIN_JOURNAL_BLOCKS;
+    }
 
-    printf("===================================== WRITE START =====================================\n");
+    if(count > MAX_BLOCK_COUNT || journalBlocks < 2) return -1;
+
+    memset(sb, 0, sizeof(cs1550_superblock));
+    sb->magic = SUPERBLOCK_MAGIC;
+    sb->version = SUPERBLOCK_VERSION;
+    sb->blockSize = size;
+    sb->blockCount = count;
+    sb->bitmapStart = 1;
+    sb->bitmapBlocks = ((count + 7) / 8 + size - 1) / size;
+    sb->journalStart = sb->bitmapStart + sb->bitmapBlocks;
+    sb->journalBlocks = journalBlocks;
+    sb->dataStart = sb->journalStart + sb->journalBlocks;
+    sb->freeBlocks = count > sb->dataStart ? count - sb->dataStart : 0;
+    sb->files = 0;
+
+    return sb->dataStart < count ? 0 : -1;
+}
 
-    //check that size is > 0
-    if(size <= 0)
+
+// Reads the superblock and sets up blockSize and the rest from it. A disk without one is taken to be laid out the way
+// disks were before there was a superblock. Called at mount, once .disk is open. Returns 0, or -1.
+int superblockLoad(void)
+{
+    cs1550_superblock sb;
+
+    if(diskRead(&sb, sizeof(sb), 0) != sizeof(sb))
     {
-        printf("Size too small.\n");
+        LOG_ERROR("Couldn't read the superblock from .disk.");
         return -1;
     }
 
-    if(offset > size)
+    if(sb.magic != SUPERBLOCK_MAGIC)
     {
-        printf("Your offset is larger than the file.\n");
-        return -1;
+        memset(&sb, 0, sizeof(sb));
+        sb.blockSize = LEGACY_BLOCK_SIZE;
+        sb.blockCount = LEGACY_BLOCK_COUNT;
+        sb.bitmapStart = 0;
+        sb.bitmapBlocks = LEGACY_BITMAP_BLOCKS;
+        sb.journalStart = LEGACY_JOURNAL_START;
+        sb.journalBlocks = LEGACY_JOURNAL_BLOCKS;
+        sb.dataStart = sb.journalStart + sb.journalBlocks;
     }
+    else
+    {
+        // mkfs only makes one layout for a given size, so anything else is damage. The counters are whatever they are.
+        cs1550_superblock expected;
 
-    char directory[MAX_FILENAME + 1] = {0};
-    char filename[MAX_FILENAME + 1] = {0};
-    char extension[MAX_EXTENSION] = {0};
+        int ret = superblockLayout(&expected, sb.blockSize, sb.blockCount, sb.journalBlocks);
 
-    sscanf(path, "/%[^/]/%[^.].%s", directory, filename, extension);
+        expected.freeBlocks = sb.freeBlocks;
+        expected.files = sb.files;
 
-    if(strcmp("/", directory) == 0)
+        if(ret != 0 || memcmp(&expected, &sb, sizeof(sb)) != 0)
+        {
+            LOG_ERROR("The superblock of .disk is damaged.");
+            return -1;
+        }
+    }
+
+    if((off_t) (sb.blockCount * sb.blockSize) > diskSize)
     {
-        printf("I'm sorry, but you can't create files in the root directory.\n");
+        LOG_ERROR(".disk is %lld bytes, but holds %llu blocks of %u bytes.", (long long) diskSize,
+                  (unsigned long long) sb.blockCount, sb.blockSize);
         return -1;
     }
 
-    cs1550_directory_entry dir;
+    superblock = sb;
+    blockSize = sb.blockSize;
+    blockCount = sb.blockCount;
+    inodePointers = (blockSize - offsetof(cs1550_inode, pointers)) / sizeof(unsigned long);
+    indexPointers = blockSize / sizeof(unsigned long);
 
-    //check to make sure path exists
-    if(!getDir(directory, &dir))
+    return 0;
+}
+
+
+// Makes an empty filesystem laid out as sb says in fd, which must already be sb->blockCount blocks of zeros: writes
+// the superblock, and marks the blocks before the data as taken in the bitmap. Returns 0, or -1.
+int makeFilesystem(int fd, const cs1550_superblock *sb)
+{
+    size_t bytes = (sb->dataStart + 7) / 8;
+    unsigned char *block = (unsigned char *) calloc(1, sb->blockSize);
+    unsigned char *bits = (unsigned char *) malloc(bytes);
+    int ret = -1;
+
+    if(block != NULL && bits != NULL)
     {
-        printf("Cannot find specified directory.\n");
-        return -1;
+        // Block 0 is the high bit of byte 0.
+        memset(bits, 0xFF, bytes);
+        if(sb->dataStart % 8 != 0) bits[bytes - 1] = (unsigned char) (0xFF << (8 - sb->dataStart % 8));
+
+        memcpy(block, sb, sizeof(cs1550_superblock));
+
+        if(writeFully(fd, block, sb->blockSize, 0) == (int) sb->blockSize &&
+           writeFully(fd, bits, bytes, (off_t) sb->bitmapStart * sb->blockSize) == (int) bytes) ret = 0;
     }
 
-    int i;
-    for(i = 0; i < dir.nFiles; i++)
-    { // Look through all the files in the directory
-        if(!strcmp(dir.files[i].fname, filename))
-        { // If you find a positive match
-            if(getBlockSize(size + offset) > getBlockSize(dir.files[i].fsize))
-            { // If it is time to grow the file...
-                printf("We're growing the file\n");
-                // Calculate the current size of the file.
-                int startBlock = dir.files[i].nStartBlock;
-                int sizeInBlocks = getBlockSize(dir.files[i].fsize);
+    free(block);
+    free(bits);
+
+    return ret;
+}
+
 
-                // Remove the bitmap entries for this file
-                removeFileFromMemory(startBlock, sizeInBlocks);
 
-                FILE *fp;
-                fp = fopen(".disk","r");
+/* * * * * * * * * * * * * * *
 
-                void *buffer = malloc(BLOCK_SIZE * sizeInBlocks);
+          BLOCK CACHE
 
-                fseek(fp, startBlock * BLOCK_SIZE, SEEK_SET);
+ * * * * * * * * * * * * * * */
 
-                // Read all the files blocks into a temporary buffer.
-                fread(buffer, 1, BLOCK_SIZE * sizeInBlocks, fp);
 
-                // Write the file into the disk and change the bitmap accordingly.
-                int newStartBlock = moveFileToMemory(buffer, BLOCK_SIZE * sizeInBlocks);
+// Sets up an empty block cache that can hold capacity blocks of .disk, split evenly over the shards.
+int cacheInit(int capacity)
+{
+    int i, j;
 
-                if(newStartBlock == -1)
-                {
-                    printf("Error... Out of space!\n");
-                    return -1;
-                }
+    int perShard = (capacity + CACHE_SHARDS - 1) / CACHE_SHARDS;
 
-                fp = fopen(".directories", "r+");
+    if(perShard < 1) perShard = 1;
 
-                // Record the change in file size and start block into the filesystem.
-                if(fp)
-                {
-                    cs1550_directory_entry searchDir;
-                    while(fread(&searchDir, 1, sizeof(cs1550_directory_entry), fp))
-                    {
-                        if(!strcmp(searchDir.dname, directory))
-                        {
-                            int i;
-                            for(i = 0; i < searchDir.nFiles; i++)
-                            {
-                                if(!strcmp(searchDir.files[i].fname, filename))
-                                {
-                                    searchDir.files[i].nStartBlock = newStartBlock;
-                                    searchDir.files[i].fsize = size + offset;
-
-                                    fseek(fp, -sizeof(cs1550_directory_entry), SEEK_CUR);
-                                    fwrite(&searchDir, 1, sizeof(cs1550_directory_entry), fp);
-                                    fclose(fp);
-
-                                    printf("===================================== WRITE END =====================================\n");
-                                    return size;
-                                }
-                            }
-                        }
-                    }
-                }
-            }
-            else
-            { // If the write won't take us out of our current block...
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        cs1550_cache_shard *shard = &cacheShards[i];
 
-                printf("Simple write...\n");
+        memset(shard, 0, sizeof(cs1550_cache_shard));
+        pthread_mutex_init(&shard->lock, NULL);
 
-                FILE *fp;
-                fp = fopen(".disk", "r+");
+        shard->blocks = (cs1550_cache_block *) calloc(perShard, sizeof(cs1550_cache_block));
+        shard->data = (char *) malloc((size_t) perShard * blockSize);
 
-                int startBlock = dir.files[i].nStartBlock;
+        for(shard->bucketCount = 1; shard->bucketCount < perShard; shard->bucketCount *= 2);
 
-                int offsetInBytes = startBlock * BLOCK_SIZE;
+        shard->buckets = (cs1550_cache_block **) calloc(shard->bucketCount, sizeof(cs1550_cache_block *));
 
-                fseek(fp, offsetInBytes + offset, SEEK_SET);
-                fwrite(buf, 1, size, fp);
+        if(shard->blocks == NULL || shard->data == NULL || shard->buckets == NULL) return -1;
 
-                fclose(fp);
+        // Chain all the slots into the LRU list. Unused slots are at the tail so they get used first.
+        for(j = 0; j < perShard; j++)
+        {
+            shard->blocks[j].block = -1;
+            shard->blocks[j].data = shard->data + (size_t) j * blockSize;
+            shard->blocks[j].prev = (j > 0) ? &shard->blocks[j - 1] : NULL;
+            shard->blocks[j].next = (j < perShard - 1) ? &shard->blocks[j + 1] : NULL;
+        }
 
-                fp = fopen(".directories", "r+");
+        shard->head = &shard->blocks[0];
+        shard->tail = &shard->blocks[perShard - 1];
+    }
 
-                if(fp)
-                {
-                    cs1550_directory_entry searchDir;
-                    while(fread(&searchDir, 1, sizeof(cs1550_directory_entry), fp))
-                    {
-                        if(!strcmp(searchDir.dname, directory))
-                        {
-                            int i;
-
-                            for(i = 0; i < searchDir.nFiles; i++)
-                            {
-                                if(!strcmp(searchDir.files[i].fname, filename))
-                                {
-                                    if((offset + size) > searchDir.files[i].fsize)
-                                    {
-                                        printf("Update...\n");
-                                        searchDir.files[i].fsize = offset + size;
-                                    }
-
-                                    fseek(fp, -sizeof(cs1550_directory_entry), SEEK_CUR);
-                                    fwrite(&searchDir, 1, sizeof(cs1550_directory_entry), fp);
-                                    fclose(fp);
-                                    break;
-                                }
-                            }
-                            break;
-                        }
-                    }
-                }
+    return 0;
+}
 
-                printf("===================================== WRITE END =====================================\n");
-                return size;
-            }
+
+// Frees the block cache. Call cacheFlush() first or dirty blocks are lost.
+void cacheDestroy(void)
+{
+    int i;
+
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        cs1550_cache_block *b = cacheShards[i].head;
+
+        while(b != NULL)
+        {
+            cs1550_cache_block *next = b->next;
+            if(b->extra) free(b);
+            b = next;
         }
+
+        free(cacheShards[i].blocks);
+        free(cacheShards[i].data);
+        free(cacheShards[i].buckets);
+        pthread_mutex_destroy(&cacheShards[i].lock);
+        memset(&cacheShards[i], 0, sizeof(cs1550_cache_shard));
     }
+}
 
-    printf("===================================== WRITE END (FAIL) =====================================\n");
-    return -1;
+
+// Returns the shard a block of .disk is cached in. Neighbouring blocks go to different shards.
+static cs1550_cache_shard *cacheShardFor(long block)
+{
+    return &cacheShards[block % CACHE_SHARDS];
 }
 
 
-/******************************************************************************
-*
-*  DO NOT MODIFY ANYTHING BELOW THIS LINE
-*
-*****************************************************************************/
+// Adds up the hit and miss counters of every shard.
+void cacheCounters(unsigned long *hits, unsigned long *misses)
+{
+    int i;
+
+    *hits = 0;
+    *misses = 0;
+
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        pthread_mutex_lock(&cacheShards[i].lock);
+        *hits += cacheShards[i].hits;
+        *misses += cacheShards[i].misses;
+        pthread_mutex_unlock(&cacheShards[i].lock);
+    }
+}
 
-/*
- * truncate is called when a new file is created (with a 0 size) or when an
- * existing file is made shorter. We're not handling deleting files or 
- * truncating existing ones, so all we need to do here is to initialize
- * the appropriate directory entry.
- *
- */
-static int cs1550_truncate(const char *path, off_t size)
+
+// Moves a cached block to the front of its shard's LRU list.
+static void cacheTouch(cs1550_cache_shard *shard, cs1550_cache_block *b)
 {
-    (void) path;
-    (void) size;
+    if(b == shard->head) return;
 
-    return 0;
+    b->prev->next = b->next;
+    if(b->next) b->next->prev = b->prev;
+    else shard->tail = b->prev;
+
+    b->prev = NULL;
+    b->next = shard->head;
+    shard->head->prev = b;
+    shard->head = b;
 }
 
 
-/* 
- * Called when we open a file
- *
- */
-static int cs1550_open(const char *path, struct fuse_file_info *fi)
+// Returns the cached copy of block, or NULL if it isn't cached. The shard's lock must be held.
+static cs1550_cache_block *cacheFind(cs1550_cache_shard *shard, long block)
 {
-    (void) path;
-    (void) fi;
-    /*
-        //if we can't find the desired file, return an error
-        return -ENOENT;
-    */
+    cs1550_cache_block *b = shard->buckets[(block / CACHE_SHARDS) & (shard->bucketCount - 1)];
 
-    //It's not really necessary for this project to anything in open
+    while(b != NULL && b->block != block) b = b->hashNext;
 
-    /* We're not going to worry about permissions for this project, but 
-	   if we were and we don't have them to the file we should return an error
+    return b;
+}
 
-        return -EACCES;
-    */
 
-    return 0; //success!
+// Takes a cached block out of its hash bucket.
+static void cacheUnhash(cs1550_cache_shard *shard, cs1550_cache_block *b)
+{
+    cs1550_cache_block **link = &shard->buckets[(b->block / CACHE_SHARDS) & (shard->bucketCount - 1)];
+
+    while(*link != b) link = &(*link)->hashNext;
+
+    *link = b->hashNext;
 }
 
-/*
- * Called when close is called on a file descriptor, but because it might
- * have been dup'ed, this isn't a guarantee we won't ever need the file 
- * again. For us, return success simply to avoid the unimplemented error
- * in the debug log.
- */
-static int cs1550_flush(const char *path, struct fuse_file_info *fi)
+
+// Writes a dirty cached block back to .disk. Metadata the journal hasn't committed yet stays where it is.
+static int cacheWriteBack(cs1550_cache_block *b)
 {
-    (void) path;
-    (void) fi;
+    if(!b->dirty || b->journalTid != 0) return 0;
 
-    return 0; //success!
+    if(diskWrite(b->data, blockSize, (off_t) b->block * blockSize) != blockSize) return -1;
+
+    b->dirty = 0;
+
+    return 0;
 }
 
 
-//register our new functions as the implementations of the syscalls
-static struct fuse_operations hello_oper = {
-        .getattr    = cs1550_getattr,
-        .readdir    = cs1550_readdir,
-        .mkdir    = cs1550_mkdir,
-        .rmdir = cs1550_rmdir,
-        .read    = cs1550_read,
-        .write    = cs1550_write,
-        .mknod    = cs1550_mknod,
-        .unlink = cs1550_unlink,
-        .truncate = cs1550_truncate,
-        .flush = cs1550_flush,
-        .open    = cs1550_open,
-};
+// Returns the cache slot for a block, evicting the least recently used block of the shard if it isn't cached yet.
+// If load is set the block's contents are read from .disk, otherwise the caller is about to overwrite all of it.
+// The shard's lock must be held.
+static cs1550_cache_block *cacheGet(cs1550_cache_shard *shard, long block, int load)
+{
+    int bucket = (block / CACHE_SHARDS) & (shard->bucketCount - 1);
+    cs1550_cache_block *b = cacheFind(shard, block);
 
-//Don't change this.
-int main(int argc, char *argv[])
+    if(b != NULL)
+    {
+        shard->hits++;
+        cacheTouch(shard, b);
+        return b;
+    }
+
+    shard->misses++;
+
+    // Blocks the journal has pinned can't be written back yet, so take the least recently used one that isn't. If
+    // they are all pinned the shard grows by a block; journalEnd() commits long before that gets out of hand.
+    b = shard->tail;
+
+    while(b != NULL && b->journalTid != 0) b = b->prev;
+
+    if(b == NULL)
+    {
+        b = (cs1550_cache_block *) calloc(1, sizeof(cs1550_cache_block) + blockSize);
+
+        if(b == NULL) return NULL;
+
+        b->block = -1;
+        b->data = (char *) (b + 1);
+        b->extra = 1;
+        b->prev = shard->tail;
+        shard->tail->next = b;
+        shard->tail = b;
+    }
+
+    if(b->block != -1)
+    {
+        if(cacheWriteBack(b) != 0) return NULL;
+        if(b->prefetched) STAT_ADD(STAT_READAHEAD_WASTED, 1);
+        cacheUnhash(shard, b);
+        b->block = -1;
+        b->prefetched = 0;
+    }
+
+    if(load)
+    {
+        int got = diskRead(b->data, blockSize, (off_t) block * blockSize);
+
+        if(got == -1) return NULL;
+        if(got < blockSize) memset(b->data + got, 0, blockSize - got);
+    }
+
+    b->block = block;
+    b->dirty = 0;
+    b->hashNext = shard->buckets[bucket];
+    shard->buckets[bucket] = b;
+
+    cacheTouch(shard, b);
+
+    return b;
+}
+
+
+// Reads a range of .disk through the cache. Returns size, or -1.
+int cacheRead(void *buf, size_t size, off_t offset)
 {
-    return fuse_main(argc, argv, &hello_oper, NULL);
+    size_t done = 0;
+
+    while(done < size)
+    {
+        long block = (offset + done) / blockSize;
+        int inBlock = (offset + done) % blockSize;
+        size_t count = blockSize - inBlock;
+
+        if(count > size - done) count = size - done;
+
+        cs1550_cache_shard *shard = cacheShardFor(block);
+
+        pthread_mutex_lock(&shard->lock);
+
+        cs1550_cache_block *b = cacheGet(shard, block, 1);
+
+        if(b != NULL) memcpy((char *) buf + done, b->data + inBlock, count);
+        STAT_ADD(STAT_BYTES_COPIED, count);
+
+        if(b != NULL && b->prefetched)
+        {
+            b->prefetched = 0;
+            STAT_ADD(STAT_READAHEAD_HITS, 1);
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        if(b == NULL) return -1;
+
+        done += count;
+    }
+
+    return size;
+}
+
+
+// Writes a range of .disk through the cache. If tid isn't 0 the range is metadata belonging to that journal
+// transaction, and the blocks stay pinned in the cache until it commits.
+static int cacheWriteRange(const void *buf, size_t size, off_t offset, unsigned long tid)
+{
+    size_t done = 0;
+
+    while(done < size)
+    {
+        long block = (offset + done) / blockSize;
+        int inBlock = (offset + done) % blockSize;
+        size_t count = blockSize - inBlock;
+
+        if(count > size - done) count = size - done;
+
+        cs1550_cache_shard *shard = cacheShardFor(block);
+
+        pthread_mutex_lock(&shard->lock);
+
+        // A block that is overwritten completely doesn't need to be read first.
+        cs1550_cache_block *b = cacheGet(shard, block, count != blockSize);
+
+        if(b != NULL)
+        {
+            memcpy(b->data + inBlock, (const char *) buf + done, count);
+            b->dirty = 1;
+            STAT_ADD(STAT_BYTES_COPIED, count);
+
+            if(tid != 0 && b->journalTid != tid)
+            {
+                b->journalTid = tid;
+                journalAddPending(blockSize);
+            }
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+
+        if(b == NULL) return -1;
+
+        done += count;
+    }
+
+    return size;
+}
+
+
+// Writes a range of .disk through the cache. The data reaches the disk when the block is evicted or flushed. Returns size, or -1.
+int cacheWrite(const void *buf, size_t size, off_t offset)
+{
+    return cacheWriteRange(buf, size, offset, 0);
+}
+
+
+// Like cacheWrite(), for inodes and index blocks. They only reach their place on disk once the journal holds them.
+// Must be called inside journalBegin()/journalEnd().
+int cacheWriteMeta(const void *buf, size_t size, off_t offset)
+{
+    return cacheWriteRange(buf, size, offset, journalRunningTid());
+}
+
+
+// Adds a copy of every block pinned by transaction tid to it.
+int cacheJournal(unsigned long tid, cs1550_journal_buffer *txn)
+{
+    int i;
+
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        cs1550_cache_block *b;
+        int ret = 0;
+
+        pthread_mutex_lock(&cacheShards[i].lock);
+
+        for(b = cacheShards[i].head; b != NULL && ret == 0; b = b->next)
+        {
+            if(b->block != -1 && b->journalTid == tid)
+            {
+                ret = journalAppend(txn, JOURNAL_DISK, (off_t) b->block * blockSize, b->data, blockSize);
+            }
+        }
+
+        pthread_mutex_unlock(&cacheShards[i].lock);
+
+        if(ret != 0) return -1;
+    }
+
+    return 0;
+}
+
+
+// Called once the copy of a block that transaction tid committed is in its place on disk. If nothing changed the
+// block since, it is clean, and either way it can be written back again.
+void cacheUnpin(long block, unsigned long tid, const char *image)
+{
+    cs1550_cache_shard *shard = cacheShardFor(block);
+    cs1550_cache_block *b;
+
+    pthread_mutex_lock(&shard->lock);
+
+    b = shard->buckets[(block / CACHE_SHARDS) & (shard->bucketCount - 1)];
+
+    while(b != NULL && b->block != block) b = b->hashNext;
+
+    if(b != NULL && b->journalTid == tid)
+    {
+        b->journalTid = 0;
+        if(memcmp(b->data, image, blockSize) == 0) b->dirty = 0;
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+// Is block in the cache? Reading it from there is cheaper than going to .disk for it.
+int cacheHolds(long block)
+{
+    cs1550_cache_shard *shard = cacheShardFor(block);
+
+    pthread_mutex_lock(&shard->lock);
+
+    int held = cacheFind(shard, block) != NULL;
+
+    pthread_mutex_unlock(&shard->lock);
+
+    return held;
+}
+
+
+// Drops count blocks starting at block from the cache without writing them back, because they are about to be
+// overwritten on .disk directly. Whoever calls this must make sure nobody reads them back in before that's done.
+// Returns 0, or -1 if some of them are pinned by the journal and have to stay (the rest are dropped all the same).
+int cacheDiscard(long block, long count)
+{
+    int ret = 0;
+    long i;
+
+    for(i = block; i < block + count; i++)
+    {
+        cs1550_cache_shard *shard = cacheShardFor(i);
+
+        pthread_mutex_lock(&shard->lock);
+
+        cs1550_cache_block *b = cacheFind(shard, i);
+
+        if(b != NULL && b->journalTid != 0) ret = -1;
+        else if(b != NULL)
+        {
+            cacheUnhash(shard, b);
+            b->block = -1;
+            b->dirty = 0;
+            b->prefetched = 0;
+        }
+
+        pthread_mutex_unlock(&shard->lock);
+    }
+
+    return ret;
+}
+
+
+// Loads block into the cache for readahead, unless it is there already.
+void cachePrefetch(long block)
+{
+    cs1550_cache_shard *shard = cacheShardFor(block);
+
+    pthread_mutex_lock(&shard->lock);
+
+    if(cacheFind(shard, block) == NULL)
+    {
+        cs1550_cache_block *b = cacheGet(shard, block, 1);
+
+        if(b != NULL)
+        {
+            b->prefetched = 1;
+            STAT_ADD(STAT_READAHEAD_BLOCKS, 1);
+        }
+    }
+
+    pthread_mutex_unlock(&shard->lock);
+}
+
+
+// Writes every dirty block in the cache back to .disk.
+int cacheFlush(void)
+{
+    int i;
+    int ret = 0;
+
+    for(i = 0; i < CACHE_SHARDS; i++)
+    {
+        cs1550_cache_block *b;
+
+        pthread_mutex_lock(&cacheShards[i].lock);
+
+        for(b = cacheShards[i].head; b != NULL; b = b->next)
+        {
+            if(b->block != -1 && cacheWriteBack(b) != 0) ret = -1;
+        }
+
+        pthread_mutex_unlock(&cacheShards[i].lock);
+    }
+
+    return ret;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+            JOURNAL
+
+ * * * * * * * * * * * * * * */
+// Metadata (the bitmap, directory records, inodes and index blocks) never goes straight to its place on disk. Every
+// change goes into the running transaction; a commit copies that transaction into the ring at the start of .disk,
+// syncs, and only then writes the copies where they belong. After a crash, replaying the ring at mount puts back
+// whatever a commit got as far as syncing.
+//
+// Operations that change metadata run between journalBegin() and journalEnd(), which has to come before any other
+// lock they take. A commit waits for the ones in progress to finish and holds new ones back while it copies the
+// running transaction, so a transaction never holds half an operation.
+
+
+static int journalCommitLocked(void);
+
+
+// CRC-32 (the zlib one) of a buffer
+static unsigned int journalChecksum(const void *data, size_t length)
+{
+    static unsigned int table[256];
+    static int ready;
+    const unsigned char *bytes = (const unsigned char *) data;
+    unsigned int crc = 0xFFFFFFFFu;
+    size_t i;
+
+    if(!ready)
+    {
+        unsigned int n, k;
+
+        for(n = 0; n < 256; n++)
+        {
+            unsigned int c = n;
+            for(k = 0; k < 8; k++) c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+            table[n] = c;
+        }
+
+        ready = 1;
+    }
+
+    for(i = 0; i < length; i++) crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+
+    return crc ^ 0xFFFFFFFFu;
+}
+
+
+// Makes sure a transaction being put together has room for needed bytes. Returns 0, or -1 if we're out of memory.
+static int journalReserve(cs1550_journal_buffer *txn, size_t needed)
+{
+    if(needed <= txn->capacity) return 0;
+
+    size_t capacity = txn->capacity ? txn->capacity : 4 * blockSize;
+    while(capacity < needed) capacity *= 2;
+
+    char *grown = (char *) realloc(txn->data, capacity);
+    if(grown == NULL) return -1;
+
+    txn->data = grown;
+    txn->capacity = capacity;
+
+    return 0;
+}
+
+
+// Adds a record to a transaction being put together. Returns 0, or -1 if we're out of memory.
+int journalAppend(cs1550_journal_buffer *txn, int target, off_t offset, const void *data, size_t length)
+{
+    size_t needed = txn->length + sizeof(cs1550_journal_record) + length;
+
+    if(journalReserve(txn, needed) != 0) return -1;
+
+    cs1550_journal_record record;
+
+    record.target = target;
+    record.length = length;
+    record.offset = offset;
+
+    memcpy(txn->data + txn->length, &record, sizeof(record));
+    memcpy(txn->data + txn->length + sizeof(record), data, length);
+    txn->length = needed;
+
+    return 0;
+}
+
+
+// Notes that the running transaction has grown by about bytes.
+void journalAddPending(unsigned long bytes)
+{
+    __atomic_fetch_add(&journalPending, bytes, __ATOMIC_RELAXED);
+}
+
+
+// The transaction metadata changed right now belongs to. Only meaningful inside journalBegin()/journalEnd().
+unsigned long journalRunningTid(void)
+{
+    return __atomic_load_n(&journalTid, __ATOMIC_RELAXED);
+}
+
+
+// Starts an operation that changes metadata, waiting if a commit is copying the running transaction.
+void journalBegin(void)
+{
+    pthread_mutex_lock(&journalLock);
+
+    while(journalFrozen) pthread_cond_wait(&journalCond, &journalLock);
+
+    journalUpdates++;
+
+    pthread_mutex_unlock(&journalLock);
+}
+
+
+// Ends an operation started with journalBegin(). Commits if the running transaction has got big, so call it after
+// every other lock has been let go.
+void journalEnd(void)
+{
+    pthread_mutex_lock(&journalLock);
+
+    if(--journalUpdates == 0 && journalFrozen) pthread_cond_broadcast(&journalCond);
+
+    pthread_mutex_unlock(&journalLock);
+
+    if(__atomic_load_n(&journalPending, __ATOMIC_RELAXED) >= JOURNAL_COMMIT_BYTES)
+    {
+        pthread_mutex_lock(&commitLock);
+
+        // Someone else may have committed while we waited.
+        if(__atomic_load_n(&journalPending, __ATOMIC_RELAXED) >= JOURNAL_COMMIT_BYTES) journalCommitLocked();
+
+        pthread_mutex_unlock(&commitLock);
+    }
+}
+
+
+// Copies the running transaction into txn and starts a new one. Returns the id of the one copied, or 0 if we ran out
+// of memory (in which case nothing is lost: it all stays in the running transaction).
+static unsigned long journalCapture(cs1550_journal_buffer *txn)
+{
+    unsigned long tid;
+    int ret = 0;
+    int block, i;
+
+    pthread_mutex_lock(&journalLock);
+
+    journalFrozen = 1;
+
+    while(journalUpdates > 0) pthread_cond_wait(&journalCond, &journalLock);
+
+    tid = journalTid;
+
+    pthread_mutex_unlock(&journalLock);
+
+    // The header goes first; it is filled in when the transaction is written out.
+    if(journalReserve(txn, sizeof(cs1550_journal_txn)) != 0) ret = -1;
+    txn->length = sizeof(cs1550_journal_txn);
+
+    pthread_mutex_lock(&allocLock);
+
+    // Blocks this transaction freed are free in the bitmap it commits, though nobody may take them until it has.
+    freeingShow(0);
+
+    for(block = 0; block < (int) superblock.bitmapBlocks && ret == 0; block++)
+    {
+        unsigned char bytes[blockSize];
+
+        if(!bitmapDirty[block]) continue;
+
+        int count = bitmapBlockBytes(block, bytes);
+
+        ret = journalAppend(txn, JOURNAL_DISK, (off_t) (superblock.bitmapStart + block) * blockSize, bytes, count);
+    }
+
+    // The counters ride along in the superblock whenever they have moved, so they always agree with the bitmap and
+    // the directory records of the same transaction. A disk without a superblock has nowhere to keep them.
+    freeingShow(1);
+
+    cs1550_superblock counted = superblock;
+
+    counted.freeBlocks = freeBlocks + freeingBlocks;
+    counted.files = __atomic_load_n(&fileTotal, __ATOMIC_RELAXED);
+
+    if(ret == 0 && superblock.magic == SUPERBLOCK_MAGIC &&
+       (counted.freeBlocks != superblock.freeBlocks || counted.files != superblock.files))
+    {
+        ret = journalAppend(txn, JOURNAL_DISK, 0, &counted, sizeof(cs1550_superblock));
+    }
+
+    pthread_mutex_unlock(&allocLock);
+
+    pthread_rwlock_rdlock(&namespaceLock);
+
+    for(i = 0; i < dirCount && ret == 0; i++)
+    {
+        cs1550_cached_dir *dir = dirCache[i];
+        int j;
+
+        if(dir->dirtyCount == 0) continue;
+
+        pthread_rwlock_rdlock(&dir->lock);
+
+        for(j = 0; j < dir->dirtyCount && ret == 0; j++)
+        {
+            cs1550_dir_record *record = dir->records[dir->dirtyRecords[j]];
+
+            ret = journalAppend(txn, JOURNAL_DIRECTORIES, record->offset, &record->entry,
+                                sizeof(cs1550_directory_entry));
+        }
+
+        pthread_rwlock_unlock(&dir->lock);
+    }
+
+    pthread_rwlock_unlock(&namespaceLock);
+
+    if(ret == 0) ret = cacheJournal(tid, txn);
+
+    // Only now that the copy is complete can the dirty marks go.
+    if(ret == 0)
+    {
+        pthread_mutex_lock(&allocLock);
+        memset(bitmapDirty, 0, superblock.bitmapBlocks);
+        freeingHandOver();
+        superblock.freeBlocks = counted.freeBlocks;
+        superblock.files = counted.files;
+        pthread_mutex_unlock(&allocLock);
+
+        pthread_rwlock_rdlock(&namespaceLock);
+        for(i = 0; i < dirCount; i++)
+        {
+            cs1550_cached_dir *dir = dirCache[i];
+            int j, kept = 0;
+
+            if(dir->dirtyCount == 0) continue;
+
+            // The copy holds every size a record had, so they have been written back too.
+            for(j = 0; j < dir->dirtyCount; j++)
+            {
+                dir->records[dir->dirtyRecords[j]]->dirty = 0;
+                dir->records[dir->dirtyRecords[j]]->sizesDirty = 0;
+            }
+
+            for(j = 0; j < dir->grownCount; j++)
+            {
+                if(dir->records[dir->grownRecords[j]]->sizesDirty) dir->grownRecords[kept++] = dir->grownRecords[j];
+            }
+
+            dir->dirtyCount = 0;
+            dir->grownCount = kept;
+        }
+        pthread_rwlock_unlock(&namespaceLock);
+    }
+
+    pthread_mutex_lock(&journalLock);
+
+    if(ret == 0)
+    {
+        __atomic_store_n(&journalTid, tid + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&journalPending, 0, __ATOMIC_RELAXED);
+    }
+
+    journalFrozen = 0;
+    pthread_cond_broadcast(&journalCond);
+
+    pthread_mutex_unlock(&journalLock);
+
+    if(ret != 0)
+    {
+        LOG_ERROR("Out of memory putting a journal transaction together.");
+        return 0;
+    }
+
+    return tid;
+}
+
+
+// Writes the journal header. commitLock must be held (or we must be mounting).
+static int journalWriteHeader(void)
+{
+    char block[blockSize];
+    cs1550_journal_header header;
+
+    memset(block, 0, sizeof(block));
+
+    header.magic = JOURNAL_MAGIC;
+    header.tail = journalTail % JOURNAL_RING_BLOCKS;
+    header.tailSeq = journalTailSeq;
+
+    memcpy(block, &header, sizeof(header));
+
+    return diskWrite(block, blockSize, (off_t) JOURNAL_START * blockSize) == blockSize ? 0 : -1;
+}
+
+
+// Reads or writes count blocks of the ring starting at ring block position, wrapping around the end.
+static int journalRing(char *buf, unsigned long position, unsigned long count, int write)
+{
+    while(count > 0)
+    {
+        unsigned long at = position % JOURNAL_RING_BLOCKS;
+        unsigned long run = JOURNAL_RING_BLOCKS - at;
+
+        if(run > count) run = count;
+
+        size_t bytes = run * blockSize;
+        off_t offset = (off_t) (JOURNAL_RING_START + at) * blockSize;
+
+        if(write && diskWrite(buf, bytes, offset) != (int) bytes) return -1;
+        if(!write && diskRead(buf, bytes, offset) != (int) bytes) return -1;
+
+        buf += bytes;
+        position += run;
+        count -= run;
+    }
+
+    return 0;
+}
+
+
+// Writes every record of a transaction to where it belongs. If tid isn't 0, blocks that transaction pinned in the
+// cache are let go as well.
+static int journalApply(const char *data, size_t length, unsigned long tid)
+{
+    size_t at = sizeof(cs1550_journal_txn);
+    int ret = 0;
+
+    while(at + sizeof(cs1550_journal_record) <= length)
+    {
+        cs1550_journal_record record;
+
+        memcpy(&record, data + at, sizeof(record));
+        at += sizeof(record);
+
+        if(record.length < 0 || at + record.length > length) return -1;
+
+        const char *image = data + at;
+
+        if(record.target == JOURNAL_DIRECTORIES)
+        {
+            if(directoriesWrite(image, record.length, record.offset) != record.length) ret = -1;
+        }
+        else
+        {
+            if(diskWrite(image, record.length, record.offset) != record.length) ret = -1;
+
+            if(tid != 0 && record.length == blockSize) cacheUnpin(record.offset / blockSize, tid, image);
+        }
+
+        at += record.length;
+    }
+
+    return ret;
+}
+
+
+// Writes a transaction to the ring and syncs it, data blocks first. Until that has all worked nothing of it may go in
+// place, so on failure the ring is left as it was. commitLock must be held. Returns 0 once it is on disk, or -1.
+static int journalWrite(cs1550_journal_buffer *txn)
+{
+    unsigned long nBlocks = (txn->length + blockSize - 1) / blockSize;
+    cs1550_journal_txn header;
+
+    // File data goes first, so a committed inode never points at blocks that hold something else.
+    if(cacheFlush() != 0 || storageSync() != 0) return -1;
+
+    if(txn->length <= sizeof(cs1550_journal_txn)) return 0;
+
+    if(nBlocks > JOURNAL_RING_BLOCKS)
+    {
+        // Can't happen as long as journalEnd() keeps transactions small, but if it does the best we can do is write
+        // the changes in place.
+        LOG_ERROR("Journal transaction of %lu blocks doesn't fit, writing it in place.", nBlocks);
+        return 0;
+    }
+
+    // Make room by syncing what earlier transactions put in place; then the ring doesn't need them.
+    if(journalHead - journalTail + nBlocks > JOURNAL_RING_BLOCKS)
+    {
+        journalTail = journalHead;
+        journalTailSeq = journalSeq;
+
+        if(journalWriteHeader() != 0 || storageSync() != 0) return -1;
+    }
+
+    if(txn->capacity < nBlocks * blockSize)
+    {
+        char *grown = (char *) realloc(txn->data, nBlocks * blockSize);
+
+        if(grown == NULL) return -1;
+
+        txn->data = grown;
+        txn->capacity = nBlocks * blockSize;
+    }
+
+    memset(txn->data + txn->length, 0, nBlocks * blockSize - txn->length);
+
+    header.magic = JOURNAL_TXN_MAGIC;
+    header.checksum = 0;
+    header.seq = journalSeq;
+    header.nBlocks = nBlocks;
+    header.length = txn->length;
+
+    memcpy(txn->data, &header, sizeof(header));
+    header.checksum = journalChecksum(txn->data, txn->length);
+    memcpy(txn->data, &header, sizeof(header));
+
+    if(journalRing(txn->data, journalHead, nBlocks, 1) != 0 || storageSync() != 0) return -1;
+
+    journalHead += nBlocks;
+    journalSeq++;
+
+    return 0;
+}
+
+
+// Commits the running transaction and waits until it is on disk. commitLock must be held.
+static int journalCommitLocked(void)
+{
+    cs1550_journal_buffer txn = { NULL, 0, 0 };
+    unsigned long tid = journalRetryTid;
+    int retried = tid != 0;
+    int ret = 0;
+
+    // One that failed before has to reach the ring ahead of anything newer.
+    if(retried)
+    {
+        txn = journalRetry;
+        journalRetryTid = 0;
+    }
+    else if((tid = journalCapture(&txn)) == 0)
+    {
+        free(txn.data);
+        return -1;
+    }
+
+    if(journalWrite(&txn) != 0)
+    {
+        // Keep it for next time. Its blocks stay pinned in the cache, so they don't reach their places before it is
+        // in the ring, and what it freed stays taken until a later commit.
+        freeingRelease(0);
+
+        journalRetry = txn;
+        journalRetryTid = tid;
+
+        LOG_ERROR("Journal commit failed, it will be tried again.");
+        return -1;
+    }
+
+    // Only now that the commit record is safely on disk can blocks freed in the transaction be written over.
+    freeingRelease(1);
+
+    if(txn.length > sizeof(cs1550_journal_txn) && journalApply(txn.data, txn.length, tid) != 0)
+    {
+        // The ring has it, so the next mount puts it in place again.
+        LOG_ERROR("Couldn't put a committed journal transaction in place.");
+        ret = -1;
+    }
+
+    committedTid = tid;
+
+    free(txn.data);
+
+    // What came after the one that failed is still in the running transaction.
+    if(retried && ret == 0) ret = journalCommitLocked();
+
+    return ret;
+}
+
+
+// Commits the running transaction now.
+int journalCommit(void)
+{
+    pthread_mutex_lock(&commitLock);
+
+    int ret = journalCommitLocked();
+
+    pthread_mutex_unlock(&commitLock);
+
+    return ret;
+}
+
+
+// Makes sure everything done so far is on disk. Threads that call this at the same time share one commit: whoever
+// gets commitLock last finds its changes already committed by the one before.
+int journalSync(void)
+{
+    unsigned long needed = journalRunningTid();
+    int ret = 0;
+
+    pthread_mutex_lock(&commitLock);
+
+    if(committedTid < needed) ret = journalCommitLocked();
+
+    pthread_mutex_unlock(&commitLock);
+
+    return ret;
+}
+
+
+
+// Called at mount, before anything else reads the bitmap or the directories. Puts back every transaction that made it
+// into the ring, then empties the ring.
+int journalReplay(void)
+{
+    char block[blockSize];
+    cs1550_journal_header header;
+    int replayed = 0;
+
+    if(diskRead(block, blockSize, (off_t) JOURNAL_START * blockSize) != blockSize) return -1;
+
+    memcpy(&header, block, sizeof(header));
+
+    if(header.magic != JOURNAL_MAGIC || header.tail >= JOURNAL_RING_BLOCKS)
+    {
+        // A disk that has never been mounted
+        header.tail = 0;
+        header.tailSeq = 1;
+    }
+
+    unsigned long position = header.tail;
+    unsigned long seq = header.tailSeq;
+    unsigned long used = 0;
+    char *data = NULL;
+
+    while(used < JOURNAL_RING_BLOCKS)
+    {
+        cs1550_journal_txn txn;
+
+        // Only what is in the ring ends it. Going on without what we couldn't read would drop it for good.
+        if(journalRing(block, position, 1, 0) != 0)
+        {
+            free(data);
+            return -1;
+        }
+
+        memcpy(&txn, block, sizeof(txn));
+
+        if(txn.magic != JOURNAL_TXN_MAGIC || txn.seq != seq) break;
+        if(txn.nBlocks == 0 || used + txn.nBlocks > JOURNAL_RING_BLOCKS) break;
+        if(txn.length < sizeof(txn) || txn.length > txn.nBlocks * blockSize) break;
+
+        char *grown = (char *) realloc(data, txn.nBlocks * blockSize);
+
+        if(grown == NULL || journalRing(grown, position, txn.nBlocks, 0) != 0)
+        {
+            free(grown != NULL ? grown : data);
+            return -1;
+        }
+
+        data = grown;
+
+        // A transaction that didn't get all the way to disk before the crash doesn't count, and neither does anything
+        // after it.
+        unsigned int checksum = txn.checksum;
+        memset(data + offsetof(cs1550_journal_txn, checksum), 0, sizeof(txn.checksum));
+        if(journalChecksum(data, txn.length) != checksum) break;
+
+        if(journalApply(data, txn.length, 0) != 0)
+        {
+            free(data);
+            return -1;
+        }
+
+        position = (position + txn.nBlocks) % JOURNAL_RING_BLOCKS;
+        used += txn.nBlocks;
+        seq++;
+        replayed++;
+    }
+
+    free(data);
+
+    if(replayed > 0 && storageSync() != 0) return -1;
+
+    journalHead = position;
+    journalTail = position;
+    journalSeq = seq;
+    journalTailSeq = seq;
+
+    if(journalWriteHeader() != 0 || storageSync() != 0) return -1;
+
+    // Replay may have put back directory records past what was the end of .directories.
+    struct stat st;
+
+    if(fstat(directoriesFd, &st) == 0) directoriesSize = st.st_size - st.st_size % sizeof(cs1550_directory_entry);
+
+    if(replayed > 0) LOG_INFO("Replayed %d journal transactions.", replayed);
+
+    return 0;
+}
+
+
+// Called at unmount: commits what is left, and empties the ring so the next mount has nothing to replay.
+int journalClose(void)
+{
+    pthread_mutex_lock(&commitLock);
+
+    int ret = journalCommitLocked();
+
+    if(storageSync() != 0) ret = -1;
+
+    journalTail = journalHead;
+    journalTailSeq = journalSeq;
+
+    if(journalWriteHeader() != 0 || storageSync() != 0) ret = -1;
+
+    // A transaction that still couldn't be committed is lost with the mount.
+    free(journalRetry.data);
+    memset(&journalRetry, 0, sizeof(journalRetry));
+    journalRetryTid = 0;
+
+    pthread_mutex_unlock(&commitLock);
+
+    return ret;
+}
+
+
+// The checkpoint thread. Every options.commitInterval seconds it places the blocks files hold, writes back the sizes
+// of files that have grown and commits, so changes nobody fsyncs still reach the disk before long.
+static void *checkpointLoop(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&checkpointLock);
+
+    while(!checkpointStop)
+    {
+        struct timespec until;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+        until.tv_sec += options.commitInterval;
+
+        if(pthread_cond_timedwait(&checkpointCond, &checkpointLock, &until) != ETIMEDOUT || checkpointStop) continue;
+
+        pthread_mutex_unlock(&checkpointLock);
+
+        delallocFlush(NULL, DELALLOC_GROW);
+        writeBackSizes(NULL);
+
+        if(__atomic_load_n(&journalPending, __ATOMIC_RELAXED) > 0) journalCommit();
+
+        pthread_mutex_lock(&checkpointLock);
+    }
+
+    pthread_mutex_unlock(&checkpointLock);
+
+    return NULL;
+}
+
+
+// Starts the checkpoint thread. Called at mount, once the journal has been replayed.
+int checkpointStart(void)
+{
+    checkpointStop = 0;
+
+    if(pthread_create(&checkpointThread, NULL, checkpointLoop, NULL) != 0)
+    {
+        LOG_ERROR("Couldn't start the checkpoint thread.");
+        return -1;
+    }
+
+    checkpointRunning = 1;
+
+    return 0;
+}
+
+
+// Stops the checkpoint thread and waits for it to finish what it is doing. Called at unmount, before journalClose().
+void checkpointEnd(void)
+{
+    if(!checkpointRunning) return;
+
+    pthread_mutex_lock(&checkpointLock);
+    checkpointStop = 1;
+    pthread_cond_signal(&checkpointCond);
+    pthread_mutex_unlock(&checkpointLock);
+
+    pthread_join(checkpointThread, NULL);
+
+    checkpointRunning = 0;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+           READAHEAD
+
+ * * * * * * * * * * * * * * */
+
+
+// Makes the readahead state for a file being opened. Returns NULL if there's no memory for it, and the file is then
+// read without readahead.
+cs1550_readahead *readaheadOpen(void)
+{
+    cs1550_readahead *ra = (cs1550_readahead *) malloc(sizeof(cs1550_readahead));
+
+    if(ra == NULL) return NULL;
+
+    pthread_mutex_init(&ra->lock, NULL);
+    ra->next = 0;
+    ra->window = READAHEAD_MIN_BLOCKS;
+    ra->end = 0;
+
+    return ra;
+}
+
+
+void readaheadClose(cs1550_readahead *ra)
+{
+    if(ra == NULL) return;
+
+    pthread_mutex_destroy(&ra->lock);
+    free(ra);
+}
+
+
+// Hands blocks from up to to of a file to the readahead thread. Returns 0, or -1 if it is too busy to take them.
+static int readaheadQueueAdd(const char *directory, const char *filename, long inode, long from, long to)
+{
+    int ret = -1;
+
+    pthread_mutex_lock(&readaheadLock);
+
+    if(!readaheadStop && readaheadCount < READAHEAD_QUEUE)
+    {
+        cs1550_prefetch *request = &readaheadQueue[(readaheadHead + readaheadCount) % READAHEAD_QUEUE];
+
+        strcpy(request->directory, directory);
+        strcpy(request->filename, filename);
+        request->inode = inode;
+        request->from = from;
+        request->to = to;
+
+        readaheadCount++;
+        pthread_cond_signal(&readaheadCond);
+        ret = 0;
+    }
+
+    pthread_mutex_unlock(&readaheadLock);
+
+    return ret;
+}
+
+
+// Called for every read of size bytes at offset of an open file, with the file's lock held. Adjusts the window and,
+// if the file is being read sequentially, asks for the blocks after this read that haven't been asked for yet.
+void readaheadNote(cs1550_readahead *ra, const char *directory, const char *filename, long inode, size_t fsize,
+                   off_t offset, size_t size)
+{
+    long max = options.cacheBlocks / 4; //more than this would only push the blocks out before they are read
+
+    if(ra == NULL) return;
+
+    if(max > READAHEAD_MAX_BLOCKS) max = READAHEAD_MAX_BLOCKS;
+    if(max < 1) max = 1;
+
+    pthread_mutex_lock(&ra->lock);
+
+    int sequential = offset == ra->next;
+
+    if(sequential && offset / blockSize < ra->end) ra->window *= 2;
+    else ra->window /= 2;
+
+    if(ra->window > max) ra->window = max;
+    if(ra->window < READAHEAD_MIN_BLOCKS) ra->window = READAHEAD_MIN_BLOCKS < max ? READAHEAD_MIN_BLOCKS : max;
+
+    ra->next = offset + size;
+
+    if(!sequential) ra->end = 0;
+    else
+    {
+        long from = ra->next / blockSize;
+        long to = from + ra->window;
+        long blocks = (fsize + blockSize - 1) / blockSize;
+
+        if(from < ra->end) from = ra->end;
+        if(to > blocks) to = blocks;
+
+        if(from < to && readaheadQueueAdd(directory, filename, inode, from, to) == 0) ra->end = to;
+    }
+
+    pthread_mutex_unlock(&ra->lock);
+}
+
+
+// Loads the blocks of one request into the cache. They are only looked up with the file's lock held, and only if the
+// file still has the inode it had when they were asked for, so they can't belong to anything else by then.
+static void readaheadFetch(const cs1550_prefetch *request)
+{
+    pthread_rwlock_t *lock = fileLock(request->directory, request->filename);
+    struct cs1550_file_directory file;
+    long i;
+
+    pthread_rwlock_rdlock(lock);
+
+    int slot = getFile(request->directory, request->filename, &file);
+
+    // An inline file has nothing to read ahead: its inode is its data.
+    if(slot != -1 && file.nStartBlock == request->inode && inodeInline(request->inode) == 0)
+    {
+        for(i = request->from; i < request->to; i++)
+        {
+            long block = inodeBlockFor(request->inode, i, 0);
+
+            if(block == -1) break;
+            if(block != 0) cachePrefetch(block); //0 is a hole
+        }
+    }
+
+    pthread_rwlock_unlock(lock);
+}
+
+
+// The readahead thread: works through readaheadQueue until readaheadEnd() stops it.
+static void *readaheadLoop(void *arg)
+{
+    (void) arg;
+
+    pthread_mutex_lock(&readaheadLock);
+
+    while(!readaheadStop)
+    {
+        if(readaheadCount == 0)
+        {
+            pthread_cond_wait(&readaheadCond, &readaheadLock);
+            continue;
+        }
+
+        cs1550_prefetch request = readaheadQueue[readaheadHead];
+
+        readaheadHead = (readaheadHead + 1) % READAHEAD_QUEUE;
+        readaheadCount--;
+
+        pthread_mutex_unlock(&readaheadLock);
+
+        readaheadFetch(&request);
+
+        pthread_mutex_lock(&readaheadLock);
+    }
+
+    pthread_mutex_unlock(&readaheadLock);
+
+    return NULL;
+}
+
+
+// Starts the readahead thread. Called at mount, once the block cache is up.
+int readaheadStart(void)
+{
+    pthread_mutex_lock(&readaheadLock);
+    readaheadStop = 0;
+    readaheadHead = 0;
+    readaheadCount = 0;
+    pthread_mutex_unlock(&readaheadLock);
+
+    if(pthread_create(&readaheadThread, NULL, readaheadLoop, NULL) != 0)
+    {
+        LOG_ERROR("Couldn't start the readahead thread.");
+        readaheadEnd();
+        return -1;
+    }
+
+    readaheadRunning = 1;
+
+    return 0;
+}
+
+
+// Stops the readahead thread, dropping whatever it hasn't got to yet. Called at unmount, before the cache goes away.
+void readaheadEnd(void)
+{
+    pthread_mutex_lock(&readaheadLock);
+    readaheadStop = 1;
+    readaheadCount = 0;
+    pthread_cond_signal(&readaheadCond);
+    pthread_mutex_unlock(&readaheadLock);
+
+    if(!readaheadRunning) return;
+
+    pthread_join(readaheadThread, NULL);
+
+    readaheadRunning = 0;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+           DEFRAG
+
+ * * * * * * * * * * * * * * */
+
+
+// Notes that a file was just read or written, so the defrag thread keeps out of the way for a while.
+void noteActivity(void)
+{
+    __atomic_store_n(&lastActivity, traceNow(), __ATOMIC_RELAXED);
+}
+
+
+// Has nothing read or written a file for DEFRAG_IDLE_MS?
+static int defragIdle(void)
+{
+    return traceNow() - __atomic_load_n(&lastActivity, __ATOMIC_RELAXED) >= DEFRAG_IDLE_MS * 1000000LL;
+}
+
+
+// Looks up the first count data blocks of a file, 0 for a hole. Returns how many pieces the allocated ones are in
+// (setting allocated to how many there are), or -1.
+static int defragExtents(long inode, long count, long *blocks, long *allocated)
+{
+    long previous = -1;
+    int extents = 0;
+    long i;
+
+    *allocated = 0;
+
+    for(i = 0; i < count; i++)
+    {
+        blocks[i] = inodeBlockFor(inode, i, 0);
+
+        if(blocks[i] == -1) return -1;
+        if(blocks[i] == 0) continue;
+
+        if(blocks[i] != previous + 1) extents++;
+
+        previous = blocks[i];
+        (*allocated)++;
+    }
+
+    return extents;
+}
+
+
+// Moves the allocated blocks of a file (as defragExtents() found them) into one run of free blocks, in order, if they
+// are in pieces or there is a free run for them lower down the disk. The inode and indirect blocks stay where they
+// are. The file's lock must be held for writing, inside journalBegin()/journalEnd(). Returns how many blocks moved.
+static long defragMove(long inode, long count, const long *blocks, int extents, long allocated)
+{
+    char data[blockSize];
+    long first = 0;
+    long moved = 0;
+    long i;
+
+    for(i = 0; i < count && first == 0; i++)
+    {
+        first = blocks[i];
+    }
+
+    pthread_mutex_lock(&allocLock);
+
+    int target = freeBlocks - reservedBlocks >= allocated ? nextFreeRunFit(allocated) : -1;
+
+    if(target != -1 && (extents > 1 || target < first)) markRun(target, allocated, 1);
+    else target = -1;
+
+    pthread_mutex_unlock(&allocLock);
+
+    if(target == -1) return 0;
+
+    STAT_ADD(STAT_BLOCKS_ALLOCATED, allocated);
+
+    // The copy goes through the cache, so the journal commit that points the file at it writes it out first.
+    for(i = 0; i < count; i++)
+    {
+        if(blocks[i] == 0) continue;
+
+        long to = target + moved;
+
+        if(cacheRead(data, blockSize, (off_t) blocks[i] * blockSize) == -1 ||
+           cacheWrite(data, blockSize, (off_t) to * blockSize) == -1 || inodeSetBlock(inode, i, to) != 0) break;
+
+        cacheDiscard(blocks[i], 1);
+        removeFileFromMemory(blocks[i], 1);
+        moved++;
+    }
+
+    if(moved < allocated) removeFileFromMemory(target + moved, allocated - moved);
+
+    if(moved > 0)
+    {
+        STAT_ADD(STAT_DEFRAG_FILES, 1);
+        STAT_ADD(STAT_DEFRAG_BLOCKS, moved);
+    }
+
+    return moved;
+}
+
+
+// Takes the next file in .directories and defragments it if it needs it. Returns how many blocks were moved, or -1
+// when there are no more files, and the next call starts over from the first one.
+static long defragOne(void)
+{
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    long inode = 0;
+
+    pthread_rwlock_rdlock(&namespaceLock);
+
+    while(inode == 0 && defragNextDir < dirCount)
+    {
+        cs1550_cached_dir *dir = dirCache[defragNextDir];
+
+        pthread_rwlock_rdlock(&dir->lock);
+
+        if(defragNextFile < dir->recordCount * FILES_PER_RECORD)
+        {
+            struct cs1550_file_directory *file = dirFile(dir, defragNextFile);
+
+            strcpy(directory, dir->dname);
+            strcpy(filename, file->fname);
+            inode = file->nStartBlock; //0 for an unused slot, which is skipped
+            defragNextFile++;
+        }
+        else
+        {
+            defragNextDir++;
+            defragNextFile = 0;
+        }
+
+        pthread_rwlock_unlock(&dir->lock);
+    }
+
+    pthread_rwlock_unlock(&namespaceLock);
+
+    if(inode == 0)
+    {
+        __atomic_store_n(&defragFragmented, defragSeen, __ATOMIC_RELAXED);
+        defragSeen = 0;
+        defragNextDir = 0;
+        defragNextFile = 0;
+        return -1;
+    }
+
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+    struct cs1550_file_directory file;
+    long *blocks = NULL;
+    long moved = 0;
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    // The file may have gone, or been replaced by another of the same name, since we let go of its directory.
+    int slot = getFile(directory, filename, &file);
+    long count = slot != -1 ? (long) ((file.fsize + blockSize - 1) / blockSize) : 0;
+
+    // A pass over every file is also when what a crash left preallocated past their ends is given back.
+    if(slot != -1 && file.nStartBlock == inode && inodeValid(inode)) preallocRecover(inode, file.fsize);
+
+    if(slot != -1 && file.nStartBlock == inode && count > 0 && count <= DEFRAG_MAX_BLOCKS &&
+       inodeValid(inode) && inodeInline(inode) == 0 && (blocks = (long *) malloc(count * sizeof(long))) != NULL)
+    {
+        long allocated;
+        int extents = defragExtents(inode, count, blocks, &allocated);
+
+        if(extents > 1) defragSeen++;
+
+        if(extents > 0) moved = defragMove(inode, count, blocks, extents, allocated);
+    }
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    free(blocks);
+
+    return moved;
+}
+
+
+// The defrag thread. While the filesystem is idle it goes through the files one at a time, and after moving one it
+// waits as long as options.defragRate says the blocks it moved should take.
+static void *defragLoop(void *arg)
+{
+    long long wait = 0;
+    long passMoved = 0;
+
+    (void) arg;
+
+    pthread_mutex_lock(&defragLock);
+
+    while(!__atomic_load_n(&defragStop, __ATOMIC_RELAXED))
+    {
+        struct timespec until;
+
+        clock_gettime(CLOCK_REALTIME, &until);
+
+        if(wait <= 0) wait = DEFRAG_IDLE_MS * 1000000LL;
+
+        until.tv_sec += wait / 1000000000LL;
+        until.tv_nsec += wait % 1000000000LL;
+
+        if(until.tv_nsec >= 1000000000L)
+        {
+            until.tv_sec++;
+            until.tv_nsec -= 1000000000L;
+        }
+
+        if(pthread_cond_timedwait(&defragCond, &defragLock, &until) != ETIMEDOUT) continue;
+
+        pthread_mutex_unlock(&defragLock);
+
+        long moved = 0;
+
+        wait = 0;
+
+        while(moved == 0 && defragIdle() && !__atomic_load_n(&defragStop, __ATOMIC_RELAXED))
+        {
+            moved = defragOne();
+        }
+
+        if(moved > 0)
+        {
+            passMoved += moved;
+            wait = moved * 1000000000LL / options.defragRate;
+        }
+        else if(moved == -1)
+        {
+            // A whole pass without anything to move: the disk is as good as it gets until something changes.
+            if(passMoved == 0) wait = DEFRAG_REST * 1000000000LL;
+            passMoved = 0;
+        }
+
+        pthread_mutex_lock(&defragLock);
+    }
+
+    pthread_mutex_unlock(&defragLock);
+
+    return NULL;
+}
+
+
+// Starts the defrag thread, unless -o nodefrag says not to. Called at mount, once everything else is up.
+int defragStart(void)
+{
+    if(options.noDefrag) return 0;
+
+    __atomic_store_n(&defragStop, 0, __ATOMIC_RELAXED);
+    noteActivity();
+
+    if(pthread_create(&defragThread, NULL, defragLoop, NULL) != 0)
+    {
+        LOG_ERROR("Couldn't start the defrag thread.");
+        return -1;
+    }
+
+    defragRunning = 1;
+
+    return 0;
+}
+
+
+// Stops the defrag thread, waiting for it to finish moving whatever file it is on. Called at unmount, first.
+void defragEnd(void)
+{
+    if(!defragRunning) return;
+
+    pthread_mutex_lock(&defragLock);
+    __atomic_store_n(&defragStop, 1, __ATOMIC_RELAXED);
+    pthread_cond_signal(&defragCond);
+    pthread_mutex_unlock(&defragLock);
+
+    pthread_join(defragThread, NULL);
+
+    defragRunning = 0;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+        HELPER FUNCTIONS
+
+ * * * * * * * * * * * * * * */
+
+
+// Reverses the bits of a byte. The on-disk bitmap is indexed left to right (block 0 is the high bit of byte 0) while
+// the in-memory words are indexed from the low bit so that ctz can be used on them.
+static unsigned char reverseBits(unsigned char b)
+{
+    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
+    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
+    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
+    return b;
+}
+
+
+// Reads the on-disk bitmap into memory. Called once at mount.
+int loadBitmap(void)
+{
+    int nodes = 2;
+    int i;
+
+    // Every node of the extent index is below twice the smallest power of two that covers the disk.
+    while(nodes < 2 * blockCount) nodes *= 2;
+
+    unloadBitmap();
+
+    unsigned char *bytes = (unsigned char *) malloc(BITMAP_BYTES);
+    bitmap = (uint64_t *) calloc(BITMAP_WORDS, sizeof(uint64_t));
+    bitmapDirty = (unsigned char *) calloc(superblock.bitmapBlocks, 1);
+    extentTree = (cs1550_extent_node *) calloc(nodes, sizeof(cs1550_extent_node));
+
+    if(bytes == NULL || bitmap == NULL || bitmapDirty == NULL || extentTree == NULL)
+    {
+        LOG_ERROR("Not enough memory for the bitmap of %d blocks.", blockCount);
+        free(bytes);
+        return -1;
+    }
+
+    if(diskRead(bytes, BITMAP_BYTES, (off_t) superblock.bitmapStart * blockSize) != BITMAP_BYTES)
+    {
+        LOG_ERROR("Couldn't read the bitmap from .disk.");
+        free(bytes);
+        return -1;
+    }
+
+    for(i = 0; i < BITMAP_BYTES; i++)
+    {
+        bitmap[i / 8] |= (uint64_t) reverseBits(bytes[i]) << (8 * (i % 8));
+    }
+
+    free(bytes);
+
+    // The superblock, the bitmap and the journal live in the first blocks of the disk, so they can never be handed out.
+    for(i = 0; i < (int) superblock.dataStart; i++)
+    {
+        if(blockStatus(i) == 0)
+        {
+            bitmap[i / 64] |= (uint64_t) 1 << (i % 64);
+            bitmapDirty[i / 8 / blockSize] = 1;
+        }
+    }
+
+    extentIndexBuild(1, 0, blockCount - 1);
+
+    int used = 0;
+    for(i = 0; i < BITMAP_WORDS; i++)
+    {
+        used += __builtin_popcountll(bitmap[i]);
+    }
+
+    freeBlocks = blockCount - used;
+
+    LOG_INFO("Loaded bitmap: %d of %d blocks in use.", used, blockCount);
+
+    return 0;
+}
+
+
+// Frees what loadBitmap() allocated. Called at unmount.
+void unloadBitmap(void)
+{
+    free(bitmap);
+    free(bitmapDirty);
+    free(extentTree);
+    free(freeingRuns);
+
+    bitmap = NULL;
+    bitmapDirty = NULL;
+    extentTree = NULL;
+    freeingRuns = NULL;
+    freeingCount = 0;
+    freeingCapacity = 0;
+    freeingBlocks = 0;
+}
+
+
+// Puts block number block of the on-disk bitmap into bytes, the way it is laid out on disk. Returns how many bytes of
+// the block the bitmap uses. allocLock must be held.
+int bitmapBlockBytes(int block, unsigned char *bytes)
+{
+    int first = block * blockSize;
+    int count = BITMAP_BYTES - first;
+    int i;
+
+    if(count > blockSize) count = blockSize;
+
+    for(i = 0; i < count; i++)
+    {
+        bytes[i] = reverseBits((unsigned char) (bitmap[(first + i) / 8] >> (8 * ((first + i) % 8))));
+    }
+
+    return count;
+}
+
+
+// Given a block, mark said block as taken
+int markTaken(int blockNum)
+{
+    markRun(blockNum, 1, 1);
+    return 0;
+}
+
+
+// Given a block, marks said block as free
+int markFree(int blockNum)
+{
+    markRun(blockNum, 1, 0);
+    return 0;
+}
+
+
+// Sets (taken) or clears the bits of count blocks starting at startBlock, in the bitmap only. Returns how many of them
+// changed. allocLock must be held.
+static int bitmapSetRun(int startBlock, int count, int taken)
+{
+    int block = startBlock;
+    int end = startBlock + count;
+    int changed = 0;
+
+    while(block < end)
+    {
+        int bit = block % 64;
+        int bits = 64 - bit;
+
+        if(bits > end - block) bits = end - block;
+
+        uint64_t mask = (bits == 64) ? ~(uint64_t) 0 : (((uint64_t) 1 << bits) - 1) << bit;
+
+        if(taken)
+        {
+            changed += __builtin_popcountll(mask & ~bitmap[block / 64]);
+            bitmap[block / 64] |= mask;
+        }
+        else
+        {
+            changed += __builtin_popcountll(mask & bitmap[block / 64]);
+            bitmap[block / 64] &= ~mask;
+        }
+
+        block += bits;
+    }
+
+    return changed;
+}
+
+
+// Notes that the on-disk bitmap blocks holding the bits of count blocks starting at startBlock need to be written back.
+// allocLock must be held.
+static void bitmapTouch(int startBlock, int count)
+{
+    int byteIndex;
+    int indexIntoByte;
+    int lastByteIndex;
+    int block;
+
+    blockToByteTranslation(startBlock, &byteIndex, &indexIntoByte);
+    blockToByteTranslation(startBlock + count - 1, &lastByteIndex, &indexIntoByte);
+
+    for(block = byteIndex / blockSize; block <= lastByteIndex / blockSize; block++)
+    {
+        bitmapDirty[block] = 1;
+    }
+}
+
+
+// Marks count blocks starting at startBlock as taken (1) or free (0) in both the bitmap and the free extent index.
+// allocLock must be held.
+void markRun(int startBlock, int count, int taken)
+{
+    if(count <= 0) return;
+
+    // Only the bits that actually change move the count; markTaken() on a taken block changes nothing.
+    int changed = bitmapSetRun(startBlock, count, taken);
+
+    freeBlocks += taken ? -changed : changed;
+
+    bitmapTouch(startBlock, count);
+
+    extentIndexSet(1, 0, blockCount - 1, startBlock, startBlock + count - 1, taken ? EXTENT_TAKEN : EXTENT_FREE);
+}
+
+
+// Puts count blocks starting at startBlock, which the running transaction frees, on freeingRuns. The bitmap it commits
+// shows them free, but they stay taken until then: after a crash before the commit, the inode that pointed at them
+// comes back, so nothing else may be written into them yet. allocLock must be held. Returns 0, or -1 if we are out
+// of memory.
+static int freeingAdd(int startBlock, int count)
+{
+    cs1550_free_run *last = freeingCount > 0 ? &freeingRuns[freeingCount - 1] : NULL;
+
+    if(last != NULL && last->start + last->count == startBlock) last->count += count;
+    else
+    {
+        if(freeingCount == freeingCapacity)
+        {
+            int capacity = freeingCapacity > 0 ? freeingCapacity * 2 : 64;
+            cs1550_free_run *grown = (cs1550_free_run *) realloc(freeingRuns, capacity * sizeof(cs1550_free_run));
+
+            if(grown == NULL) return -1;
+
+            freeingRuns = grown;
+            freeingCapacity = capacity;
+        }
+
+        freeingRuns[freeingCount].start = startBlock;
+        freeingRuns[freeingCount++].count = count;
+    }
+
+    freeingBlocks += count;
+    bitmapTouch(startBlock, count);
+
+    return 0;
+}
+
+
+// Clears the bits of every block on freeingRuns (taken == 0), so a copy of the bitmap taken now shows them free, or
+// sets them again once the copy is done (taken == 1). Nothing else sees the bitmap in between. allocLock must be held.
+void freeingShow(int taken)
+{
+    int i;
+
+    for(i = 0; i < freeingCount; i++) bitmapSetRun(freeingRuns[i].start, freeingRuns[i].count, taken);
+}
+
+
+// Hands the blocks on freeingRuns to the transaction being committed, whose bitmap has just been copied. allocLock and
+// commitLock must be held.
+void freeingHandOver(void)
+{
+    free(committingRuns);
+
+    committingRuns = freeingRuns;
+    committingCount = freeingCount;
+
+    freeingRuns = NULL;
+    freeingCount = 0;
+    freeingCapacity = 0;
+}
+
+
+// Says that this thread sends the reply to the read it is about to do before it calls spliceEnd(), so the reply may
+// point at blocks of .disk instead of copying them. Blocks freed after the file's lock is let go then aren't handed out
+// again until the reply is sent.
+void spliceBegin(void)
+{
+    pthread_mutex_lock(&spliceLock);
+    splicePin = spliceEpoch;
+    spliceReplies[splicePin]++;
+    pthread_mutex_unlock(&spliceLock);
+}
+
+
+// Says that the reply spliceBegin() was called for has been sent.
+void spliceEnd(void)
+{
+    if(splicePin == -1) return;
+
+    pthread_mutex_lock(&spliceLock);
+    if(--spliceReplies[splicePin] == 0) pthread_cond_broadcast(&spliceCond);
+    splicePin = -1;
+    pthread_mutex_unlock(&spliceLock);
+}
+
+
+// Waits until every reply begun before now has been sent. Replies begun after it can't point at blocks that were
+// already freed, since the file's lock kept them from being read. Must be called without allocLock or a file's lock.
+static void spliceDrain(void)
+{
+    pthread_mutex_lock(&spliceLock);
+
+    int old = spliceEpoch;
+
+    spliceEpoch = !old;
+
+    while(spliceReplies[old] > 0) pthread_cond_wait(&spliceCond, &spliceLock);
+
+    pthread_mutex_unlock(&spliceLock);
+}
+
+
+// Gives the blocks the transaction just committed freed back to the allocator. If the commit failed, they wait for the
+// next one instead. commitLock must be held.
+void freeingRelease(int committed)
+{
+    int i;
+
+    // A read reply still on its way may point at them.
+    if(committed && committingCount > 0) spliceDrain();
+
+    pthread_mutex_lock(&allocLock);
+
+    for(i = 0; i < committingCount; i++)
+    {
+        int start = committingRuns[i].start;
+        int count = committingRuns[i].count;
+
+        freeingBlocks -= count;
+
+        // The bitmap the commit wrote shows them free already, so only our copy of it has to change.
+        if(committed || freeingAdd(start, count) != 0)
+        {
+            freeBlocks += bitmapSetRun(start, count, 0);
+            extentIndexSet(1, 0, blockCount - 1, start, start + count - 1, EXTENT_FREE);
+        }
+    }
+
+    pthread_mutex_unlock(&allocLock);
+
+    free(committingRuns);
+
+    committingRuns = NULL;
+    committingCount = 0;
+}
+
+
+// Determines if the given block is free or taken
+int blockStatus(int blockNum)
+{
+    return (bitmap[blockNum / 64] >> (blockNum % 64)) & 1;
+}
+
+
+// Given a block number will return which byte that block can be found at in our file (and the index into our byte)
+void blockToByteTranslation(int blockNum, int *byteIndex, int *indexIntoByte)
+{
+    *byteIndex = blockNum / 8;
+    *indexIntoByte = blockNum % 8;
+}
+
+
+// Returns the first block at or after blockNum whose bit matches the given status, or blockCount if there is none.
+int nextBlockWithStatus(int blockNum, int status)
+{
+    if(blockNum >= blockCount) return blockCount;
+
+    int word = blockNum / 64;
+    uint64_t bits = status ? bitmap[word] : ~bitmap[word];
+
+    bits &= ~(uint64_t) 0 << (blockNum % 64); // ignore the blocks before blockNum
+
+    while(bits == 0)
+    {
+        word++;
+        if(word >= BITMAP_WORDS) return blockCount;
+        bits = status ? bitmap[word] : ~bitmap[word];
+    }
+
+    int found = word * 64 + __builtin_ctzll(bits);
+
+    return found < blockCount ? found : blockCount;
+}
+
+
+// Sets the summary of an extent index node whose whole range is either free or taken.
+static void extentIndexFill(int node, int length, int state)
+{
+    int run = (state == EXTENT_FREE) ? length : 0;
+
+    extentTree[node].prefix = run;
+    extentTree[node].suffix = run;
+    extentTree[node].longest = run;
+    extentTree[node].pending = state;
+}
+
+
+// Hands a pending fill down to the two children of an extent index node.
+static void extentIndexPush(int node, int lo, int hi)
+{
+    if(extentTree[node].pending == 0 || lo == hi) return;
+
+    int mid = (lo + hi) / 2;
+
+    extentIndexFill(2 * node, mid - lo + 1, extentTree[node].pending);
+    extentIndexFill(2 * node + 1, hi - mid, extentTree[node].pending);
+    extentTree[node].pending = 0;
+}
+
+
+// Recomputes an extent index node from its two children, joining the free run that crosses the middle.
+static void extentIndexPull(int node, int lo, int hi)
+{
+    int mid = (lo + hi) / 2;
+    cs1550_extent_node *left = &extentTree[2 * node];
+    cs1550_extent_node *right = &extentTree[2 * node + 1];
+
+    extentTree[node].prefix = left->prefix == mid - lo + 1 ? left->prefix + right->prefix : left->prefix;
+    extentTree[node].suffix = right->suffix == hi - mid ? right->suffix + left->suffix : right->suffix;
+
+    int longest = left->suffix + right->prefix;
+    if(left->longest > longest) longest = left->longest;
+    if(right->longest > longest) longest = right->longest;
+
+    extentTree[node].longest = longest;
+}
+
+
+// Builds the free extent index for blocks lo..hi from the in-memory bitmap.
+void extentIndexBuild(int node, int lo, int hi)
+{
+    extentTree[node].pending = 0;
+
+    if(lo == hi)
+    {
+        int run = blockStatus(lo) ? 0 : 1;
+
+        extentTree[node].prefix = run;
+        extentTree[node].suffix = run;
+        extentTree[node].longest = run;
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+
+    extentIndexBuild(2 * node, lo, mid);
+    extentIndexBuild(2 * node + 1, mid + 1, hi);
+    extentIndexPull(node, lo, hi);
+}
+
+
+// Marks blocks first..last as EXTENT_FREE or EXTENT_TAKEN in the free extent index.
+void extentIndexSet(int node, int lo, int hi, int first, int last, int state)
+{
+    if(last < lo || first > hi) return;
+
+    if(first <= lo && hi <= last)
+    {
+        extentIndexFill(node, hi - lo + 1, state);
+        return;
+    }
+
+    int mid = (lo + hi) / 2;
+
+    extentIndexPush(node, lo, hi);
+    extentIndexSet(2 * node, lo, mid, first, last, state);
+    extentIndexSet(2 * node + 1, mid + 1, hi, first, last, state);
+    extentIndexPull(node, lo, hi);
+}
+
+
+// Returns the lowest block that starts a free run of at least runLength blocks inside lo..hi.
+// The caller has to check that extentTree[node].longest >= runLength first.
+int extentIndexFirstFit(int node, int lo, int hi, int runLength)
+{
+    while(lo != hi)
+    {
+        int mid = (lo + hi) / 2;
+
+        extentIndexPush(node, lo, hi);
+
+        if(extentTree[2 * node].longest >= runLength)
+        { // It fits entirely in the left half
+            node = 2 * node;
+            hi = mid;
+        }
+        else if(extentTree[2 * node].suffix + extentTree[2 * node + 1].prefix >= runLength)
+        { // It fits across the middle
+            return mid - extentTree[2 * node].suffix + 1;
+        }
+        else
+        { // It has to be in the right half
+            node = 2 * node + 1;
+            lo = mid + 1;
+        }
+    }
+
+    return lo;
+}
+
+
+// Returns the length of the longest run of free blocks on the disk.
+int largestFreeRun(void)
+{
+    return extentTree[1].longest;
+}
+
+
+// Counts the runs the free blocks make up. Unlike freeBlocks this takes a walk over the whole bitmap. allocLock must be
+// held.
+unsigned long freeRunCount(void)
+{
+    uint64_t carry = 0; //was the last block of the word before free?
+    unsigned long runs = 0;
+    int i;
+
+    for(i = 0; i < BITMAP_WORDS; i++)
+    {
+        uint64_t free = ~bitmap[i];
+
+        if(i == BITMAP_WORDS - 1 && blockCount % 64 != 0) free &= ((uint64_t) 1 << (blockCount % 64)) - 1;
+
+        // A run starts at every free block whose neighbour below isn't free.
+        runs += __builtin_popcountll(free & ~((free << 1) | carry));
+
+        carry = free >> 63;
+    }
+
+    return runs;
+}
+
+
+// Detects the next sequence of blocks that a file of the given size can fit in, then returns the first block number in that run.
+int nextFreeRunFit(int sizeOfTargetRun)
+{
+    STAT_ADD(STAT_BITMAP_LOOKUPS, 1);
+
+    if(sizeOfTargetRun <= 0 || largestFreeRun() < sizeOfTargetRun) return -1;
+
+    return extentIndexFirstFit(1, 0, blockCount - 1, sizeOfTargetRun);
+}
+
+
+// Given a file, will move said file into memory and mark the bitmap appropriately. Returns startblock.
+int moveFileToMemory(void * data, int size)
+{
+    int tempSize = size;
+    int blocks = 0;
+
+    while(tempSize > 0)
+    {
+        tempSize = tempSize - blockSize;
+        blocks++;
+    }
+
+    pthread_mutex_lock(&allocLock);
+
+    // Blocks set aside for what files hold aren't anybody else's to take.
+    int startBlock = freeBlocks - reservedBlocks >= blocks ? nextFreeRunFit(blocks) : -1;
+
+    if(startBlock != -1) markRun(startBlock, blocks, 1);
+
+    pthread_mutex_unlock(&allocLock);
+
+    if(startBlock == -1)
+    {
+        LOG_DEBUG("No more space left!!!");
+        errno = ENOSPC;
+        return -1;
+    }
+
+    off_t offsetInBytes = (off_t) startBlock * blockSize;
+
+    if(data != 0)
+    {
+        if(cacheWrite(data, size, offsetInBytes) != size)
+        {
+            removeFileFromMemory(startBlock, blocks);
+            return -1;
+        }
+    }
+
+    return startBlock;
+}
+
+
+// Marks a given region in memory as free
+void removeFileFromMemory(int startBlockNum, int count)
+{
+    STAT_ADD(STAT_BLOCKS_FREED, count);
+
+    // They can only be reused once the transaction freeing them has committed. Short of memory to wait, they are
+    // freed straight away, as they used to be.
+    pthread_mutex_lock(&allocLock);
+    if(count > 0 && freeingAdd(startBlockNum, count) != 0) markRun(startBlockNum, count, 0);
+    pthread_mutex_unlock(&allocLock);
+}
+
+
+// Allocates a single block, preferring goal so that a file's blocks stay next to each other. reserved says the caller
+// had the block set aside with delallocReserve(), so it may be one of reservedBlocks. Returns it, or -1 (with errno set
+// to ENOSPC).
+int allocateBlockNear(long goal, int reserved)
+{
+    pthread_mutex_lock(&allocLock);
+
+    int block = -1;
+
+    STAT_ADD(STAT_BITMAP_LOOKUPS, 1);
+
+    if(!reserved && freeBlocks - reservedBlocks < 1) block = -1;
+    else if(goal >= (long) superblock.dataStart && goal < blockCount && blockStatus(goal) == 0) block = goal;
+    else block = nextFreeRunFit(1);
+
+    if(block != -1) markRun(block, 1, 1);
+
+    pthread_mutex_unlock(&allocLock);
+
+    if(block == -1) errno = ENOSPC;
+
+    return block;
+}
+
+
+// Allocates a run of up to *count blocks: straight after goal if the block there is free, otherwise the first free run
+// that is long enough, or failing that the longest there is. Blocks set aside for held blocks are left alone. Sets
+// *count to how long the run is. Returns its first block, or -1 if there are no free blocks.
+int allocateRun(long goal, long *count)
+{
+    pthread_mutex_lock(&allocLock);
+
+    long want = freeBlocks - reservedBlocks < *count ? freeBlocks - reservedBlocks : *count;
+    int start = -1;
+
+    STAT_ADD(STAT_BITMAP_LOOKUPS, 1);
+
+    if(want <= 0) start = -1;
+    else if(goal >= (long) superblock.dataStart && goal < blockCount && blockStatus(goal) == 0)
+    {
+        start = goal;
+
+        if(nextBlockWithStatus(goal, 1) - goal < want) want = nextBlockWithStatus(goal, 1) - goal;
+    }
+    else if((start = nextFreeRunFit(want)) == -1)
+    {
+        if(largestFreeRun() < want) want = largestFreeRun();
+
+        start = nextFreeRunFit(want);
+    }
+
+    if(start != -1) markRun(start, want, 1);
+
+    pthread_mutex_unlock(&allocLock);
+
+    if(start != -1) *count = want;
+
+    return start;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+            INODES
+
+ * * * * * * * * * * * * * * */
+
+
+// Reads one pointer out of an inode or indirect block. Returns it, or -1 (a pointer that couldn't be read mustn't look
+// like a hole).
+static long readPointer(long block, long offsetInBlock)
+{
+    unsigned long pointer = 0;
+
+    if(cacheRead(&pointer, sizeof(pointer), (off_t) block * blockSize + offsetInBlock) == -1) return -1;
+
+    return pointer;
+}
+
+
+// Writes one pointer into an inode or indirect block.
+static int writePointer(long block, long offsetInBlock, unsigned long pointer)
+{
+    return cacheWriteMeta(&pointer, sizeof(pointer), (off_t) block * blockSize + offsetInBlock) == -1 ? -1 : 0;
+}
+
+
+// Adds to the count of blocks an inode owns. Returns 0, or -1.
+static int inodeAddBlocks(long inode, long count)
+{
+    long nBlocks = readPointer(inode, offsetof(cs1550_inode, nBlocks));
+
+    if(nBlocks == -1 || writePointer(inode, offsetof(cs1550_inode, nBlocks), nBlocks + count) != 0) return -1;
+
+    STAT_ADD(STAT_BLOCKS_ALLOCATED, count);
+
+    return 0;
+}
+
+
+// Allocates a zeroed block near goal for use as an indirect block. reserved is as for allocateBlockNear(). Returns it,
+// or -1.
+static long allocateIndexBlock(long goal, int reserved)
+{
+    unsigned long empty[indexPointers];
+    int block = allocateBlockNear(goal, reserved);
+
+    if(block == -1) return -1;
+
+    memset(empty, 0, sizeof(empty));
+
+    if(cacheWriteMeta(empty, sizeof(empty), (off_t) block * blockSize) == -1)
+    {
+        removeFileFromMemory(block, 1);
+        return -1;
+    }
+
+    return block;
+}
+
+
+// Follows (and, if allocate is set, fills in) the pointer at offsetInBlock of block. New blocks are placed near goal,
+// except that a data block is place if that isn't 0. The new block is charged to the inode. Returns the block pointed
+// to, 0 if there is none, or -1 if one was needed and the disk is full, or the pointer couldn't be read or written.
+static long followPointer(long inode, long block, long offsetInBlock, int allocate, int isIndex, long goal, long place)
+{
+    long target = readPointer(block, offsetInBlock);
+
+    if(target != 0 || !allocate) return target;
+
+    if(isIndex) target = allocateIndexBlock(goal, allocate == ALLOCATE_RESERVED);
+    else if(place != 0) target = place;
+    else target = allocateBlockNear(goal, allocate == ALLOCATE_RESERVED);
+
+    if(target == -1) return -1;
+
+    if(writePointer(block, offsetInBlock, target) != 0)
+    {
+        // place is the caller's to give back.
+        if(place == 0 || isIndex) removeFileFromMemory(target, 1);
+        return -1;
+    }
+
+    // The pointer is in, so the block is the file's now whatever the count says; fsck puts the count right.
+    if(inodeAddBlocks(inode, 1) != 0) return -1;
+
+    return target;
+}
+
+
+// Makes a new, empty inode. Returns its block, or -1 if the disk is full.
+long inodeCreate(void)
+{
+    unsigned long buffer[blockSize / sizeof(unsigned long)];
+    cs1550_inode *inode = (cs1550_inode *) buffer;
+
+    memset(buffer, 0, sizeof(buffer));
+    inode->magic = INODE_MAGIC;
+    inode->flags = INODE_INLINE; //every file starts out small
+
+    long block = moveFileToMemory(NULL, blockSize);
+
+    if(block == -1) return -1;
+
+    if(cacheWriteMeta(buffer, sizeof(buffer), (off_t) block * blockSize) == -1)
+    {
+        removeFileFromMemory(block, 1);
+        return -1;
+    }
+
+    return block;
+}
+
+
+// Checks that a block really holds an inode.
+int inodeValid(long inode)
+{
+    unsigned int magic = 0;
+
+    if(inode < (long) superblock.dataStart || inode >= blockCount) return 0;
+    if(cacheRead(&magic, sizeof(magic), (off_t) inode * blockSize) == -1) return 0;
+
+    return magic == INODE_MAGIC;
+}
+
+
+// Is the file's data inline in its inode? Returns 1 if it is, 0 if it isn't, or -1.
+int inodeInline(long inode)
+{
+    unsigned int flags = 0;
+
+    if(cacheRead(&flags, sizeof(flags), (off_t) inode * blockSize + offsetof(cs1550_inode, flags)) == -1) return -1;
+
+    return (flags & INODE_INLINE) != 0;
+}
+
+
+// Returns the flags of a file's inode, or -1.
+int inodeFlags(long inode)
+{
+    unsigned int flags = 0;
+
+    if(cacheRead(&flags, sizeof(flags), (off_t) inode * blockSize + offsetof(cs1550_inode, flags)) == -1) return -1;
+
+    return flags;
+}
+
+
+// Turns the flags in set on and those in clear off in a file's inode. The file's lock must be held for writing, inside
+// journalBegin()/journalEnd(). Returns 0, or -1.
+int inodeMark(long inode, unsigned int set, unsigned int clear)
+{
+    off_t at = (off_t) inode * blockSize + offsetof(cs1550_inode, flags);
+    int flags = inodeFlags(inode);
+
+    if(flags == -1) return -1;
+
+    unsigned int wanted = ((unsigned int) flags | set) & ~clear;
+
+    if(wanted != (unsigned int) flags && cacheWriteMeta(&wanted, sizeof(wanted), at) == -1) return -1;
+
+    return 0;
+}
+
+
+// Moves the data of an inline file out into a block of its own (held in pending, if that isn't NULL), and turns the
+// inode back into pointers, so the file can grow past INLINE_CAPACITY. The file's lock must be held for writing, inside
+// journalBegin()/journalEnd(). Returns 0, or -1.
+static int inodeUninline(long inode, cs1550_delalloc *pending)
+{
+    unsigned long buffer[blockSize / sizeof(unsigned long)];
+    cs1550_inode *node = (cs1550_inode *) buffer;
+    char data[INLINE_CAPACITY];
+
+    if(cacheRead(buffer, sizeof(buffer), (off_t) inode * blockSize) == -1) return -1;
+
+    memcpy(data, node->pointers, sizeof(data));
+    memset(node->pointers, 0, sizeof(data));
+    node->flags &= ~INODE_INLINE;
+    node->nBlocks = 0;
+
+    if(cacheWriteMeta(buffer, sizeof(buffer), (off_t) inode * blockSize) == -1) return -1;
+
+    // Everything past the end of an inline file is zeros, so an empty (or all zero) one doesn't need a block yet.
+    size_t used = sizeof(data);
+
+    while(used > 0 && data[used - 1] == 0) used--;
+
+    if(used == 0) return 0;
+
+    // The whole block gets written, so nothing a block's last owner left in it can show through.
+    char block[blockSize];
+
+    memcpy(block, data, sizeof(data));
+    memset(block + sizeof(data), 0, blockSize - sizeof(data));
+
+    int held = pending != NULL ? delallocHold(pending, 0, 0, block, blockSize) : 0;
+
+    if(held != 0) return held == 1 ? 0 : -1;
+
+    long target = inodeBlockFor(inode, 0, 1);
+
+    if(target == -1 || cacheWrite(block, blockSize, (off_t) target * blockSize) == -1) return -1;
+
+    return 0;
+}
+
+
+// Does the work of inodeBlockFor(), and of pointing a file's block at a block of .disk already allocated for it: if
+// place isn't 0, that is where the block goes, and only the indirect blocks on the way to it are allocated.
+static long inodeWalk(long inode, long fileBlock, int allocate, long place)
+{
+    long goal = inode + 1;
+
+    if(allocate)
+    {
+        long block = inodeWalk(inode, fileBlock, 0, 0);
+
+        if(block != 0) return block;
+
+        // Put the new block straight after the one before it so the file stays in one piece when it can. The indirect
+        // blocks on the way to a block that already has its place go as near it as they can.
+        if(place != 0) goal = place;
+        else if(fileBlock > 0)
+        {
+            long previous = inodeBlockFor(inode, fileBlock - 1, 0);
+            if(previous > 0) goal = previous + 1;
+        }
+    }
+
+    if(fileBlock < NUM_DIRECT_POINTERS)
+    {
+        return followPointer(inode, inode, offsetof(cs1550_inode, pointers) + fileBlock * sizeof(unsigned long), allocate, 0, goal, place);
+    }
+
+    fileBlock -= NUM_DIRECT_POINTERS;
+
+    if(fileBlock < (long) indexPointers)
+    {
+        long single = followPointer(inode, inode, offsetof(cs1550_inode, pointers) + SINGLE_INDIRECT_POINTER * sizeof(unsigned long), allocate, 1, goal, 0);
+
+        if(single <= 0) return single;
+
+        return followPointer(inode, single, fileBlock * sizeof(unsigned long), allocate, 0, goal, place);
+    }
+
+    fileBlock -= indexPointers;
+
+    if(fileBlock >= (long) (indexPointers * indexPointers))
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    long outer = followPointer(inode, inode, offsetof(cs1550_inode, pointers) + DOUBLE_INDIRECT_POINTER * sizeof(unsigned long), allocate, 1, goal, 0);
+
+    if(outer <= 0) return outer;
+
+    long inner = followPointer(inode, outer, (fileBlock / indexPointers) * sizeof(unsigned long), allocate, 1, goal, 0);
+
+    if(inner <= 0) return inner;
+
+    return followPointer(inode, inner, (fileBlock % indexPointers) * sizeof(unsigned long), allocate, 0, goal, place);
+}
+
+
+// Returns the disk block that holds block fileBlock of a file, which mustn't be inline. If allocate is set, the block
+// (and any indirect blocks on the way to it) is allocated when it doesn't exist yet; ALLOCATE_RESERVED takes them
+// from what delallocReserve() set aside. Returns 0 for a block that was never allocated, or -1.
+long inodeBlockFor(long inode, long fileBlock, int allocate)
+{
+    return inodeWalk(inode, fileBlock, allocate, 0);
+}
+
+
+// Points block fileBlock of a file at block instead. The indirect blocks on the way there must already exist. Returns
+// 0, or -1.
+int inodeSetBlock(long inode, long fileBlock, long block)
+{
+    long holder = inode;
+    long offset;
+
+    if(fileBlock < NUM_DIRECT_POINTERS)
+    {
+        offset = offsetof(cs1550_inode, pointers) + fileBlock * sizeof(unsigned long);
+    }
+    else if((fileBlock -= NUM_DIRECT_POINTERS) < (long) indexPointers)
+    {
+        holder = readPointer(inode, offsetof(cs1550_inode, pointers) + SINGLE_INDIRECT_POINTER * sizeof(unsigned long));
+        offset = fileBlock * sizeof(unsigned long);
+    }
+    else
+    {
+        fileBlock -= indexPointers;
+
+        long outer = readPointer(inode,
+                                 offsetof(cs1550_inode, pointers) + DOUBLE_INDIRECT_POINTER * sizeof(unsigned long));
+
+        holder = outer <= 0 ? -1 : readPointer(outer, (fileBlock / indexPointers) * sizeof(unsigned long));
+        offset = (fileBlock % indexPointers) * sizeof(unsigned long);
+    }
+
+    if(holder <= 0) return -1;
+
+    return writePointer(holder, offset, block);
+}
+
+
+// Zeroes count blocks of .disk from block on before they are given to a file, so that nothing their last owner left
+// in them can be read back. Returns 0, or -1.
+static int zeroBlocks(long block, long count)
+{
+    char zeros[blockSize];
+    long i;
+
+    if(cacheDiscard(block, count) == 0 && diskZero(count * blockSize, (off_t) block * blockSize) != -1) return 0;
+
+    // A block the journal still has pinned (one that held metadata until just now) takes its zeros through the cache.
+    memset(zeros, 0, sizeof(zeros));
+
+    for(i = 0; i < count; i++)
+    {
+        if(cacheWrite(zeros, blockSize, (off_t) (block + i) * blockSize) == -1) return -1;
+    }
+
+    return 0;
+}
+
+
+// Gives every file block from fileBlock up to fileBlock + count that has no block of .disk a zeroed one, in as few runs
+// as it can, each starting straight after the file's block before it when that is free. Sets *allocated to how many
+// data blocks it allocated. The file mustn't be inline. Its lock must be held for writing, inside
+// journalBegin()/journalEnd(). Returns 0, or -1 if the disk filled up first (what was allocated by then stays).
+int inodeAllocate(long inode, long fileBlock, long count, long *allocated)
+{
+    long i = 0;
+
+    *allocated = 0;
+
+    while(i < count)
+    {
+        long block = inodeBlockFor(inode, fileBlock + i, 0);
+        long run = 1;
+
+        if(block == -1) return -1;
+
+        if(block != 0)
+        {
+            i++;
+            continue;
+        }
+
+        while(i + run < count && (block = inodeBlockFor(inode, fileBlock + i + run, 0)) == 0) run++;
+
+        if(block == -1) return -1;
+
+        long previous = fileBlock + i > 0 ? inodeBlockFor(inode, fileBlock + i - 1, 0) : 0;
+        int start = allocateRun(previous > 0 ? previous + 1 : inode + 1, &run);
+        long j;
+
+        if(start == -1)
+        {
+            errno = ENOSPC;
+            return -1;
+        }
+
+        if(zeroBlocks(start, run) != 0)
+        {
+            removeFileFromMemory(start, run);
+            return -1;
+        }
+
+        for(j = 0; j < run && inodeWalk(inode, fileBlock + i + j, 1, start + j) != -1; j++);
+
+        *allocated += j;
+
+        if(j < run)
+        {
+            removeFileFromMemory(start + j, run - j);
+            return -1;
+        }
+
+        i += run;
+    }
+
+    return 0;
+}
+
+
+// Zeroes whatever is past byte fsize of a file in the block that byte is in, or in the inode of an inline file, so that
+// growing the file shows zeros there rather than what a write left past the end. Blocks that aren't on .disk read as
+// zeros already. The file's lock must be held for writing, inside journalBegin()/journalEnd(). Returns 0, or -1.
+int inodeZeroTail(long inode, size_t fsize)
+{
+    char zeros[blockSize];
+    int isInline = inodeInline(inode);
+
+    memset(zeros, 0, sizeof(zeros));
+
+    if(isInline == -1) return -1;
+
+    if(isInline)
+    {
+        off_t at = (off_t) inode * blockSize + offsetof(cs1550_inode, pointers) + fsize;
+
+        if(fsize < INLINE_CAPACITY && cacheWriteMeta(zeros, INLINE_CAPACITY - fsize, at) == -1) return -1;
+
+        return 0;
+    }
+
+    int inBlock = fsize % blockSize;
+    long block = inBlock != 0 ? inodeBlockFor(inode, fsize / blockSize, 0) : 0;
+
+    if(block == -1) return -1;
+
+    if(block != 0 && cacheWrite(zeros, blockSize - inBlock, (off_t) block * blockSize + inBlock) == -1) return -1;
+
+    return 0;
+}
+
+
+// Frees the data blocks an indirect block leads to for file blocks from up to (but not including) to. Its first
+// pointer is for file block first, and each pointer covers span file blocks (going depth levels further down). Adds
+// how many blocks were freed to *freed. Returns 1 if the indirect block points at nothing any more, 0 if it still
+// does, or -1 if some of the range couldn't be freed (what was freed stays freed).
+static int freeIndexRange(long block, int depth, long first, long span, long from, long to, long *freed)
+{
+    unsigned long pointers[indexPointers];
+    long gone[indexPointers];
+    int nGone = 0;
+    int used = 0;
+    int failed = 0;
+    int i;
+
+    if(cacheRead(pointers, sizeof(pointers), (off_t) block * blockSize) == -1) return -1;
+
+    for(i = 0; i < indexPointers; i++)
+    {
+        long start = first + i * span;
+        int empty = 1;
+
+        if(pointers[i] == 0) continue;
+
+        if(depth > 0 && start + span > from && start < to)
+        {
+            empty = freeIndexRange(pointers[i], depth - 1, start, span / indexPointers, from, to, freed);
+            if(empty == -1) failed = 1;
+        }
+
+        if(start + span <= from || start >= to || empty != 1)
+        {
+            used = 1;
+            continue;
+        }
+
+        gone[nGone++] = pointers[i];
+        pointers[i] = 0;
+    }
+
+    // The blocks are only given back once nothing on disk points at them.
+    if(nGone > 0 && cacheWriteMeta(pointers, sizeof(pointers), (off_t) block * blockSize) == -1) return -1;
+
+    for(i = 0; i < nGone; i++) removeFileFromMemory(gone[i], 1);
+
+    *freed += nGone;
+
+    if(failed) return -1;
+
+    return !used;
+}
+
+
+// Frees the data blocks of a file from fileBlock from up to (but not including) to, along with the indirect blocks
+// that are left pointing at nothing. The file mustn't be inline. Its lock must be held for writing, inside
+// journalBegin()/journalEnd(). Returns how many blocks were freed, indirect blocks included, or -1 if .disk failed
+// part way (what was freed by then stays freed, and is taken off the inode's count).
+long inodeFreeRange(long inode, long from, long to)
+{
+    long direct = NUM_DIRECT_POINTERS;
+    long freed = 0;
+    int failed = 0;
+    long i;
+
+    for(i = from; i < direct && i < to; i++)
+    {
+        long block = readPointer(inode, offsetof(cs1550_inode, pointers) + i * sizeof(unsigned long));
+
+        if(block == 0) continue;
+
+        if(block == -1 || writePointer(inode, offsetof(cs1550_inode, pointers) + i * sizeof(unsigned long), 0) != 0)
+        {
+            failed = 1;
+            continue;
+        }
+
+        removeFileFromMemory(block, 1);
+        freed++;
+    }
+
+    // The single indirect block is as good as a block of pointers one level below the inode's own, and the double
+    // indirect block as one two levels below.
+    long pointer = SINGLE_INDIRECT_POINTER;
+    long first = direct;
+    long span = 1;
+    int depth;
+
+    for(depth = 0; depth < 2; depth++)
+    {
+        off_t at = offsetof(cs1550_inode, pointers) + pointer * sizeof(unsigned long);
+        long block = readPointer(inode, at);
+        int empty = 0;
+
+        if(block == -1) failed = 1;
+        else if(block != 0 && first < to && first + span * indexPointers > from)
+        {
+            empty = freeIndexRange(block, depth, first, span, from, to, &freed);
+            if(empty == -1) failed = 1;
+        }
+
+        if(empty == 1)
+        {
+            if(writePointer(inode, at, 0) == 0)
+            {
+                removeFileFromMemory(block, 1);
+                freed++;
+            }
+            else failed = 1;
+        }
+
+        first += span * indexPointers;
+        span *= indexPointers;
+        pointer = DOUBLE_INDIRECT_POINTER;
+    }
+
+    if(freed > 0)
+    {
+        long nBlocks = readPointer(inode, offsetof(cs1550_inode, nBlocks));
+
+        if(nBlocks == -1 || writePointer(inode, offsetof(cs1550_inode, nBlocks), nBlocks - freed) != 0) failed = 1;
+    }
+
+    return failed ? -1 : freed;
+}
+
+
+// Frees every block an indirect block points to (going depth levels further down), then the block itself.
+static void freeIndexBlock(long block, int depth)
+{
+    unsigned long pointers[indexPointers];
+    int i;
+
+    if(cacheRead(pointers, sizeof(pointers), (off_t) block * blockSize) != -1)
+    {
+        for(i = 0; i < indexPointers; i++)
+        {
+            if(pointers[i] == 0) continue;
+
+            if(depth > 0) freeIndexBlock(pointers[i], depth - 1);
+            else removeFileFromMemory(pointers[i], 1);
+        }
+    }
+
+    removeFileFromMemory(block, 1);
+}
+
+
+// Frees an inode along with every block it owns.
+void inodeFree(long inode)
+{
+    unsigned long buffer[blockSize / sizeof(unsigned long)];
+    cs1550_inode *node = (cs1550_inode *) buffer;
+    int i;
+
+    delallocDrop(inode);
+
+    if(cacheRead(buffer, sizeof(buffer), (off_t) inode * blockSize) != -1 && node->magic == INODE_MAGIC &&
+       !(node->flags & INODE_INLINE))
+    {
+        for(i = 0; i < NUM_DIRECT_POINTERS; i++)
+        {
+            if(node->pointers[i] != 0) removeFileFromMemory(node->pointers[i], 1);
+        }
+
+        if(node->pointers[SINGLE_INDIRECT_POINTER] != 0) freeIndexBlock(node->pointers[SINGLE_INDIRECT_POINTER], 0);
+        if(node->pointers[DOUBLE_INDIRECT_POINTER] != 0) freeIndexBlock(node->pointers[DOUBLE_INDIRECT_POINTER], 1);
+    }
+
+    // Make sure a stale copy can never be mistaken for a live inode.
+    unsigned int magic = 0;
+    cacheWrite(&magic, sizeof(magic), (off_t) inode * blockSize);
+
+    removeFileFromMemory(inode, 1);
+}
+
+
+// Reads size bytes at offset of a file. Blocks that were never written read as zeros. Returns size, or -1.
+int inodeRead(long inode, char *buf, size_t size, off_t offset)
+{
+    cs1550_delalloc *pending = NULL;
+    int looked = 0; //only files with blocks that aren't on .disk yet need to look for what they hold
+    size_t done = 0;
+
+    int isInline = inodeInline(inode);
+
+    if(isInline == -1) return -1;
+
+    if(isInline)
+    {
+        // One read of the inode is all it takes.
+        if(offset < (off_t) INLINE_CAPACITY) done = size < INLINE_CAPACITY - offset ? size : INLINE_CAPACITY - offset;
+
+        if(done > 0 && cacheRead(buf, done, (off_t) inode * blockSize + offsetof(cs1550_inode, pointers) + offset) == -1)
+        {
+            return -1;
+        }
+
+        memset(buf + done, 0, size - done);
+
+        return size;
+    }
+
+    while(done < size)
+    {
+        long fileBlock = (offset + done) / blockSize;
+        int inBlock = (offset + done) % blockSize;
+        size_t count = blockSize - inBlock;
+
+        if(count > size - done) count = size - done;
+
+        long block = inodeBlockFor(inode, fileBlock, 0);
+
+        if(block == -1) return -1;
+
+        if(block == 0 && !looked)
+        {
+            pending = delallocFind(inode);
+            looked = 1;
+        }
+
+        if(block == 0) delallocRead(pending, fileBlock, inBlock, buf + done, count);
+        else if(cacheRead(buf + done, count, (off_t) block * blockSize + inBlock) == -1) return -1;
+
+        done += count;
+    }
+
+    return size;
+}
+
+
+// Builds the reply to a read of size bytes at offset of a file without copying the data where it can: if the thread
+// called spliceBegin(), blocks that aren't in the block cache become ranges of .disk for FUSE to splice or read straight
+// into its own buffer, and only holes, blocks the file holds in memory and cached blocks (readahead put them there, or
+// they hold changes .disk doesn't have yet) are copied. Otherwise everything is. On success *bufp is a buffer vector
+// for FUSE to free. Returns 0, or -1.
+int inodeReadBuf(long inode, size_t size, off_t offset, struct fuse_bufvec **bufp)
+{
+    long pieces = (offset % blockSize + size + blockSize - 1) / blockSize + 1;
+    cs1550_delalloc *pending = NULL;
+    int looked = 0;
+    struct fuse_bufvec *bufv;
+
+    bufv = (struct fuse_bufvec *) calloc(1, sizeof(struct fuse_bufvec) + pieces * sizeof(struct fuse_buf));
+    size_t done = 0;
+
+    if(bufv == NULL) return -1;
+
+    int isInline = inodeInline(inode);
+
+    if(isInline == 1 && size > 0)
+    {
+        bufv->buf[0].mem = malloc(size);
+        bufv->buf[0].fd = -1;
+        bufv->buf[0].size = size;
+        bufv->count = 1;
+
+        if(bufv->buf[0].mem != NULL && inodeRead(inode, (char *) bufv->buf[0].mem, size, offset) == (int) size)
+        {
+            done = size;
+        }
+    }
+
+    while(isInline == 0 && done < size)
+    {
+        long fileBlock = (offset + done) / blockSize;
+        int inBlock = (offset + done) % blockSize;
+        size_t count = blockSize - inBlock;
+
+        if(count > size - done) count = size - done;
+
+        long block = inodeBlockFor(inode, fileBlock, 0);
+
+        if(block == -1) break;
+
+        struct fuse_buf *last = bufv->count > 0 ? &bufv->buf[bufv->count - 1] : NULL;
+        off_t position = (off_t) block * blockSize + inBlock;
+
+        if(block != 0 && splicePin != -1 && !cacheHolds(block))
+        {
+            if(last != NULL && (last->flags & FUSE_BUF_IS_FD) && last->pos + (off_t) last->size == position)
+            {
+                last->size += count;
+            }
+            else
+            {
+                last = &bufv->buf[bufv->count++];
+                last->flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+                last->fd = diskFd;
+                last->pos = position;
+                last->size = count;
+            }
+
+            STAT_ADD(STAT_BYTES_SPLICED, count);
+        }
+        else
+        {
+            // FUSE frees every buffer's memory on its own, so runs of copied pieces share one allocation.
+            if(last == NULL || (last->flags & FUSE_BUF_IS_FD))
+            {
+                last = &bufv->buf[bufv->count++];
+                last->fd = -1;
+            }
+
+            char *grown = (char *) realloc(last->mem, last->size + count);
+
+            if(grown == NULL) break;
+
+            last->mem = grown;
+
+            if(block == 0 && !looked)
+            {
+                pending = delallocFind(inode);
+                looked = 1;
+            }
+
+            if(block == 0) delallocRead(pending, fileBlock, inBlock, grown + last->size, count);
+            else if(cacheRead(grown + last->size, count, position) == -1) break;
+
+            last->size += count;
+        }
+
+        done += count;
+    }
+
+    if(done < size)
+    {
+        size_t i;
+
+        for(i = 0; i < bufv->count; i++) free(bufv->buf[i].mem);
+        free(bufv);
+
+        return -1;
+    }
+
+    if(bufv->count == 0) bufv->count = 1; //an empty read still needs one (empty) buffer
+
+    *bufp = bufv;
+
+    return 0;
+}
+
+
+// Takes count bytes from the front of src if they sit in memory in one piece, returning where they are. Returns NULL
+// (and takes nothing) if they don't.
+static const char *bufvecTake(struct fuse_bufvec *src, size_t count)
+{
+    while(src->idx < src->count && src->off == src->buf[src->idx].size)
+    {
+        src->idx++;
+        src->off = 0;
+    }
+
+    if(src->idx == src->count) return NULL;
+
+    struct fuse_buf *buf = &src->buf[src->idx];
+
+    if((buf->flags & FUSE_BUF_IS_FD) || buf->size - src->off < count) return NULL;
+
+    const char *data = (const char *) buf->mem + src->off;
+
+    src->off += count;
+
+    return data;
+}
+
+
+// Copies the next size bytes of src into dst. Returns 0, or -1 with errno set.
+static int bufvecCopy(struct fuse_bufvec *dst, struct fuse_bufvec *src, size_t size)
+{
+    ssize_t copied = fuse_buf_copy(dst, src, 0);
+
+    if(copied == (ssize_t) size) return 0;
+
+    // A short copy means the request ran out of data, or the pipe did.
+    errno = copied < 0 ? (int) -copied : EIO;
+
+    return -1;
+}
+
+
+// Writes size bytes from src at offset of a file. Data in memory for blocks that don't exist yet is held in pending
+// (unless that is NULL) until delallocPlace() gives them blocks of .disk; data for blocks that do goes through the
+// block cache. Whole blocks that arrive in a file descriptor (a pipe FUSE spliced the request into) are spliced
+// straight into .disk instead, as many at a time as lie next to each other there. The file's lock must be held for
+// writing, inside journalBegin()/journalEnd(). Returns size, or -1 with errno set.
+int inodeWrite(long inode, cs1550_delalloc *pending, struct fuse_bufvec *src, size_t size, off_t offset)
+{
+    char bounce[blockSize];
+    size_t done = 0;
+
+    int isInline = inodeInline(inode);
+
+    if(isInline == -1) return -1;
+
+    // A write FUSE spliced into a pipe already comes in big pieces that are better off going straight to .disk. What
+    // the file holds goes first, so that it isn't placed after them.
+    if(pending != NULL && src->count > 0 && (src->buf[0].flags & FUSE_BUF_IS_FD))
+    {
+        if(delallocPlace(pending, DELALLOC_GROW) != 0) return -1;
+
+        pending = NULL;
+    }
+
+    // A file that still fits in its inode stays there. Its data then goes through the journal like any other change
+    // to the inode.
+    if(isInline && offset + size <= INLINE_CAPACITY)
+    {
+        struct fuse_bufvec dst = FUSE_BUFVEC_INIT(size);
+
+        dst.buf[0].mem = bounce;
+
+        if(bufvecCopy(&dst, src, size) != 0) return -1;
+
+        off_t at = (off_t) inode * blockSize + offsetof(cs1550_inode, pointers) + offset;
+
+        if(size > 0 && cacheWriteMeta(bounce, size, at) == -1) return -1;
+
+        return size;
+    }
+
+    if(isInline && inodeUninline(inode, pending) != 0) return -1;
+
+    while(done < size)
+    {
+        long fileBlock = (offset + done) / blockSize;
+        int inBlock = (offset + done) % blockSize;
+        size_t count = blockSize - inBlock;
+
+        if(count > size - done) count = size - done;
+
+        int isHeld = pending != NULL && pending->count > 0 && fileBlock >= pending->first &&
+                     fileBlock < pending->first + pending->count;
+        long block = isHeld ? 0 : inodeBlockFor(inode, fileBlock, 0);
+
+        if(block == -1) return -1;
+
+        const char *data = NULL;
+
+        if(block == 0 && pending != NULL)
+        {
+            if((data = bufvecTake(src, count)) == NULL)
+            {
+                struct fuse_bufvec dst = FUSE_BUFVEC_INIT(count);
+
+                dst.buf[0].mem = bounce;
+
+                if(bufvecCopy(&dst, src, count) != 0) return -1;
+
+                data = bounce;
+            }
+
+            int held = delallocHold(pending, fileBlock, inBlock, data, count);
+
+            if(held == -1) return -1;
+
+            if(held == 1)
+            {
+                done += count;
+                continue;
+            }
+        }
+
+        int fresh = block == 0; //new to this write? Then it holds what its last owner left until our data is in
+
+        if(block == 0)
+        {
+            if((block = inodeBlockFor(inode, fileBlock, 1)) == -1) return -1;
+
+            // The rest of a new block is part of a hole, or past the end, and must read as zeros rather than whatever
+            // the block's last owner left in it.
+            if(count < (size_t) blockSize && zeroBlocks(block, 1) != 0) return -1;
+        }
+
+        if(data == NULL) data = bufvecTake(src, count);
+
+        long run = 0;
+
+        if(data == NULL && count == blockSize && src->idx < src->count && (src->buf[src->idx].flags & FUSE_BUF_IS_FD))
+        {
+            run = 1;
+
+            // A run is all blocks the file had or all new ones, so if the data never arrives the new ones can be
+            // zeroed again. One that isn't next to the run gets its data on its own, so it is zeroed until then.
+            while(done + (run + 1) * blockSize <= size && (inodeBlockFor(inode, fileBlock + run, 0) == 0) == fresh)
+            {
+                long next = inodeBlockFor(inode, fileBlock + run, 1);
+
+                if(next != block + run)
+                {
+                    if(next > 0 && fresh) zeroBlocks(next, 1);
+                    break;
+                }
+
+                run++;
+            }
+
+            // Nobody else can bring these back into the cache while we hold the file's lock. A block the journal
+            // still has pinned (one that held metadata until just now) goes through the cache below instead.
+            if(cacheDiscard(block, run) != 0)
+            {
+                if(fresh && run > 1) zeroBlocks(block + 1, run - 1);
+                run = 0;
+            }
+        }
+
+        if(data == NULL && count == blockSize && run > 0)
+        {
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(run * blockSize);
+
+            dst.buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+            dst.buf[0].fd = diskFd;
+            dst.buf[0].pos = (off_t) block * blockSize;
+
+            if(bufvecCopy(&dst, src, run * blockSize) != 0)
+            {
+                if(fresh) zeroBlocks(block, run);
+                return -1;
+            }
+
+            STAT_ADD(STAT_BYTES_SPLICED, run * blockSize);
+
+            done += run * blockSize;
+            continue;
+        }
+
+        if(data == NULL)
+        {
+            struct fuse_bufvec dst = FUSE_BUFVEC_INIT(count);
+
+            dst.buf[0].mem = bounce;
+
+            if(bufvecCopy(&dst, src, count) != 0)
+            {
+                if(fresh && count == (size_t) blockSize) zeroBlocks(block, 1);
+                return -1;
+            }
+
+            data = bounce;
+        }
+
+        if(cacheWrite(data, count, (off_t) block * blockSize + inBlock) == -1) return -1;
+
+        done += count;
+    }
+
+    return size;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+       DELAYED ALLOCATION
+
+ * * * * * * * * * * * * * * */
+
+
+// Finds the blocks a file holds back from .disk. Returns NULL if it holds none. The file's lock must be held.
+cs1550_delalloc *delallocFind(long inode)
+{
+    pthread_mutex_lock(&delallocLock);
+
+    cs1550_delalloc *pending = delallocTable[inode % DELALLOC_BUCKETS];
+
+    while(pending != NULL && pending->inode != inode) pending = pending->next;
+
+    pthread_mutex_unlock(&delallocLock);
+
+    return pending;
+}
+
+
+// Finds the blocks a file holds back from .disk, or gets it ready to hold some. The file's lock must be held for
+// writing. Returns NULL if we are out of memory, and then the file's blocks are allocated as they are written.
+cs1550_delalloc *delallocGet(const char *directory, const char *filename, long inode)
+{
+    cs1550_delalloc *pending = delallocFind(inode);
+
+    if(pending != NULL) return pending;
+
+    pending = (cs1550_delalloc *) calloc(1, sizeof(cs1550_delalloc));
+
+    if(pending == NULL) return NULL;
+
+    strcpy(pending->directory, directory);
+    strcpy(pending->filename, filename);
+    pending->inode = inode;
+
+    pthread_mutex_lock(&delallocLock);
+
+    pending->next = delallocTable[inode % DELALLOC_BUCKETS];
+    delallocTable[inode % DELALLOC_BUCKETS] = pending;
+
+    pthread_mutex_unlock(&delallocLock);
+
+    return pending;
+}
+
+
+// Lets go of a file's pending blocks: they are lost, and so is what was set aside for them. Blocks preallocated past
+// its end stay the file's. The file's lock must be held for writing.
+static void delallocForget(cs1550_delalloc *pending)
+{
+    cs1550_delalloc **link;
+
+    pthread_mutex_lock(&delallocLock);
+
+    for(link = &delallocTable[pending->inode % DELALLOC_BUCKETS]; *link != pending; link = &(*link)->next);
+
+    *link = pending->next;
+
+    pthread_mutex_unlock(&delallocLock);
+
+    pthread_mutex_lock(&allocLock);
+    reservedBlocks -= pending->reserved;
+    pthread_mutex_unlock(&allocLock);
+
+    __atomic_fetch_sub(&delallocBytes, pending->count * blockSize, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&preallocBlocks, pending->preallocEnd - pending->preallocFirst, __ATOMIC_RELAXED);
+
+    free(pending->data);
+    free(pending);
+}
+
+
+// Done with what delallocGet() returned. A file that ended up holding nothing, with nothing preallocated past its end,
+// stops holding. pending may be NULL.
+void delallocPut(cs1550_delalloc *pending)
+{
+    if(pending != NULL && pending->count == 0 && pending->preallocEnd == pending->preallocFirst)
+    {
+        delallocForget(pending);
+    }
+}
+
+
+// Throws away what a file that is going away holds. The file's lock must be held for writing.
+void delallocDrop(long inode)
+{
+    cs1550_delalloc *pending = delallocFind(inode);
+
+    if(pending != NULL) delallocForget(pending);
+}
+
+
+// Sets enough free blocks aside for a file to hold count blocks: those, and the indirect blocks it can take to point
+// at them. Nothing else can allocate them until delallocPlace() is done with them. Returns 0, or -1 if the disk
+// doesn't have them.
+static int delallocReserve(cs1550_delalloc *pending, long count)
+{
+    long needed = count + count / indexPointers + 3;
+    int ret = 0;
+
+    pthread_mutex_lock(&allocLock);
+
+    if(needed > pending->reserved)
+    {
+        if(freeBlocks - reservedBlocks < needed - pending->reserved) ret = -1;
+        else
+        {
+            reservedBlocks += needed - pending->reserved;
+            pending->reserved = needed;
+        }
+    }
+
+    pthread_mutex_unlock(&allocLock);
+
+    return ret;
+}
+
+
+// Puts count bytes of data at inBlock of block fileBlock of a file, which has no block of .disk yet, into what the
+// file holds. The blocks held have to be next to each other, so if fileBlock isn't next to them they are placed first,
+// and so are they once the file holds as much as it may. Returns 1 if the data is held, 0 if it has to be written the
+// usual way instead (there is no room to hold it), or -1.
+int delallocHold(cs1550_delalloc *pending, long fileBlock, int inBlock, const char *data, size_t count)
+{
+    long limit = DELALLOC_MAX_BYTES / blockSize;
+
+    // A block the inode couldn't point at would only fail once it came to be placed.
+    if(fileBlock >= MAX_FILE_BLOCKS)
+    {
+        errno = EFBIG;
+        return -1;
+    }
+
+    if(pending->count > 0 && (fileBlock < pending->first || fileBlock > pending->first + pending->count) &&
+       delallocPlace(pending, 0) != 0) return -1;
+
+    if(pending->count == 0 || fileBlock == pending->first + pending->count)
+    {
+        if(pending->count > 0 && (pending->count >= limit ||
+           __atomic_load_n(&delallocBytes, __ATOMIC_RELAXED) + blockSize > DELALLOC_TOTAL_BYTES))
+        {
+            if(delallocPlace(pending, DELALLOC_GROW) != 0) return -1;
+
+            // The blocks preallocated after the ones just placed may well include this one.
+            if(fileBlock < pending->preallocEnd) return 0;
+        }
+
+        if(pending->count == pending->capacity)
+        {
+            long capacity = pending->capacity > 0 ? pending->capacity * 2 : 8;
+
+            if(capacity > limit) capacity = limit > 0 ? limit : 1;
+
+            char *grown = (char *) realloc(pending->data, capacity * blockSize);
+
+            if(grown == NULL) return delallocPlace(pending, 0) == 0 ? 0 : -1;
+
+            pending->data = grown;
+            pending->capacity = capacity;
+        }
+
+        if(delallocReserve(pending, pending->count + 1) != 0) return delallocPlace(pending, 0) == 0 ? 0 : -1;
+
+        if(pending->count == 0) pending->first = fileBlock;
+
+        memset(pending->data + pending->count * blockSize, 0, blockSize);
+        pending->count++;
+
+        __atomic_fetch_add(&delallocBytes, blockSize, __ATOMIC_RELAXED);
+    }
+
+    memcpy(pending->data + (fileBlock - pending->first) * blockSize + inBlock, data, count);
+
+    return 1;
+}
+
+
+// Copies count bytes at inBlock of block fileBlock of a file out of what it holds, or zeros if it doesn't hold that
+// block. pending may be NULL. The file's lock must be held.
+void delallocRead(const cs1550_delalloc *pending, long fileBlock, int inBlock, char *buf, size_t count)
+{
+    if(pending != NULL && fileBlock >= pending->first && fileBlock < pending->first + pending->count)
+    {
+        memcpy(buf, pending->data + (fileBlock - pending->first) * blockSize + inBlock, count);
+    }
+    else memset(buf, 0, count);
+}
+
+
+// Lets go of the blocks a file holds past byte fsize, and zeroes the rest of the one fsize is in, because the file was
+// cut short there. What was set aside for them stays set aside until the others are placed. The file's lock must be
+// held for writing.
+void delallocTruncate(cs1550_delalloc *pending, size_t fsize)
+{
+    long end = (fsize + blockSize - 1) / blockSize;
+    long keep = end > pending->first ? end - pending->first : 0;
+
+    if(keep >= pending->count) keep = pending->count;
+    else
+    {
+        __atomic_fetch_sub(&delallocBytes, (pending->count - keep) * blockSize, __ATOMIC_RELAXED);
+        pending->count = keep;
+    }
+
+    if(fsize % blockSize != 0 && keep > 0 && (long) (fsize / blockSize) == pending->first + keep - 1)
+    {
+        memset(pending->data + fsize - pending->first * blockSize, 0, blockSize - fsize % blockSize);
+    }
+}
+
+
+// Gives the blocks a file holds blocks of .disk and writes them there. They go in one run of free blocks, straight
+// after the file's block before them if that is free, so a file written in one go ends up in one piece. If no run is
+// long enough they are allocated one at a time instead. With DELALLOC_GROW in flags, a file whose blocks went at its
+// end gets more preallocated after them. The file's lock must be held for writing, inside journalBegin()/journalEnd().
+// Returns 0, or -1.
+int delallocPlace(cs1550_delalloc *pending, int flags)
+{
+    long count = pending->count;
+    long goal = pending->inode + 1;
+    int ret = 0;
+    long i;
+
+    if(count == 0) return 0;
+
+    if(pending->first > 0)
+    {
+        long previous = inodeBlockFor(pending->inode, pending->first - 1, 0);
+        if(previous > 0) goal = previous + 1;
+    }
+
+    // The run comes out of what was set aside for these blocks, so it may use reservedBlocks.
+    pthread_mutex_lock(&allocLock);
+
+    STAT_ADD(STAT_BITMAP_LOOKUPS, 1);
+
+    int start;
+
+    if(goal >= (long) superblock.dataStart && goal + count <= blockCount &&
+       nextBlockWithStatus(goal, 1) >= goal + count) start = goal;
+    else start = nextFreeRunFit(count);
+
+    if(start != -1) markRun(start, count, 1);
+
+    pthread_mutex_unlock(&allocLock);
+
+    for(i = 0; i < count; i++)
+    {
+        long block;
+
+        if(start != -1) block = inodeWalk(pending->inode, pending->first + i, ALLOCATE_RESERVED, start + i);
+        else block = inodeBlockFor(pending->inode, pending->first + i, ALLOCATE_RESERVED);
+
+        if(block == -1) break;
+
+        // A block that went one at a time is written as it goes; a run is written below, all at once.
+        if(start == -1 && cacheWrite(pending->data + i * blockSize, blockSize, (off_t) block * blockSize) == -1) break;
+    }
+
+    // The run skips the block cache, the way spliced writes do. A block the journal still has pinned (one that held
+    // metadata until just now) means the cache has to take it instead.
+    if(start != -1 && i > 0)
+    {
+        off_t at = (off_t) start * blockSize;
+
+        if(cacheDiscard(start, i) != 0 || diskWrite(pending->data, i * blockSize, at) != i * blockSize)
+        {
+            if(cacheWrite(pending->data, i * blockSize, at) == -1) ret = -1;
+        }
+    }
+
+    if(start != -1 && i < count) removeFileFromMemory(start + i, count - i);
+
+    if(start != -1 && i > 0) STAT_ADD(STAT_DELALLOC_RUNS, 1);
+
+    STAT_ADD(STAT_DELALLOC_BLOCKS, i);
+
+    // Whatever didn't make it stays held, to be tried again.
+    memmove(pending->data, pending->data + i * blockSize, (count - i) * blockSize);
+    pending->first += i;
+    pending->count -= i;
+
+    __atomic_fetch_sub(&delallocBytes, i * blockSize, __ATOMIC_RELAXED);
+
+    if(pending->count > 0) return -1;
+
+    pthread_mutex_lock(&allocLock);
+    reservedBlocks -= pending->reserved;
+    pending->reserved = 0;
+    pthread_mutex_unlock(&allocLock);
+
+    if(ret == 0 && (flags & DELALLOC_GROW)) preallocGrow(pending, pending->first);
+
+    return ret;
+}
+
+
+// Places the blocks a file holds, if it still has the inode it had when we looked (or any inode, if inode is 0), and
+// does what flags asks for. Takes its own locks and journal handle. Returns 0, or -1.
+static int delallocFlushFile(const char *directory, const char *filename, long inode, int flags)
+{
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+    struct cs1550_file_directory file;
+    int ret = 0;
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    if(getFile(directory, filename, &file) != -1 && (inode == 0 || file.nStartBlock == inode))
+    {
+        cs1550_delalloc *pending = delallocFind(file.nStartBlock);
+
+        if(pending != NULL)
+        {
+            ret = delallocPlace(pending, flags);
+
+            if(flags & DELALLOC_TRIM) preallocTrim(pending);
+
+            delallocPut(pending);
+        }
+    }
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    return ret;
+}
+
+
+// Lists every file that holds blocks or has blocks preallocated past its end, as a cs1550_prefetch each, which names a
+// file and its inode and so is all it takes to find it again. The files' locks come before delallocLock, so callers
+// list them first and lock them one at a time after. Returns how many there are (*files is for the caller to free),
+// or -1 if we are out of memory.
+static int delallocList(cs1550_prefetch **files)
+{
+    int count = 0, capacity = 0;
+    int i;
+
+    *files = NULL;
+
+    pthread_mutex_lock(&delallocLock);
+
+    for(i = 0; i < DELALLOC_BUCKETS && count != -1; i++)
+    {
+        cs1550_delalloc *pending;
+
+        for(pending = delallocTable[i]; pending != NULL; pending = pending->next)
+        {
+            if(count == capacity)
+            {
+                capacity = capacity > 0 ? capacity * 2 : 16;
+
+                cs1550_prefetch *grown = (cs1550_prefetch *) realloc(*files, capacity * sizeof(cs1550_prefetch));
+
+                if(grown == NULL)
+                {
+                    count = -1;
+                    break;
+                }
+
+                *files = grown;
+            }
+
+            strcpy((*files)[count].directory, pending->directory);
+            strcpy((*files)[count].filename, pending->filename);
+            (*files)[count++].inode = pending->inode;
+        }
+    }
+
+    pthread_mutex_unlock(&delallocLock);
+
+    return count;
+}
+
+
+// Places the blocks the file at path holds, or that every file holds if path is NULL, and does what flags asks for.
+// Returns 0, or -1 if some of them couldn't be placed.
+int delallocFlush(const char *path, int flags)
+{
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    cs1550_prefetch *files;
+    int ret = 0;
+    int i;
+
+    if(path != NULL)
+    {
+        if(parsePath(path, directory, filename, extension) != 0) return 0;
+
+        return delallocFlushFile(directory, filename, 0, flags);
+    }
+
+    int count = delallocList(&files);
+
+    if(count == -1) ret = -1;
+
+    for(i = 0; i < count; i++)
+    {
+        if(delallocFlushFile(files[i].directory, files[i].filename, files[i].inode, flags) != 0) ret = -1;
+    }
+
+    free(files);
+
+    return ret;
+}
+
+
+// Preallocates blocks past the end of a file whose held blocks were just placed there, as many as the file has up to
+// end (the block after the last one placed), so it can double in size before it needs any more. Only the hole right
+// after end is filled: blocks further on are the file's for good. The file's lock must be held for writing, inside
+// journalBegin()/journalEnd().
+void preallocGrow(cs1550_delalloc *pending, long end)
+{
+    long count = end < PREALLOC_MAX_BYTES / blockSize ? end : PREALLOC_MAX_BYTES / blockSize;
+    long hole = 0;
+    long allocated;
+
+    if(pending->preallocEnd > pending->preallocFirst || end < PREALLOC_MIN_BYTES / blockSize) return;
+
+    // Blocks fallocate put past the end can't be told apart from preallocated ones after a crash.
+    int flags = inodeFlags(pending->inode);
+
+    if(flags == -1 || (flags & INODE_KEEP_SIZE)) return;
+
+    // Leave the rest of the free blocks for everybody else.
+    pthread_mutex_lock(&allocLock);
+    long share = (freeBlocks - reservedBlocks) / PREALLOC_FREE_SHARE;
+    pthread_mutex_unlock(&allocLock);
+
+    if(count > share) count = share;
+
+    if(count > MAX_FILE_BLOCKS - end) count = MAX_FILE_BLOCKS - end;
+
+    while(hole < count && inodeBlockFor(pending->inode, end + hole, 0) == 0) hole++;
+
+    if(hole == 0) return;
+
+    // The mark goes in with the blocks, so a crash can't leave them without it.
+    if(inodeMark(pending->inode, INODE_PREALLOC, 0) != 0) return;
+
+    // A hole is filled from its start, so even if the disk fills up part way what was preallocated is one range.
+    inodeAllocate(pending->inode, end, hole, &allocated);
+
+    pending->preallocFirst = end;
+    pending->preallocEnd = end + allocated;
+
+    __atomic_fetch_add(&preallocBlocks, allocated, __ATOMIC_RELAXED);
+    STAT_ADD(STAT_PREALLOC_BLOCKS, allocated);
+}
+
+
+// Says that file blocks from up to (but not including) to are the file's to keep now, because it was written there or
+// fallocate asked for them, so any of them that were preallocated are never given back. Preallocated blocks after
+// them are kept as well if some before them aren't. pending may be NULL. The file's lock must be held for writing.
+void preallocKeep(cs1550_delalloc *pending, long from, long to)
+{
+    if(pending == NULL || to <= pending->preallocFirst || from >= pending->preallocEnd) return;
+
+    long before = pending->preallocEnd - pending->preallocFirst;
+
+    if(from <= pending->preallocFirst) pending->preallocFirst = to < pending->preallocEnd ? to : pending->preallocEnd;
+    else pending->preallocEnd = from;
+
+    __atomic_fetch_sub(&preallocBlocks, before - (pending->preallocEnd - pending->preallocFirst), __ATOMIC_RELAXED);
+}
+
+
+// Gives back the blocks preallocated past the end of a file that it never grew into. The file's lock must be held for
+// writing, inside journalBegin()/journalEnd(). Returns how many blocks were freed, indirect blocks included. If .disk
+// fails part way the inode stays marked, so preallocRecover() has another go at the rest.
+long preallocTrim(cs1550_delalloc *pending)
+{
+    long count = pending->preallocEnd - pending->preallocFirst;
+
+    if(count == 0) return 0;
+
+    long freed = inodeFreeRange(pending->inode, pending->preallocFirst, pending->preallocEnd);
+
+    pending->preallocFirst = 0;
+    pending->preallocEnd = 0;
+
+    if(freed == -1) freed = 0;
+    else inodeMark(pending->inode, 0, INODE_PREALLOC);
+
+    __atomic_fetch_sub(&preallocBlocks, count, __ATOMIC_RELAXED);
+    STAT_ADD(STAT_PREALLOC_TRIMMED, count);
+
+    return freed;
+}
+
+
+// Frees everything past the end of a file whose inode says it had blocks preallocated there, if nothing in memory
+// says it still has: they were preallocated before a crash, which took what we knew about them with it. The file's
+// lock must be held for writing, inside journalBegin()/journalEnd(). Returns how many blocks were freed.
+long preallocRecover(long inode, size_t fsize)
+{
+    cs1550_delalloc *pending = delallocFind(inode);
+    int flags = inodeFlags(inode);
+
+    if(flags == -1 || !(flags & INODE_PREALLOC) || (flags & INODE_INLINE)) return 0;
+    if(pending != NULL && pending->preallocEnd > pending->preallocFirst) return 0;
+
+    long freed = inodeFreeRange(inode, (fsize + blockSize - 1) / blockSize, MAX_FILE_BLOCKS);
+
+    if(freed == -1) return 0;
+
+    inodeMark(inode, 0, INODE_PREALLOC);
+
+    if(freed > 0) STAT_ADD(STAT_PREALLOC_TRIMMED, freed);
+
+    return freed;
+}
+
+
+// Gives back the blocks preallocated past the end of every file, because the disk is running out. Files whose locks
+// are taken right now keep theirs, so this never waits for anybody. Must be called inside journalBegin()/journalEnd(),
+// without allocLock or delallocLock. Returns how many blocks were freed.
+long preallocReclaim(void)
+{
+    cs1550_prefetch *files;
+    long freed = 0;
+    int i;
+
+    if(__atomic_load_n(&preallocBlocks, __ATOMIC_RELAXED) == 0) return 0;
+
+    int count = delallocList(&files);
+
+    for(i = 0; i < count; i++)
+    {
+        pthread_rwlock_t *lock = fileLock(files[i].directory, files[i].filename);
+
+        if(pthread_rwlock_trywrlock(lock) != 0) continue;
+
+        // Without the directory's lock there is no telling whether the file is still there, but whatever holds this
+        // inode under this name is guarded by the lock we have.
+        cs1550_delalloc *pending = delallocFind(files[i].inode);
+
+        if(pending != NULL && strcmp(pending->directory, files[i].directory) == 0 &&
+           strcmp(pending->filename, files[i].filename) == 0)
+        {
+            freed += preallocTrim(pending);
+            delallocPut(pending);
+        }
+
+        pthread_rwlock_unlock(lock);
+    }
+
+    free(files);
+
+    return freed;
+}
+
+
+// Gets ready for an operation that may allocate enough blocks for bytes of data. If the disk doesn't have them free,
+// blocks preallocated past the end of files are given back, and the running transaction is committed so that what it
+// freed can be allocated. Freed blocks can't be used before that commit, which operations can't wait for, so this is
+// done before they start. Must be called outside journalBegin()/journalEnd(), without any other lock.
+void makeRoom(size_t bytes)
+{
+    long count = (bytes + blockSize - 1) / blockSize;
+    long needed = count + count / indexPointers + 3;
+
+    pthread_mutex_lock(&allocLock);
+    long free = freeBlocks - reservedBlocks;
+    long waiting = freeingBlocks;
+    pthread_mutex_unlock(&allocLock);
+
+    if(free >= needed) return;
+
+    if(__atomic_load_n(&preallocBlocks, __ATOMIC_RELAXED) > 0)
+    {
+        journalBegin();
+        waiting += preallocReclaim();
+        journalEnd();
+    }
+
+    if(waiting > 0) journalCommit();
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+          DIRECTORIES
+
+ * * * * * * * * * * * * * * */
+
+
+// Copies the record of a file out of its directory. Returns the file's slot, or -1 if there is no such file.
+int getFile(const char *directory, const char *filename, struct cs1550_file_directory *file)
+{
+    cs1550_cached_dir *dir = lockDir(directory, 0);
+
+    if(dir == NULL) return -1;
+
+    int slot = findFile(dir, filename);
+
+    if(slot != -1) *file = *dirFile(dir, slot);
+
+    unlockDir(dir);
+
+    return slot;
+}
+
+
+// FNV-1a hash of a name.
+unsigned int hashName(const char *name)
+{
+    unsigned int hash = 2166136261u;
+
+    while(*name)
+    {
+        hash ^= (unsigned char) *name++;
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+
+// Returns the index into dirCache of the directory with the given name, or -1 if there isn't one.
+// namespaceLock must be held.
+int findDir(const char *name)
+{
+    STAT_ADD(STAT_DIR_LOOKUPS, 1);
+
+    if(dirHashSize == 0) return -1;
+
+    unsigned int slot = hashName(name) & (dirHashSize - 1);
+
+    while(dirHash[slot] != -1)
+    {
+        if(strcmp(dirCache[dirHash[slot]]->dname, name) == 0) return dirHash[slot];
+
+        slot = (slot + 1) & (dirHashSize - 1);
+    }
+
+    return -1;
+}
+
+
+// Finds a directory and locks it for reading, or for writing if write is set. Returns NULL if there is no such
+// directory. Everything that is locked here is released by unlockDir().
+cs1550_cached_dir *lockDir(const char *name, int write)
+{
+    pthread_rwlock_rdlock(&namespaceLock);
+
+    int index = findDir(name);
+
+    if(index == -1)
+    {
+        pthread_rwlock_unlock(&namespaceLock);
+        return NULL;
+    }
+
+    cs1550_cached_dir *dir = dirCache[index];
+
+    if(write) pthread_rwlock_wrlock(&dir->lock);
+    else pthread_rwlock_rdlock(&dir->lock);
+
+    return dir;
+}
+
+
+// Releases a directory locked by lockDir().
+void unlockDir(cs1550_cached_dir *dir)
+{
+    pthread_rwlock_unlock(&dir->lock);
+    pthread_rwlock_unlock(&namespaceLock);
+}
+
+
+// Returns the record of the file in a slot of a directory. The directory must be locked.
+struct cs1550_file_directory *dirFile(const cs1550_cached_dir *dir, int slot)
+{
+    return &dir->records[slot / FILES_PER_RECORD]->entry.files[slot % FILES_PER_RECORD];
+}
+
+
+// Returns the slot of the named file in a directory, or -1 if it isn't there. The directory must be locked.
+int findFile(const cs1550_cached_dir *dir, const char *filename)
+{
+    int probes = 0;
+
+    STAT_ADD(STAT_DIR_SCANS, 1);
+
+    if(dir->fileHashSize == 0) return -1;
+
+    unsigned int i = hashName(filename) & (dir->fileHashSize - 1);
+
+    while(dir->fileHash[i] != -1)
+    {
+        probes++;
+
+        if(strcmp(dirFile(dir, dir->fileHash[i])->fname, filename) == 0)
+        {
+            STAT_ADD(STAT_DIR_ENTRIES_SCANNED, probes);
+            return dir->fileHash[i];
+        }
+
+        i = (i + 1) & (dir->fileHashSize - 1);
+    }
+
+    STAT_ADD(STAT_DIR_ENTRIES_SCANNED, probes);
+
+    return -1;
+}
+
+
+// Returns the lock that guards the data of the named file.
+pthread_rwlock_t *fileLock(const char *directory, const char *filename)
+{
+    unsigned int hash = hashName(directory) * 31 + hashName(filename);
+
+    return &fileLocks[hash % FILE_LOCK_STRIPES];
+}
+
+
+// Puts dirCache[index] into the hash table, doubling the table when it gets more than half full. Returns 0, or -1 if
+// there's no memory to double it.
+static int hashDir(int index)
+{
+    if((index + 1) * 2 > dirHashSize)
+    {
+        int size = dirHashSize ? dirHashSize * 2 : 64;
+        int *grown = (int *) malloc(sizeof(int) * size);
+        int i;
+
+        if(grown == NULL) return -1;
+
+        free(dirHash);
+
+        dirHashSize = size;
+        dirHash = grown;
+
+        for(i = 0; i < dirHashSize; i++) dirHash[i] = -1;
+
+        for(i = 0; i < index; i++) hashDir(i);
+    }
+
+    unsigned int slot = hashName(dirCache[index]->dname) & (dirHashSize - 1);
+
+    while(dirHash[slot] != -1) slot = (slot + 1) & (dirHashSize - 1);
+
+    dirHash[slot] = index;
+
+    return 0;
+}
+
+
+// Puts a slot of a directory into its file hash table, which must have room for it.
+static void fileHashPut(cs1550_cached_dir *dir, int slot)
+{
+    unsigned int i = hashName(dirFile(dir, slot)->fname) & (dir->fileHashSize - 1);
+
+    while(dir->fileHash[i] != -1) i = (i + 1) & (dir->fileHashSize - 1);
+
+    dir->fileHash[i] = slot;
+}
+
+
+// Indexes a slot that now holds a file, doubling the directory's file hash table when it gets more than half full.
+// Returns 0, or -1 if there's no memory to double it. The directory must be locked for writing.
+static int hashFile(cs1550_cached_dir *dir, int slot)
+{
+    if((dir->fileCount + 1) * 2 > dir->fileHashSize)
+    {
+        int *old = dir->fileHash;
+        int oldSize = dir->fileHashSize;
+        int size = oldSize ? oldSize * 2 : 32;
+        int *grown = (int *) malloc(sizeof(int) * size);
+        int i;
+
+        if(grown == NULL) return -1;
+
+        dir->fileHashSize = size;
+        dir->fileHash = grown;
+
+        for(i = 0; i < dir->fileHashSize; i++) dir->fileHash[i] = -1;
+
+        for(i = 0; i < oldSize; i++)
+        {
+            if(old[i] != -1) fileHashPut(dir, old[i]);
+        }
+
+        free(old);
+    }
+
+    fileHashPut(dir, slot);
+    dir->fileCount++;
+
+    return 0;
+}
+
+
+// Takes a slot out of a directory's file hash table while its file's name is still there to find it by. The entries
+// after it are moved back to close the gap, as long as that doesn't put them before where their names hash to, so
+// nothing has to be left behind to mark the hole. The directory must be locked for writing.
+static void unhashFile(cs1550_cached_dir *dir, int slot)
+{
+    unsigned int mask = dir->fileHashSize - 1;
+    unsigned int hole = hashName(dirFile(dir, slot)->fname) & mask;
+    unsigned int i;
+
+    while(dir->fileHash[hole] != slot) hole = (hole + 1) & mask;
+
+    for(i = (hole + 1) & mask; dir->fileHash[i] != -1; i = (i + 1) & mask)
+    {
+        unsigned int home = hashName(dirFile(dir, dir->fileHash[i])->fname) & mask;
+
+        if(((i - home) & mask) >= ((i - hole) & mask))
+        {
+            dir->fileHash[hole] = dir->fileHash[i];
+            hole = i;
+        }
+    }
+
+    dir->fileHash[hole] = -1;
+    dir->fileCount--;
+}
+
+
+// Grows one of a directory's arrays to hold count entries of size bytes. Returns 0, or -1 and leaves it as it was.
+static int growArray(void *array, size_t count, size_t size)
+{
+    void *grown = realloc(*(void **) array, count * size);
+
+    if(grown == NULL) return -1;
+
+    *(void **) array = grown;
+
+    return 0;
+}
+
+
+// Appends a record to a directory's list of them and indexes the files in it. Returns its index, or -1 if there's no
+// memory for it (a record whose files couldn't all be indexed is still appended, so freeDir() gets it back). The
+// directory must be locked for writing, or not yet be in dirCache.
+static int cacheRecord(cs1550_cached_dir *dir, const cs1550_directory_entry *entry, long offset)
+{
+    int i;
+
+    if(dir->recordCount == dir->recordCapacity)
+    {
+        int capacity = dir->recordCapacity ? dir->recordCapacity * 2 : 4;
+
+        // The arrays that did grow are just bigger than they need to be if a later one can't.
+        if(growArray(&dir->records, capacity, sizeof(cs1550_dir_record *)) != 0 ||
+           growArray(&dir->dirtyRecords, capacity, sizeof(int)) != 0 ||
+           growArray(&dir->grownRecords, capacity, sizeof(int)) != 0 ||
+           growArray(&dir->freeSlots, capacity * FILES_PER_RECORD, sizeof(int)) != 0)
+        {
+            return -1;
+        }
+
+        dir->recordCapacity = capacity;
+    }
+
+    cs1550_dir_record *record = (cs1550_dir_record *) malloc(sizeof(cs1550_dir_record));
+
+    if(record == NULL) return -1;
+
+    int index = dir->recordCount++;
+
+    record->entry = *entry;
+    record->offset = offset;
+    record->dirty = 0;
+    record->sizesDirty = 0;
+
+    dir->records[index] = record;
+
+    int nFiles = record->entry.nFiles;
+
+    if(nFiles < 0) nFiles = 0;
+    if(nFiles > FILES_PER_RECORD) nFiles = FILES_PER_RECORD;
+
+    // Slots from nFiles on can still hold files removed back when the rest were moved down over them.
+    memset(&record->entry.files[nFiles], 0, (FILES_PER_RECORD - nFiles) * sizeof(struct cs1550_file_directory));
+    record->entry.nFiles = nFiles;
+
+    for(i = 0; i < nFiles; i++)
+    {
+        if(record->entry.files[i].nStartBlock != 0 && hashFile(dir, index * FILES_PER_RECORD + i) != 0) return -1;
+    }
+
+    return index;
+}
+
+
+// Puts the unused slots of one of a directory's records on its stack of them, lowest on top.
+static void freeRecordSlots(cs1550_cached_dir *dir, int record)
+{
+    int i;
+
+    for(i = FILES_PER_RECORD - 1; i >= 0; i--)
+    {
+        if(dir->records[record]->entry.files[i].nStartBlock == 0)
+        {
+            dir->freeSlots[dir->freeCount++] = record * FILES_PER_RECORD + i;
+        }
+    }
+}
+
+
+// Frees a directory's cached copy.
+static void freeDir(cs1550_cached_dir *dir)
+{
+    int i;
+
+    for(i = 0; i < dir->recordCount; i++) free(dir->records[i]);
+
+    free(dir->records);
+    free(dir->fileHash);
+    free(dir->freeSlots);
+    free(dir->dirtyRecords);
+    free(dir->grownRecords);
+
+    pthread_rwlock_destroy(&dir->lock);
+    free(dir);
+}
+
+
+// Appends a directory to the end of dirCache, starting with its first record, and indexes it. Returns its index, or
+// -1 if there's no memory for it. namespaceLock must be held for writing.
+static int cacheDir(const cs1550_directory_entry *entry, long offset)
+{
+    if(dirCount == dirCapacity)
+    {
+        int capacity = dirCapacity ? dirCapacity * 2 : 16;
+
+        if(growArray(&dirCache, capacity, sizeof(cs1550_cached_dir *)) != 0) return -1;
+
+        dirCapacity = capacity;
+    }
+
+    cs1550_cached_dir *dir = (cs1550_cached_dir *) calloc(1, sizeof(cs1550_cached_dir));
+
+    if(dir == NULL) return -1;
+
+    memcpy(dir->dname, entry->dname, sizeof(dir->dname));
+    dir->dname[MAX_FILENAME] = '\0';
+    dir->offset = offset;
+    pthread_rwlock_init(&dir->lock, NULL);
+
+    dirCache[dirCount] = dir;
+
+    if(cacheRecord(dir, entry, offset) == -1 || hashDir(dirCount) != 0)
+    {
+        freeDir(dir);
+        return -1;
+    }
+
+    return dirCount++;
+}
+
+
+// Reads every record in .directories into the directory cache. Called once at mount.
+int loadDirectories(void)
+{
+    int i, j;
+
+    for(i = 0; i < dirCount; i++) freeDir(dirCache[i]);
+
+    free(dirCache);
+    free(dirHash);
+
+    dirCache = NULL;
+    dirHash = NULL;
+    dirCount = 0;
+    dirCapacity = 0;
+    dirHashSize = 0;
+
+    cs1550_directory_entry entry;
+    long offset;
+    long files = 0;
+
+    for(offset = 0; offset < directoriesSize; offset += sizeof(cs1550_directory_entry))
+    {
+        if(directoriesRead(&entry, sizeof(cs1550_directory_entry), offset) != sizeof(cs1550_directory_entry)) return -1;
+
+        entry.dname[MAX_FILENAME] = '\0';
+
+        // Records after a directory's first one carry its name too.
+        int index = findDir(entry.dname);
+
+        if(index == -1) index = cacheDir(&entry, offset);
+        else if(cacheRecord(dirCache[index], &entry, offset) == -1) index = -1;
+
+        if(index == -1) return -1;
+    }
+
+    for(i = 0; i < dirCount; i++)
+    {
+        for(j = dirCache[i]->recordCount - 1; j >= 0; j--) freeRecordSlots(dirCache[i], j);
+
+        files += dirCache[i]->fileCount;
+    }
+
+    fileTotal = files;
+
+    LOG_INFO("Loaded %d directories holding %ld files.", dirCount, files);
+
+    return 0;
+}
+
+
+// Creates a new, empty directory record at the end of .directories. Returns its index, or -1 if there's no memory for
+// it. namespaceLock must be held for writing, inside journalBegin()/journalEnd().
+int addDir(const char *name)
+{
+    cs1550_directory_entry entry;
+    size_t length = strlen(name);
+
+    // cs1550_mkdir() turns away names that don't fit.
+    assert(length <= MAX_FILENAME);
+
+    memset(&entry, 0, sizeof(cs1550_directory_entry));
+    memcpy(entry.dname, name, length);
+
+    int index = cacheDir(&entry, 0);
+
+    if(index == -1) return -1;
+
+    // The record only gets its place in .directories once it's sure to be written there, so a failure can't leave a
+    // gap. Other directories can be growing at the same time, with only namespaceLock held for reading.
+    long offset = __atomic_fetch_add(&directoriesSize, sizeof(cs1550_directory_entry), __ATOMIC_RELAXED);
+
+    dirCache[index]->offset = offset;
+    dirCache[index]->records[0]->offset = offset;
+
+    freeRecordSlots(dirCache[index], 0);
+    writeDir(dirCache[index], 0);
+
+    __atomic_fetch_add(&namespaceGeneration, 1, __ATOMIC_RELEASE);
+
+    return index;
+}
+
+
+// Gives a directory with every slot in use another record, at the end of .directories. Returns 0, or -1 if there's no
+// memory for it. The directory must be locked for writing, inside journalBegin()/journalEnd().
+static int growDir(cs1550_cached_dir *dir)
+{
+    cs1550_directory_entry entry;
+
+    memset(&entry, 0, sizeof(cs1550_directory_entry));
+    memcpy(entry.dname, dir->dname, sizeof(entry.dname));
+
+    int record = cacheRecord(dir, &entry, 0);
+
+    if(record == -1) return -1;
+
+    // As in addDir(), the place in .directories is only taken once nothing can fail.
+    dir->records[record]->offset = __atomic_fetch_add(&directoriesSize, sizeof(cs1550_directory_entry),
+                                                      __ATOMIC_RELAXED);
+
+    freeRecordSlots(dir, record);
+    writeDir(dir, record);
+
+    return 0;
+}
+
+
+// Marks the cached copy of one of a directory's records as changed, so the next journal commit writes it over the
+// record in .directories. The directory must be locked for writing, inside journalBegin()/journalEnd().
+int writeDir(cs1550_cached_dir *dir, int record)
+{
+    STAT_ADD(STAT_DIR_WRITES, 1);
+
+    if(!dir->records[record]->dirty)
+    {
+        dir->records[record]->dirty = 1;
+        dir->dirtyRecords[dir->dirtyCount++] = record;
+        journalAddPending(sizeof(cs1550_directory_entry));
+    }
+
+    return 0;
+}
+
+
+// Writes back the sizes that writes to a directory's files have changed since their records were last written. Until
+// then they live only in the cached copy, so a stream of writes costs one record write and not one per write. The
+// directory must be locked for writing, inside journalBegin()/journalEnd().
+void writeSizes(cs1550_cached_dir *dir)
+{
+    int i;
+
+    for(i = 0; i < dir->grownCount; i++)
+    {
+        dir->records[dir->grownRecords[i]]->sizesDirty = 0;
+        writeDir(dir, dir->grownRecords[i]);
+    }
+
+    dir->grownCount = 0;
+}
+
+
+// Does writeSizes() for the directory path is in, or for every directory if path is NULL. Takes its own locks and
+// journal handle.
+void writeBackSizes(const char *path)
+{
+    journalBegin();
+
+    if(path != NULL)
+    {
+        char directory[MAX_FILENAME + 1];
+        char filename[MAX_FILENAME + 1];
+        char extension[MAX_EXTENSION + 1];
+
+        cs1550_cached_dir *dir = NULL;
+
+        if(parsePath(path, directory, filename, extension) == 0) dir = lockDir(directory, 1);
+
+        if(dir != NULL)
+        {
+            writeSizes(dir);
+            unlockDir(dir);
+        }
+    }
+    else
+    {
+        int i;
+
+        pthread_rwlock_rdlock(&namespaceLock);
+
+        for(i = 0; i < dirCount; i++)
+        {
+            cs1550_cached_dir *dir = dirCache[i];
+
+            pthread_rwlock_wrlock(&dir->lock);
+            writeSizes(dir);
+            pthread_rwlock_unlock(&dir->lock);
+        }
+
+        pthread_rwlock_unlock(&namespaceLock);
+    }
+
+    journalEnd();
+}
+
+
+// find out how many blocks you'll need to store a file of a given size.
+int getBlockSize(size_t fsize)
+{
+    if(fsize == 0) return 1;
+    else
+    {
+        int blocks = fsize / blockSize;
+        int remainder = fsize % blockSize;
+
+        if(remainder != 0) blocks++;
+
+        return blocks;
+    }
+}
+
+
+// Adds an empty file to a directory. Returns 0 or a negative errno. The file's lock must be held, inside
+// journalBegin()/journalEnd().
+int makeFile(const char *directory, const char *filename, const char *extension)
+{
+    cs1550_cached_dir *dir = lockDir(directory, 1);
+
+    if(dir == NULL) return -ENOENT;
+
+    if(findFile(dir, filename) != -1)
+    {
+        unlockDir(dir);
+        return -EEXIST;
+    }
+
+    if(dir->freeCount == 0 && growDir(dir) != 0)
+    {
+        unlockDir(dir);
+        return -ENOSPC;
+    }
+
+    // A new file is just an empty inode; blocks are allocated as it is written.
+    long startBlock = inodeCreate();
+
+    if(startBlock == -1)
+    {
+        unlockDir(dir);
+        return -ENOSPC;
+    }
+
+    int slot = dir->freeSlots[dir->freeCount - 1];
+    cs1550_directory_entry *entry = &dir->records[slot / FILES_PER_RECORD]->entry;
+    struct cs1550_file_directory *file = dirFile(dir, slot);
+
+    strcpy(file->fname, filename);
+    strcpy(file->fext, extension);
+    file->fsize = 0;
+    file->nStartBlock = startBlock;
+
+    if(hashFile(dir, slot) != 0)
+    {
+        memset(file, 0, sizeof(struct cs1550_file_directory));
+        inodeFree(startBlock);
+        unlockDir(dir);
+        return -ENOSPC;
+    }
+
+    dir->freeCount--;
+
+    if(entry->nFiles <= slot % FILES_PER_RECORD) entry->nFiles = slot % FILES_PER_RECORD + 1;
+
+    dir->generation++;
+    __atomic_fetch_add(&fileTotal, 1, __ATOMIC_RELAXED);
+
+    writeDir(dir, slot / FILES_PER_RECORD);
+
+    unlockDir(dir);
+
+    return 0;
+}
+
+
+// Removes a file from a directory and frees its blocks. Its slot is left empty for the next file. Returns 0, or -1 if
+// there is no such file. The file's lock must be held, inside journalBegin()/journalEnd().
+int removeFile(const char *directory, const char *filename)
+{
+    cs1550_cached_dir *dir = lockDir(directory, 1);
+
+    if(dir == NULL) return -ENOENT;
+
+    int slot = findFile(dir, filename);
+
+    if(slot != -1)
+    {
+        cs1550_directory_entry *entry = &dir->records[slot / FILES_PER_RECORD]->entry;
+
+        inodeFree(dirFile(dir, slot)->nStartBlock);
+
+        unhashFile(dir, slot);
+        memset(dirFile(dir, slot), 0, sizeof(struct cs1550_file_directory));
+
+        while(entry->nFiles > 0 && entry->files[entry->nFiles - 1].nStartBlock == 0) entry->nFiles--;
+
+        dir->freeSlots[dir->freeCount++] = slot;
+        dir->generation++;
+        __atomic_fetch_sub(&fileTotal, 1, __ATOMIC_RELAXED);
+
+        writeDir(dir, slot / FILES_PER_RECORD);
+    }
+
+    unlockDir(dir);
+
+    return slot != -1 ? 0 : -1;
+}
+
+
+// Does the work of cs1550_write() once the file's lock is held. Nobody else can change the file's record or inode while
+// we hold it, but other files in the directory can come and go, so the directory is only locked to copy the record out
+// and to put the new size in. Must be called inside journalBegin()/journalEnd().
+int writeToFile(const char *directory, const char *filename, struct fuse_bufvec *buf, size_t size, off_t offset)
+{
+    noteActivity();
+
+    struct cs1550_file_directory file;
+
+    //check to make sure path exists
+    if(getFile(directory, filename, &file) == -1)
+    {
+        LOG_DEBUG("Cannot find specified file.");
+        return -1;
+    }
+
+    if(!inodeValid(file.nStartBlock)) return -EIO;
+
+    // A write past the end leaves a hole, which gets no blocks and reads as zeros. So does whatever was past the end
+    // in the file's last block.
+    if(offset > (off_t) file.fsize && inodeZeroTail(file.nStartBlock, file.fsize) != 0) return -EIO;
+
+    // Only the blocks the write touches for the first time need blocks of .disk, and those are held back until the
+    // file stops growing. A file that still fits in its inode doesn't need any.
+    cs1550_delalloc *pending = delallocFind(file.nStartBlock);
+
+    if(pending == NULL && offset + size > file.fsize && offset + size > INLINE_CAPACITY)
+    {
+        // Blocks a crash left preallocated past the end are given back the first time the file grows after it.
+        preallocRecover(file.nStartBlock, file.fsize);
+
+        pending = delallocGet(directory, filename, file.nStartBlock);
+    }
+
+    int ret = inodeWrite(file.nStartBlock, pending, buf, size, offset);
+    int error = errno;
+
+    // Preallocated blocks the file has grown into aren't spare any more.
+    if(ret != -1) preallocKeep(pending, 0, (offset + size + blockSize - 1) / blockSize);
+
+    // A write past the end that failed part way can leave blocks there that the file's size never covers.
+    if(ret == -1 && offset + size > file.fsize) preallocRecover(file.nStartBlock, file.fsize);
+
+    delallocPut(pending);
+
+    // ENOSPC for a full disk, EFBIG for a file that can't grow that far, EIO (or the like) when .disk fails. A path
+    // that forgot to set errno still mustn't look like a write of nothing.
+    if(ret == -1) return error != 0 ? -error : -EIO;
+
+    if((offset + size) <= file.fsize) return size;
+
+    growFile(directory, filename, offset + size);
+
+    return size;
+}
+
+
+// Makes a file fsize bytes long, which is more than it was. The new size goes in the cached copy of the directory only;
+// it gets written back at flush, fsync, release or the next checkpoint, whichever comes first. The file's lock must be
+// held for writing.
+void growFile(const char *directory, const char *filename, size_t fsize)
+{
+    cs1550_cached_dir *dir = lockDir(directory, 1);
+
+    int slot = findFile(dir, filename);
+    cs1550_dir_record *record = dir->records[slot / FILES_PER_RECORD];
+
+    dirFile(dir, slot)->fsize = fsize;
+
+    if(!record->sizesDirty)
+    {
+        record->sizesDirty = 1;
+        dir->grownRecords[dir->grownCount++] = slot / FILES_PER_RECORD;
+    }
+
+    unlockDir(dir);
+}
+
+
+// Makes a file fsize bytes long, which is less than it was. Unlike a grown size, this one is written back with the
+// transaction that frees the blocks past it, so the record never claims blocks that are gone. The file's lock must be
+// held for writing, inside journalBegin()/journalEnd().
+void shrinkFile(const char *directory, const char *filename, size_t fsize)
+{
+    cs1550_cached_dir *dir = lockDir(directory, 1);
+
+    int slot = findFile(dir, filename);
+
+    dirFile(dir, slot)->fsize = fsize;
+    writeDir(dir, slot / FILES_PER_RECORD);
+
+    unlockDir(dir);
+}
+
+
+// Does the work of cs1550_truncate() once the file's lock is held. Cutting a file short frees its blocks past the new
+// end, the ones it holds in memory and the ones preallocated for it included, and zeroes the rest of the block the
+// end is in. Making it longer allocates nothing: the new part is a hole. Returns 0 or a negative errno. Must be called
+// inside journalBegin()/journalEnd().
+int truncateFile(const char *directory, const char *filename, off_t size)
+{
+    struct cs1550_file_directory file;
+
+    noteActivity();
+
+    if(getFile(directory, filename, &file) == -1) return -ENOENT;
+
+    if(size < 0) return -EINVAL;
+    if((size + blockSize - 1) / blockSize > MAX_FILE_BLOCKS) return -EFBIG;
+
+    if(!inodeValid(file.nStartBlock)) return -EIO;
+
+    if(size == (off_t) file.fsize) return 0;
+
+    if(size > (off_t) file.fsize)
+    {
+        if(inodeZeroTail(file.nStartBlock, file.fsize) != 0) return -EIO;
+
+        growFile(directory, filename, size);
+
+        return 0;
+    }
+
+    int isInline = inodeInline(file.nStartBlock);
+    cs1550_delalloc *pending = delallocFind(file.nStartBlock);
+
+    if(isInline == -1) return -EIO;
+
+    if(pending != NULL)
+    {
+        delallocTruncate(pending, size);
+        preallocTrim(pending);
+        delallocPut(pending);
+    }
+
+    // Nothing is left past the end, asked for or not.
+    if(!isInline)
+    {
+        if(inodeFreeRange(file.nStartBlock, (size + blockSize - 1) / blockSize, MAX_FILE_BLOCKS) == -1) return -EIO;
+
+        if(inodeMark(file.nStartBlock, 0, INODE_KEEP_SIZE | INODE_PREALLOC) != 0) return -EIO;
+    }
+
+    if(inodeZeroTail(file.nStartBlock, size) != 0) return -EIO;
+
+    shrinkFile(directory, filename, size);
+
+    return 0;
+}
+
+
+// Does the work of cs1550_fallocate() once the file's lock is held: gives every block of the file from offset up to
+// offset + length a zeroed block of .disk if it has none, and makes the file at least that long unless mode has
+// FALLOC_FL_KEEP_SIZE. Returns 0 or a negative errno. Must be called inside journalBegin()/journalEnd().
+int allocateToFile(const char *directory, const char *filename, int mode, off_t offset, off_t length)
+{
+    struct cs1550_file_directory file;
+
+    if(getFile(directory, filename, &file) == -1) return -ENOENT;
+
+    if((mode & ~FALLOC_FL_KEEP_SIZE) != 0) return -EOPNOTSUPP;
+    if(offset < 0 || length <= 0) return -EINVAL;
+    if((offset + length + blockSize - 1) / blockSize > MAX_FILE_BLOCKS) return -EFBIG;
+
+    if(!inodeValid(file.nStartBlock)) return -EIO;
+
+    int isInline = inodeInline(file.nStartBlock);
+    long first = offset / blockSize;
+    long count = (offset + length + blockSize - 1) / blockSize - first;
+    long allocated;
+
+    if(isInline == -1) return -EIO;
+
+    // Space that fits in the inode is there already.
+    if(isInline && offset + length > (off_t) INLINE_CAPACITY)
+    {
+        if(inodeUninline(file.nStartBlock, NULL) != 0) return -ENOSPC;
+
+        isInline = 0;
+    }
+
+    if(!isInline)
+    {
+        cs1550_delalloc *pending = delallocFind(file.nStartBlock);
+
+        preallocRecover(file.nStartBlock, file.fsize);
+
+        // What the file holds goes first, so none of its blocks are given a block here and then placed again.
+        if(pending != NULL && delallocPlace(pending, 0) != 0) return -ENOSPC;
+
+        preallocKeep(pending, first, first + count);
+
+        // Blocks asked for past the end have to outlive a crash, which preallocated ones don't, so the file stops
+        // having any.
+        if((mode & FALLOC_FL_KEEP_SIZE) && offset + length > (off_t) file.fsize)
+        {
+            if(pending != NULL) preallocTrim(pending);
+
+            if(inodeMark(file.nStartBlock, INODE_KEEP_SIZE, INODE_PREALLOC) != 0)
+            {
+                delallocPut(pending);
+                return -EIO;
+            }
+        }
+
+        delallocPut(pending);
+
+        // Whatever was allocated before the disk filled up stays the file's.
+        if(inodeAllocate(file.nStartBlock, first, count, &allocated) != 0) return -ENOSPC;
+    }
+
+    if(!(mode & FALLOC_FL_KEEP_SIZE) && offset + length > (off_t) file.fsize)
+    {
+        if(inodeZeroTail(file.nStartBlock, file.fsize) != 0) return -EIO;
+
+        growFile(directory, filename, offset + length);
+    }
+
+    return 0;
+}
+
+
+// Copies count characters of a path into part, which has room for max of them and a null. Returns -1 if they don't fit.
+static int copyPathPart(char *part, const char *from, size_t count, size_t max)
+{
+    if(count > max) return -1;
+
+    memcpy(part, from, count);
+    part[count] = '\0';
+
+    return 0;
+}
+
+
+// Splits a path of the form /directory/filename.extension into its parts, leaving the ones it doesn't have empty.
+// directory and filename need room for MAX_FILENAME characters and a null, extension for MAX_EXTENSION and a null.
+// Returns 0, or -ENAMETOOLONG if a part is too long to be stored.
+int parsePath(const char *path, char *directory, char *filename, char *extension)
+{
+    directory[0] = '\0';
+    filename[0] = '\0';
+    extension[0] = '\0';
+
+    if(*path == '/') path++;
+
+    size_t length = strcspn(path, "/");
+    if(copyPathPart(directory, path, length, MAX_FILENAME) != 0) return -ENAMETOOLONG;
+
+    path += length;
+    if(*path == '/') path++;
+
+    length = strcspn(path, ".");
+    if(copyPathPart(filename, path, length, MAX_FILENAME) != 0) return -ENAMETOOLONG;
+
+    path += length;
+    if(*path == '.') path++;
+
+    if(copyPathPart(extension, path, strlen(path), MAX_EXTENSION) != 0) return -ENAMETOOLONG;
+
+    return 0;
+}
+
+
+// Finds out what a path names, going to the directories only if the lookup cache doesn't already know. Sets *dir to
+// the directory the path is in and *slot to the file's slot in it, or to LOOKUP_DIRECTORY if the path is the
+// directory; *size gets the file's size. Returns 0, -ENOENT if there is no such file or directory, or -ENAMETOOLONG.
+//
+// Cached answers carry the generation they were found under, so one goes stale the moment a mknod or unlink in its
+// directory (or a mkdir, for directories that didn't exist) could change it, and nothing has to be cleared out.
+int resolvePath(const char *path, cs1550_cached_dir **dir, int *slot, size_t *size)
+{
+    size_t length = strlen(path);
+    unsigned int index = hashName(path) % LOOKUP_CACHE_SIZE;
+    pthread_mutex_t *lock = &lookupLocks[index % LOOKUP_STRIPES];
+    cs1550_lookup found;
+
+    *size = 0;
+
+    if(length < LOOKUP_PATH)
+    {
+        pthread_mutex_lock(lock);
+        found = lookupCache[index];
+        pthread_mutex_unlock(lock);
+
+        if(strcmp(found.path, path) == 0)
+        {
+            if(found.dir == NULL)
+            {
+                if(found.generation == __atomic_load_n(&namespaceGeneration, __ATOMIC_ACQUIRE))
+                {
+                    STAT_ADD(STAT_LOOKUP_HITS, 1);
+                    return -ENOENT;
+                }
+            }
+            else
+            {
+                // Directories are never freed, so the pointer is still good even if the answer isn't.
+                pthread_rwlock_rdlock(&found.dir->lock);
+
+                int fresh = found.generation == found.dir->generation;
+
+                if(fresh && found.slot >= 0) *size = dirFile(found.dir, found.slot)->fsize;
+
+                pthread_rwlock_unlock(&found.dir->lock);
+
+                if(fresh)
+                {
+                    STAT_ADD(STAT_LOOKUP_HITS, 1);
+
+                    *dir = found.dir;
+                    *slot = found.slot;
+
+                    return found.slot == LOOKUP_MISSING ? -ENOENT : 0;
+                }
+            }
+        }
+    }
+
+    STAT_ADD(STAT_LOOKUP_MISSES, 1);
+
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    pthread_rwlock_rdlock(&namespaceLock);
+
+    int dirIndex = findDir(directory);
+
+    found.dir = NULL;
+    found.slot = LOOKUP_MISSING;
+
+    if(dirIndex == -1)
+    {
+        found.generation = __atomic_load_n(&namespaceGeneration, __ATOMIC_ACQUIRE);
+    }
+    else
+    {
+        found.dir = dirCache[dirIndex];
+
+        pthread_rwlock_rdlock(&found.dir->lock);
+
+        if(strcmp(filename, "") == 0) found.slot = LOOKUP_DIRECTORY;
+        else
+        {
+            int i = findFile(found.dir, filename);
+
+            if(i != -1)
+            {
+                found.slot = i;
+                *size = dirFile(found.dir, i)->fsize;
+            }
+        }
+
+        found.generation = found.dir->generation;
+
+        pthread_rwlock_unlock(&found.dir->lock);
+    }
+
+    pthread_rwlock_unlock(&namespaceLock);
+
+    if(length < LOOKUP_PATH)
+    {
+        memcpy(found.path, path, length + 1);
+
+        pthread_mutex_lock(lock);
+        lookupCache[index] = found;
+        pthread_mutex_unlock(lock);
+    }
+
+    *dir = found.dir;
+    *slot = found.slot;
+
+    return found.slot == LOOKUP_MISSING ? -ENOENT : 0;
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+     FILESYSTEM FUNCTIONS
+
+ * * * * * * * * * * * * * * */
+
+
+
+static int cs1550_getattr(const char *path, struct stat *stbuf)
+{
+    int res = 0;
+
+    memset(stbuf, 0, sizeof(struct stat));
+
+    //is path the root dir?
+    if (strcmp(path, "/") == 0)
+    {
+        //Check if name is subdirectory
+        stbuf->st_mode = S_IFDIR | 0755;
+        stbuf->st_nlink = 2;
+        res = 0;
+    }
+    else if(strcmp(path, STATS_PATH) == 0)
+    {
+        char text[STATS_TEXT_SIZE];
+
+        stbuf->st_mode = S_IFREG | 0444;
+        stbuf->st_nlink = 1;
+        stbuf->st_size = statsRender(text, sizeof(text));
+    }
+    else
+    {
+        cs1550_cached_dir *dir;
+        int slot;
+        size_t size;
+
+        res = resolvePath(path, &dir, &slot, &size);
+
+        if(res != 0)
+        {
+            LOG_DEBUG("%s could not be found", path);
+        }
+        else if(slot == LOOKUP_DIRECTORY)
+        {
+            stbuf->st_mode = S_IFDIR | 0755;
+            stbuf->st_nlink = 2;
+        }
+        else
+        {
+            //regular file, probably want to be read and write
+            stbuf->st_mode = S_IFREG | 0666;
+            stbuf->st_nlink = 1; //file links
+            stbuf->st_size = size;
+        }
+    }
+    return res;
+}
+
+
+/* 
+ * Called whenever the contents of a directory are desired. Could be from an 'ls'
+ * or could even be when a user hits TAB to do autocompletion
+ *
+ * Every name goes to filler with the offset to carry on from after it, so a
+ * listing too big for one reply picks up where it left off. Files stay in
+ * their slots, and directories in dirCache, so the order stays the same as
+ * things are added and removed.
+ */
+static int cs1550_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    (void) fi;
+
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    if(offset < 1 && filler(buf, ".", NULL, 1)) return 0;
+    if(offset < 2 && filler(buf, "..", NULL, 2)) return 0;
+
+    if (strcmp(path, "/") == 0)
+    { // If we're in the root, fill in the directories
+        int i;
+
+        if(offset < 3 && filler(buf, STATS_PATH + 1, NULL, 3)) return 0;
+
+        pthread_rwlock_rdlock(&namespaceLock);
+
+        for(i = offset > 3 ? offset - 3 : 0; i < dirCount; i++)
+        {
+            if(filler(buf, dirCache[i]->dname, NULL, i + 4)) break;
+        }
+
+        pthread_rwlock_unlock(&namespaceLock);
+
+        return 0;
+    }
+    else
+    { // Otherwise display the files in the current dir
+        cs1550_cached_dir *dir = lockDir(directory, 0);
+
+        if(dir != NULL)
+        { // Go to our dir
+            int slot;
+            for (slot = offset > 2 ? offset - 2 : 0; slot < dir->recordCount * FILES_PER_RECORD; slot++)
+            { // And add all the files
+                struct cs1550_file_directory *file = dirFile(dir, slot);
+
+                if(file->nStartBlock != 0 && filler(buf, file->fname, NULL, slot + 3)) break;
+            }
+
+            unlockDir(dir);
+        }
+        else
+        {
+            LOG_DEBUG("We couldn't find your dir... SORRY!");
+        }
+    }
+    return 0;
+}
+
+
+/* 
+ * Creates a directory. We can ignore mode since we're not dealing with
+ * permissions, as long as getattr returns appropriate ones for us.
+ */
+static int cs1550_mkdir(const char *path, mode_t mode)
+{
+    (void) mode;
+
+    if(strcmp(path, STATS_PATH) == 0) return -EEXIST;
+
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+
+    // Directories only go in the root, and their records only have room for so much of a name. Two names cut to the
+    // same length would be taken for one directory at the next mount.
+    if(strchr(path + 1, '/') != NULL) return -EPERM;
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    int ret = 0;
+
+    journalBegin();
+    pthread_rwlock_wrlock(&namespaceLock);
+
+    if(findDir(directory) != -1) ret = -EEXIST;
+    else if(addDir(directory) == -1) ret = -ENOSPC;
+
+    pthread_rwlock_unlock(&namespaceLock);
+    journalEnd();
+
+    return ret;
+}
+
+
+/* 
+ * Removes a directory.
+ */
+static int cs1550_rmdir(const char *path)
+{
+    (void) path;
+    return 0;
+}
+
+
+/* 
+ * Does the actual creation of a file. Mode and dev can be ignored.
+ */
+static int cs1550_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    (void) mode;
+    (void) dev;
+
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    if(strcmp("/", directory) == 0)
+    {
+        LOG_DEBUG("I'm sorry, but you can't create files in the root directory.");
+        return -1;
+    }
+
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+
+    makeRoom(blockSize);
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    int ret = makeFile(directory, filename, extension);
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    return ret;
+}
+
+
+/*
+ * Deletes a file
+ */
+static int cs1550_unlink(const char *path)
+{
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    int ret = removeFile(directory, filename);
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    return ret;
+}
+
+
+/* 
+ * Read size bytes from file into buf starting from offset
+ *
+ */
+static int cs1550_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    if(size <= 0)
+    {
+        LOG_DEBUG("Size too small.");
+        return -1;
+    }
+
+    if(strcmp(path, STATS_PATH) == 0) return readStats(buf, size, offset, fi);
+
+    return readFile(path, buf, NULL, size, offset, fi != NULL ? (cs1550_readahead *) (uintptr_t) fi->fh : NULL);
+}
+
+
+/*
+ * Like cs1550_read(), but hands FUSE a list of buffers instead of filling
+ * one, so data that is already on .disk doesn't have to be copied at all.
+ */
+static int cs1550_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                           struct fuse_file_info *fi)
+{
+    struct fuse_bufvec *bufv = NULL;
+    int ret;
+
+    if(size > 0 && strcmp(path, STATS_PATH) != 0)
+    {
+        ret = readFile(path, NULL, &bufv, size, offset, fi != NULL ? (cs1550_readahead *) (uintptr_t) fi->fh : NULL);
+
+        if(ret < 0) return ret;
+    }
+    else
+    {
+        // Nothing on .disk to point at, so this is an ordinary read into one buffer.
+        bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+        char *mem = (char *) malloc(size > 0 ? size : 1);
+
+        if(bufv == NULL || mem == NULL)
+        {
+            free(bufv);
+            free(mem);
+            return -ENOMEM;
+        }
+
+        ret = cs1550_read(path, mem, size, offset, fi);
+
+        if(ret < 0)
+        {
+            free(bufv);
+            free(mem);
+            return ret;
+        }
+
+        *bufv = FUSE_BUFVEC_INIT(ret);
+        bufv->buf[0].mem = mem;
+    }
+
+    // Reads at or past the end of the file come back with nothing to point at.
+    if(bufv == NULL)
+    {
+        bufv = (struct fuse_bufvec *) malloc(sizeof(struct fuse_bufvec));
+
+        if(bufv == NULL) return -ENOMEM;
+
+        *bufv = FUSE_BUFVEC_INIT(0);
+    }
+
+    *bufp = bufv;
+
+    return 0;
+}
+
+
+// Does the work of cs1550_read() and cs1550_read_buf() for files: into buf if it isn't NULL, otherwise into a buffer
+// vector left at *bufp (which stays untouched if there is nothing to read). ra is the open file's readahead state, or
+// NULL. Returns how many bytes were read, or a negative errno.
+int readFile(const char *path, char *buf, struct fuse_bufvec **bufp, size_t size, off_t offset, cs1550_readahead *ra)
+{
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    noteActivity();
+
+    // Nobody can move or resize the file while we hold its lock, so the directory only has to be locked long enough
+    // to copy the file's record.
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+    pthread_rwlock_rdlock(lock);
+
+    struct cs1550_file_directory file;
+
+    //check to make sure path exists
+    if(getFile(directory, filename, &file) == -1)
+    {
+        pthread_rwlock_unlock(lock);
+        LOG_DEBUG("Cannot find specified file.");
+        return -1;
+    }
+
+    if(offset >= (off_t) file.fsize)
+    {
+        pthread_rwlock_unlock(lock);
+        return 0;
+    }
+
+    if(offset + size > file.fsize)
+    {
+        LOG_DEBUG("You tried reading past what we've got to offer.");
+        size = file.fsize - offset;
+    }
+
+    int ret = -1;
+
+    readaheadNote(ra, directory, filename, file.nStartBlock, file.fsize, offset, size);
+
+    if(!inodeValid(file.nStartBlock)) ret = -1;
+    else if(buf != NULL) ret = inodeRead(file.nStartBlock, buf, size, offset);
+    else if(inodeReadBuf(file.nStartBlock, size, offset, bufp) == 0) ret = size;
+
+    pthread_rwlock_unlock(lock);
+
+    if(ret == -1) return -EIO;
+
+    return ret;
+}
+
+
+/*
+ * Writes the data in a list of buffers into the file starting from offset.
+ * When FUSE has spliced the request into a pipe, whole blocks go from the
+ * pipe to .disk without being copied through our memory.
+ */
+static int cs1550_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    size_t size = fuse_buf_size(buf);
+
+    (void) fi;
+
+    //check that size is > 0
+    if(size <= 0)
+    {
+        LOG_DEBUG("Size too small.");
+        return -1;
+    }
+
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    if(strcmp("/", directory) == 0)
+    {
+        LOG_DEBUG("I'm sorry, but you can't create files in the root directory.");
+        return -1;
+    }
+
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+
+    makeRoom(size);
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    int ret = writeToFile(directory, filename, buf, size, offset);
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    return ret;
+}
+
+
+/* 
+ * Write size bytes from buf into file starting from offset
+ *
+ */
+static int cs1550_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    struct fuse_bufvec src = FUSE_BUFVEC_INIT(size);
+
+    src.buf[0].mem = (void *) buf;
+
+    return cs1550_write_buf(path, &src, offset, fi);
+}
+
+
+/*
+ * truncate is called when a new file is created (with a 0 size) or when an
+ * existing file is made shorter or longer. Blocks past the new end are freed;
+ * a file made longer gets a hole, which takes no blocks and reads as zeros.
+ *
+ */
+static int cs1550_truncate(const char *path, off_t size)
+{
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    if(filename[0] == '\0') return -EISDIR;
+
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    int ret = truncateFile(directory, filename, size);
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    return ret;
+}
+
+
+/* 
+ * Called when we open a file
+ *
+ */
+static int cs1550_open(const char *path, struct fuse_file_info *fi)
+{
+    if(strcmp(path, STATS_PATH) == 0) return openStats(fi);
+
+    if(fi != NULL) fi->fh = (uintptr_t) readaheadOpen();
+    /*
+        //if we can't find the desired file, return an error
+        return -ENOENT;
+    */
+
+    //It's not really necessary for this project to anything in open
+
+    /* We're not going to worry about permissions for this project, but 
+	   if we were and we don't have them to the file we should return an error
+
+        return -EACCES;
+    */
+
+    return 0; //success!
+}
+
+/*
+ * Called when close is called on a file descriptor, but because it might
+ * have been dup'ed, this isn't a guarantee we won't ever need the file 
+ * again. For us, return success simply to avoid the unimplemented error
+ * in the debug log.
+ */
+static int cs1550_flush(const char *path, struct fuse_file_info *fi)
+{
+    (void) fi;
+
+    // Held blocks get their place on .disk now that the file's size is known.
+    int ret = delallocFlush(path, 0);
+
+    writeBackSizes(path);
+
+    if(ret != 0) return -ENOSPC;
+
+    // File data goes back to .disk now; metadata waits for the next journal commit.
+    if(cacheFlush() != 0) return -EIO;
+
+    return 0; //success!
+}
+
+
+/*
+ * Called when the last descriptor of an open file is closed.
+ */
+static int cs1550_release(const char *path, struct fuse_file_info *fi)
+{
+    if(strcmp(path, STATS_PATH) == 0 && fi != NULL && fi->fh != 0)
+    {
+        free((cs1550_stats_snapshot *) (uintptr_t) fi->fh);
+        fi->fh = 0;
+    }
+    else
+    {
+        // Nothing more is coming, so whatever was preallocated past the end of the file is given back.
+        delallocFlush(path, DELALLOC_TRIM);
+        writeBackSizes(path);
+
+        if(fi != NULL)
+        {
+            readaheadClose((cs1550_readahead *) (uintptr_t) fi->fh);
+            fi->fh = 0;
+        }
+    }
+
+    return 0;
+}
+
+
+/*
+ * Called when an application asks for a file's data to be on stable
+ * storage. We don't track which file owns what, so everything is synced.
+ */
+static int cs1550_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    (void) isdatasync;
+    (void) fi;
+
+    // A file fsynced as it grows (a log, say) is likely to keep growing.
+    int ret = delallocFlush(path, DELALLOC_GROW);
+
+    writeBackSizes(path);
+
+    if(journalSync() != 0) return -EIO;
+    if(ret != 0) return -ENOSPC;
+
+    return 0;
+}
+
+
+/*
+ * Called for fallocate(2) and posix_fallocate(3): the file gets zeroed
+ * blocks wherever it has none in the range, so later writes there can't
+ * run out of space. Holes can't be punched.
+ */
+static int cs1550_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    (void) fi;
+
+    char directory[MAX_FILENAME + 1] = {0};
+    char filename[MAX_FILENAME + 1] = {0};
+    char extension[MAX_EXTENSION + 1] = {0};
+
+    if(parsePath(path, directory, filename, extension) != 0) return -ENAMETOOLONG;
+
+    if(filename[0] == '\0') return -EISDIR;
+
+    pthread_rwlock_t *lock = fileLock(directory, filename);
+
+    if(length > 0) makeRoom(length);
+
+    journalBegin();
+    pthread_rwlock_wrlock(lock);
+
+    int ret = allocateToFile(directory, filename, mode, offset, length);
+
+    pthread_rwlock_unlock(lock);
+    journalEnd();
+
+    return ret;
+}
+
+
+/*
+ * Called for statfs(2) and df. Everything comes from counters the
+ * allocator and the directories keep up to date, so nothing is scanned.
+ * Every file takes one block for its inode, so a free block is also room
+ * for one more file.
+ */
+static int cs1550_statfs(const char *path, struct statvfs *stbuf)
+{
+    (void) path;
+
+    memset(stbuf, 0, sizeof(struct statvfs));
+
+    // Blocks set aside for what files hold in memory are as good as used. Blocks waiting for the commit that frees
+    // them are as good as free: a write that needs them commits it.
+    pthread_mutex_lock(&allocLock);
+    long free = freeBlocks + freeingBlocks - reservedBlocks;
+    pthread_mutex_unlock(&allocLock);
+
+    long files = __atomic_load_n(&fileTotal, __ATOMIC_RELAXED);
+
+    stbuf->f_bsize = blockSize;
+    stbuf->f_frsize = blockSize;
+    stbuf->f_blocks = blockCount - superblock.dataStart;
+    stbuf->f_bfree = free;
+    stbuf->f_bavail = free;
+    stbuf->f_files = files + free;
+    stbuf->f_ffree = free;
+    stbuf->f_favail = free;
+    stbuf->f_namemax = MAX_FILENAME + 1 + MAX_EXTENSION;
+
+    return 0;
+}
+
+
+/*
+ * Called once when the filesystem is mounted. Loads the bitmap so that
+ * allocation never has to go to the disk.
+ */
+static void *cs1550_init(struct fuse_conn_info *conn)
+{
+    // Let the kernel splice file data to and from us through pipes where it can
+    if(conn != NULL) conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    if(mountFilesystem() != 0) fuse_exit(fuse_get_context()->fuse);
+
+    return NULL;
+}
+
+
+/*
+ * Called once when the filesystem is unmounted. Writes back anything we
+ * were holding in memory.
+ */
+static void cs1550_destroy(void *private_data)
+{
+    (void) private_data;
+
+    unmountFilesystem();
+}
+
+
+// Everything cs1550_init() does, for whichever frontend is mounting us. Returns 0, or -1 if we can't be mounted.
+int mountFilesystem(void)
+{
+    int i;
+    for(i = 0; i < FILE_LOCK_STRIPES; i++)
+    {
+        pthread_rwlock_init(&fileLocks[i], NULL);
+    }
+
+    for(i = 0; i < LOOKUP_STRIPES; i++)
+    {
+        pthread_mutex_init(&lookupLocks[i], NULL);
+    }
+
+#if CS1550_LOG_LEVEL > 0
+    traceInit();
+#endif
+
+    if(options.cacheBlocks <= 0) options.cacheBlocks = DEFAULT_CACHE_BLOCKS;
+    if(options.commitInterval <= 0) options.commitInterval = DEFAULT_COMMIT_INTERVAL;
+    if(options.defragRate <= 0) options.defragRate = DEFAULT_DEFRAG_RATE;
+
+    mountLoaded = 0;
+
+    if(storageOpen() != 0 || superblockLoad() != 0 || journalReplay() != 0 || cacheInit(options.cacheBlocks) != 0 ||
+       loadBitmap() != 0 || loadDirectories() != 0)
+    {
+        LOG_ERROR("Couldn't mount the filesystem.");
+        return -1;
+    }
+
+    mountLoaded = 1;
+
+    if(checkpointStart() != 0 || readaheadStart() != 0 || defragStart() != 0)
+    {
+        LOG_ERROR("Couldn't mount the filesystem.");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+// Everything cs1550_destroy() does, for whichever frontend is unmounting us. FUSE calls it even when the mount failed,
+// so it only undoes what mountFilesystem() got as far as doing; each of the steps below copes with one that never ran.
+void unmountFilesystem(void)
+{
+    defragEnd();
+    readaheadEnd();
+    checkpointEnd();
+
+    // Short of that, the journal may not have been replayed, and there is nothing in memory to write back.
+    if(mountLoaded)
+    {
+        delallocFlush(NULL, DELALLOC_TRIM);
+        writeBackSizes(NULL);
+        journalClose();
+
+        unsigned long hits, misses;
+        cacheCounters(&hits, &misses);
+        LOG_INFO("Block cache: %lu hits, %lu misses.", hits, misses);
+    }
+
+    mountLoaded = 0;
+
+    cacheDestroy();
+    storageClose();
+    unloadBitmap();
+
+#if CS1550_LOG_LEVEL > 0
+    if(options.traceFile != NULL) traceDumpToFile();
+#endif
+}
+
+
+
+/* * * * * * * * * * * * * * *
+
+            TRACING
+
+ * * * * * * * * * * * * * * */
+// FUSE calls these, and they call the real handlers above. Keeping the tracing out here means the handlers themselves
+// don't change whatever the log level is.
+
+// Counts a finished operation and, at the trace level, records it in the trace ring.
+static void opFinished(int op, const char *path, long long offset, long long size, int result, long long start)
+{
+#if CS1550_LOG_LEVEL >= LOG_LEVEL_TRACE
+    traceOp(op, path, offset, size, result, start);
+#else
+    (void) path;
+    (void) offset;
+    (void) size;
+#endif
+
+    statsRecord(op, result, traceNow() - start);
+
+#if CS1550_LOG_LEVEL > 0
+    traceDumpIfRequested();
+#endif
+}
+
+static int traced_getattr(const char *path, struct stat *stbuf)
+{
+    TRACE_BEGIN();
+    int res = cs1550_getattr(path, stbuf);
+    TRACE_END(OP_GETATTR, path, 0, 0, res);
+    return res;
+}
+
+static int traced_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_readdir(path, buf, filler, offset, fi);
+    TRACE_END(OP_READDIR, path, offset, 0, res);
+    return res;
+}
+
+static int traced_mkdir(const char *path, mode_t mode)
+{
+    TRACE_BEGIN();
+    int res = cs1550_mkdir(path, mode);
+    TRACE_END(OP_MKDIR, path, 0, 0, res);
+    return res;
+}
+
+static int traced_rmdir(const char *path)
+{
+    TRACE_BEGIN();
+    int res = cs1550_rmdir(path);
+    TRACE_END(OP_RMDIR, path, 0, 0, res);
+    return res;
+}
+
+static int traced_mknod(const char *path, mode_t mode, dev_t dev)
+{
+    TRACE_BEGIN();
+    int res = cs1550_mknod(path, mode, dev);
+    TRACE_END(OP_MKNOD, path, 0, 0, res);
+    return res;
+}
+
+static int traced_unlink(const char *path)
+{
+    TRACE_BEGIN();
+    int res = cs1550_unlink(path);
+    TRACE_END(OP_UNLINK, path, 0, 0, res);
+    return res;
+}
+
+static int traced_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_read(path, buf, size, offset, fi);
+    TRACE_END(OP_READ, path, offset, size, res);
+    return res;
+}
+
+static int traced_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_write(path, buf, size, offset, fi);
+    TRACE_END(OP_WRITE, path, offset, size, res);
+    return res;
+}
+
+static int traced_read_buf(const char *path, struct fuse_bufvec **bufp, size_t size, off_t offset,
+                           struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_read_buf(path, bufp, size, offset, fi);
+    TRACE_END(OP_READ, path, offset, size, res == 0 ? (int) fuse_buf_size(*bufp) : res);
+    return res;
+}
+
+static int traced_write_buf(const char *path, struct fuse_bufvec *buf, off_t offset, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_write_buf(path, buf, offset, fi);
+    TRACE_END(OP_WRITE, path, offset, fuse_buf_size(buf), res);
+    return res;
+}
+
+static int traced_truncate(const char *path, off_t size)
+{
+    TRACE_BEGIN();
+    int res = cs1550_truncate(path, size);
+    TRACE_END(OP_TRUNCATE, path, 0, size, res);
+    return res;
+}
+
+static int traced_open(const char *path, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_open(path, fi);
+    TRACE_END(OP_OPEN, path, 0, 0, res);
+    return res;
+}
+
+static int traced_flush(const char *path, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_flush(path, fi);
+    TRACE_END(OP_FLUSH, path, 0, 0, res);
+    return res;
+}
+
+static int traced_fsync(const char *path, int isdatasync, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_fsync(path, isdatasync, fi);
+    TRACE_END(OP_FSYNC, path, 0, 0, res);
+    return res;
+}
+
+static int traced_release(const char *path, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_release(path, fi);
+    TRACE_END(OP_RELEASE, path, 0, 0, res);
+    return res;
+}
+
+static int traced_statfs(const char *path, struct statvfs *stbuf)
+{
+    TRACE_BEGIN();
+    int res = cs1550_statfs(path, stbuf);
+    TRACE_END(OP_STATFS, path, 0, 0, res);
+    return res;
+}
+
+static int traced_fallocate(const char *path, int mode, off_t offset, off_t length, struct fuse_file_info *fi)
+{
+    TRACE_BEGIN();
+    int res = cs1550_fallocate(path, mode, offset, length, fi);
+    TRACE_END(OP_FALLOCATE, path, offset, length, res);
+    return res;
+}
+
+
+//register our new functions as the implementations of the syscalls
+static struct fuse_operations hello_oper = {
+        .getattr    = traced_getattr,
+        .readdir    = traced_readdir,
+        .mkdir    = traced_mkdir,
+        .rmdir = traced_rmdir,
+        .read    = traced_read,
+        .write    = traced_write,
+        .read_buf = traced_read_buf,
+        .write_buf = traced_write_buf,
+        .mknod    = traced_mknod,
+        .unlink = traced_unlink,
+        .truncate = traced_truncate,
+        .flush = traced_flush,
+        .fsync = traced_fsync,
+        .open    = traced_open,
+        .release = traced_release,
+        .statfs = traced_statfs,
+        .fallocate = traced_fallocate,
+        .init = cs1550_init,
+        .destroy = cs1550_destroy,
+};
+
+// Makes the paths of the backing files absolute. FUSE changes to / when it goes into the background, so this has to
+// happen before then.
+void locateBackingFiles(void)
+{
+    char cwd[PATH_MAX - 16];
+
+    if(getcwd(cwd, sizeof(cwd)) != NULL)
+    {
+        snprintf(diskPath, sizeof(diskPath), "%s/.disk", cwd);
+        snprintf(directoriesPath, sizeof(directoriesPath), "%s/.directories", cwd);
+    }
+}
+
+//bench.c and cs1550_ll.c build the filesystem into their own programs and bring their own main; cs1550_ll.c still
+//takes the same -o options
+#if !defined(CS1550_NO_MAIN) || defined(CS1550_LOWLEVEL)
+//the -o options we understand on top of the ones FUSE handles
+static struct fuse_opt cs1550_opts[] = {
+        { "mmap", offsetof(struct cs1550_options, mmap), 1 },
+        { "cache_blocks=%d", offsetof(struct cs1550_options, cacheBlocks), 0 },
+        { "trace_file=%s", offsetof(struct cs1550_options, traceFile), 0 },
+        { "commit_interval=%d", offsetof(struct cs1550_options, commitInterval), 0 },
+        { "defrag_rate=%d", offsetof(struct cs1550_options, defragRate), 0 },
+        { "nodefrag", offsetof(struct cs1550_options, noDefrag), 1 },
+        FUSE_OPT_END
+};
+#endif
+
+#ifndef CS1550_NO_MAIN
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+    if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1) return 1;
+
+    locateBackingFiles();
+
+    int ret = fuse_main(args.argc, args.argv, &hello_oper, NULL);
+
+    fuse_opt_free_args(&args);
+
+    return ret;
 }
+#endif
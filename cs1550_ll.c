@@ -0,0 +1,747 @@
+/*
+ * Low-level FUSE frontend for the cs1550 filesystem.
+ *
+ * cs1550.c mounts through the high-level API, which hands every operation a full path. This builds the same
+ * filesystem on top of fuse_lowlevel instead: the kernel gets a stable inode number for everything it looks up, and we
+ * tell it how long it may keep names and attributes, so repeated lookups and stats are answered from its own caches
+ * without coming to us at all.
+ *
+ *     gcc -Wall -o cs1550_ll cs1550_ll.c `pkg-config fuse --cflags --libs`
+ *     ./cs1550_ll [-o entry_timeout=T] [-o attr_timeout=T] -d testmount
+ *
+ * It takes the same -o options as cs1550, and the same .disk and .directories.
+ */
+#define CS1550_NO_MAIN
+#define CS1550_LOWLEVEL
+#include "cs1550.c"
+#include <fuse_lowlevel.h>
+
+/* * * * * * * * * * * * * * *
+
+           DEFINES
+
+ * * * * * * * * * * * * * * */
+//Inode numbers. The root is FUSE_ROOT_ID, files are the number of their inode block and directory n of .directories
+//is LL_DIR_INO_BASE + n, past the last block. Blocks as low as LL_STATS_INO hold the superblock or the bitmap, so it
+//can't be a file either.
+#define    LL_STATS_INO 2
+#define    LL_DIR_INO_BASE ((fuse_ino_t) blockCount)
+
+//How long the kernel may keep what we tell it, in seconds, unless -o entry_timeout or -o attr_timeout say otherwise.
+//Everything goes through this mount, so nothing changes behind the kernel's back.
+#define    LL_DEFAULT_TIMEOUT 60.0
+
+//The inodes the kernel has looked up are found by hashing their number onto one of this many chains
+#define    LL_NODE_BUCKETS 1024
+
+/* * * * * * * * * * * * * * *
+
+            STRUCTS
+
+ * * * * * * * * * * * * * * */
+//Options only this frontend has
+struct ll_options
+{
+    double entryTimeout; //how long the kernel may remember a name, and that a name doesn't exist
+    double attrTimeout;  //how long the kernel may remember attributes
+};
+
+//An inode the kernel knows about. The kernel only ever uses inode numbers we gave it in a lookup, so this is how we
+//get back to the path the rest of the filesystem works with.
+struct ll_node
+{
+    fuse_ino_t ino;
+    unsigned long nlookup;  //lookups the kernel hasn't forgotten yet
+    char path[LOOKUP_PATH];
+    struct ll_node *next;   //chain of nodes in the same bucket
+};
+
+typedef struct ll_node ll_node;
+
+//A directory listing, put together at opendir and handed out a piece at a time by readdir
+struct ll_dir_buffer
+{
+    char (*names)[LOOKUP_PATH]; //what cs1550_readdir() listed
+    int count;
+    int capacity;
+    char *data;                 //the listing as readdir replies with it
+    size_t size;
+};
+
+typedef struct ll_dir_buffer ll_dir_buffer;
+
+/* * * * * * * * * * * * * * *
+
+            GLOBALS
+
+ * * * * * * * * * * * * * * */
+static struct ll_options llOptions = { LL_DEFAULT_TIMEOUT, LL_DEFAULT_TIMEOUT };
+static ll_node *llNodes[LL_NODE_BUCKETS];
+static pthread_mutex_t llNodeLock = PTHREAD_MUTEX_INITIALIZER; //guards llNodes
+static struct fuse_session *llSession;
+
+static struct fuse_opt llOpts[] = {
+        { "entry_timeout=%lf", offsetof(struct ll_options, entryTimeout), 0 },
+        { "attr_timeout=%lf", offsetof(struct ll_options, attrTimeout), 0 },
+        FUSE_OPT_END
+};
+
+/* * * * * * * * * * * * * * *
+
+            INODES
+
+ * * * * * * * * * * * * * * */
+
+
+// Notes that the kernel has looked up ino once more, as path.
+static void llRemember(fuse_ino_t ino, const char *path)
+{
+    if(ino == FUSE_ROOT_ID || ino == LL_STATS_INO) return;
+
+    pthread_mutex_lock(&llNodeLock);
+
+    ll_node **chain = &llNodes[ino % LL_NODE_BUCKETS];
+    ll_node *node = *chain;
+
+    while(node != NULL && node->ino != ino) node = node->next;
+
+    if(node == NULL)
+    {
+        node = (ll_node *) calloc(1, sizeof(ll_node));
+
+        if(node == NULL)
+        {
+            pthread_mutex_unlock(&llNodeLock);
+            LOG_ERROR("Out of memory remembering inode %lu.", (unsigned long) ino);
+            return;
+        }
+
+        node->ino = ino;
+        node->next = *chain;
+        *chain = node;
+    }
+
+    // A file's inode block can be freed and handed to a new file while the kernel still holds the old number.
+    strcpy(node->path, path);
+    node->nlookup++;
+
+    pthread_mutex_unlock(&llNodeLock);
+}
+
+
+// Takes back nlookup lookups of ino, forgetting it once the kernel holds none.
+static void llRelease(fuse_ino_t ino, unsigned long nlookup)
+{
+    pthread_mutex_lock(&llNodeLock);
+
+    ll_node **link = &llNodes[ino % LL_NODE_BUCKETS];
+
+    while(*link != NULL && (*link)->ino != ino) link = &(*link)->next;
+
+    ll_node *node = *link;
+
+    if(node != NULL)
+    {
+        node->nlookup = node->nlookup > nlookup ? node->nlookup - nlookup : 0;
+
+        if(node->nlookup == 0)
+        {
+            *link = node->next;
+            free(node);
+        }
+    }
+
+    pthread_mutex_unlock(&llNodeLock);
+}
+
+
+// Puts the path of ino into path, which has room for LOOKUP_PATH characters. Returns 0, or -1 if the kernel asked about
+// an inode it never looked up or has since forgotten.
+static int llPath(fuse_ino_t ino, char *path)
+{
+    if(ino == FUSE_ROOT_ID)
+    {
+        strcpy(path, "/");
+        return 0;
+    }
+
+    if(ino == LL_STATS_INO)
+    {
+        strcpy(path, STATS_PATH);
+        return 0;
+    }
+
+    pthread_mutex_lock(&llNodeLock);
+
+    ll_node *node = llNodes[ino % LL_NODE_BUCKETS];
+
+    while(node != NULL && node->ino != ino) node = node->next;
+
+    if(node != NULL) strcpy(path, node->path);
+
+    pthread_mutex_unlock(&llNodeLock);
+
+    return node != NULL ? 0 : -1;
+}
+
+
+// Puts the path of name inside the directory parent into path. Returns 0 or an errno.
+static int llChildPath(fuse_ino_t parent, const char *name, char *path)
+{
+    char parentPath[LOOKUP_PATH];
+
+    if(llPath(parent, parentPath) != 0) return ESTALE;
+    if(parent == LL_STATS_INO || (parent != FUSE_ROOT_ID && parent < LL_DIR_INO_BASE)) return ENOTDIR;
+
+    int length = snprintf(path, LOOKUP_PATH, "%s/%s", parent == FUSE_ROOT_ID ? "" : parentPath, name);
+
+    return length < LOOKUP_PATH ? 0 : ENAMETOOLONG;
+}
+
+
+// The inode number of what path names, or 0 if it has gone away.
+static fuse_ino_t llInode(const char *path)
+{
+    char directory[MAX_FILENAME + 1];
+    char filename[MAX_FILENAME + 1];
+    char extension[MAX_EXTENSION + 1];
+    fuse_ino_t ino = 0;
+
+    if(strcmp(path, "/") == 0) return FUSE_ROOT_ID;
+    if(strcmp(path, STATS_PATH) == 0) return LL_STATS_INO;
+
+    if(parsePath(path, directory, filename, extension) != 0) return 0;
+
+    cs1550_cached_dir *dir = lockDir(directory, 0);
+
+    if(dir == NULL) return 0;
+
+    if(strcmp(filename, "") == 0)
+    {
+        ino = LL_DIR_INO_BASE + dir->offset / sizeof(cs1550_directory_entry);
+    }
+    else
+    {
+        int i = findFile(dir, filename);
+
+        if(i != -1) ino = dirFile(dir, i)->nStartBlock;
+    }
+
+    unlockDir(dir);
+
+    return ino;
+}
+
+
+// Gets the attributes of path, with its inode number filled in. Returns 0 or a negative errno.
+static int llStat(const char *path, struct stat *st, fuse_ino_t *ino)
+{
+    int res = hello_oper.getattr(path, st);
+
+    if(res != 0) return res;
+
+    *ino = llInode(path);
+
+    if(*ino == 0) return -ENOENT;
+
+    st->st_ino = *ino;
+
+    return 0;
+}
+
+
+// How long the kernel may keep the attributes of ino. /.stats changes with every operation, so never.
+static double llAttrTimeout(fuse_ino_t ino)
+{
+    return ino == LL_STATS_INO ? 0 : llOptions.attrTimeout;
+}
+
+
+// Answers a lookup (or mknod or mkdir) of path. A name that doesn't exist is answered too, so the kernel remembers
+// that as well.
+static void llReplyEntry(fuse_req_t req, const char *path)
+{
+    struct fuse_entry_param e;
+
+    memset(&e, 0, sizeof(e));
+
+    int res = llStat(path, &e.attr, &e.ino);
+
+    if(res == -ENOENT)
+    {
+        e.ino = 0;
+        e.entry_timeout = llOptions.entryTimeout;
+        fuse_reply_entry(req, &e);
+        return;
+    }
+
+    if(res != 0)
+    {
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    e.attr_timeout = llAttrTimeout(e.ino);
+    e.entry_timeout = llOptions.entryTimeout;
+
+    llRemember(e.ino, path);
+
+    if(fuse_reply_entry(req, &e) != 0) llRelease(e.ino, 1);
+}
+
+/* * * * * * * * * * * * * * *
+
+      LOW-LEVEL OPERATIONS
+
+ * * * * * * * * * * * * * * */
+
+
+static void ll_init(void *userdata, struct fuse_conn_info *conn)
+{
+    (void) userdata;
+
+    conn->want |= conn->capable & (FUSE_CAP_SPLICE_READ | FUSE_CAP_SPLICE_WRITE | FUSE_CAP_SPLICE_MOVE);
+
+    if(mountFilesystem() != 0) fuse_session_exit(llSession);
+}
+
+
+static void ll_destroy(void *userdata)
+{
+    (void) userdata;
+
+    unmountFilesystem();
+}
+
+
+static void ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[LOOKUP_PATH];
+    int err = llChildPath(parent, name, path);
+
+    if(err != 0) fuse_reply_err(req, err);
+    else llReplyEntry(req, path);
+}
+
+
+static void ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
+{
+    llRelease(ino, nlookup);
+    fuse_reply_none(req);
+}
+
+
+static void ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+    struct stat st;
+    fuse_ino_t found;
+
+    (void) fi;
+
+    if(llPath(ino, path) != 0)
+    {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    int res = llStat(path, &st, &found);
+
+    if(res != 0) fuse_reply_err(req, -res);
+    else fuse_reply_attr(req, &st, llAttrTimeout(ino));
+}
+
+
+// Only the size can be changed; anything else is accepted and ignored, as the high-level frontend does for utimens.
+static void ll_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr, int to_set, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    if(llPath(ino, path) != 0)
+    {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    if(to_set & FUSE_SET_ATTR_SIZE)
+    {
+        int res = hello_oper.truncate(path, attr->st_size);
+
+        if(res != 0)
+        {
+            fuse_reply_err(req, -res);
+            return;
+        }
+    }
+
+    ll_getattr(req, ino, fi);
+}
+
+
+static void ll_mknod(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, dev_t rdev)
+{
+    char path[LOOKUP_PATH];
+    int err = llChildPath(parent, name, path);
+
+    if(err == 0) err = -hello_oper.mknod(path, mode, rdev);
+
+    if(err != 0) fuse_reply_err(req, err);
+    else llReplyEntry(req, path);
+}
+
+
+static void ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode)
+{
+    char path[LOOKUP_PATH];
+    int err = llChildPath(parent, name, path);
+
+    if(err == 0) err = -hello_oper.mkdir(path, mode);
+
+    if(err != 0) fuse_reply_err(req, err);
+    else llReplyEntry(req, path);
+}
+
+
+static void ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[LOOKUP_PATH];
+    int err = llChildPath(parent, name, path);
+
+    if(err == 0) err = -hello_oper.unlink(path);
+
+    fuse_reply_err(req, err);
+}
+
+
+static void ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name)
+{
+    char path[LOOKUP_PATH];
+    int err = llChildPath(parent, name, path);
+
+    if(err == 0) err = -hello_oper.rmdir(path);
+
+    fuse_reply_err(req, err);
+}
+
+
+static void ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+    int err = llPath(ino, path) != 0 ? ESTALE : -hello_oper.open(path, fi);
+
+    if(err != 0) fuse_reply_err(req, err);
+    else fuse_reply_open(req, fi);
+}
+
+
+static void ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    if(llPath(ino, path) != 0)
+    {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    // The reply is sent from here, so it can point at .disk: whatever it points at stays put until it has gone.
+    spliceBegin();
+
+    struct fuse_bufvec *bufv = NULL;
+    int res = hello_oper.read_buf(path, &bufv, size, off, fi);
+
+    if(res < 0)
+    {
+        spliceEnd();
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+
+    spliceEnd();
+
+    size_t i;
+
+    for(i = 0; i < bufv->count; i++)
+    {
+        if(!(bufv->buf[i].flags & FUSE_BUF_IS_FD)) free(bufv->buf[i].mem);
+    }
+
+    free(bufv);
+}
+
+
+static void ll_write_buf(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, off_t off,
+                         struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+    int res = llPath(ino, path) != 0 ? -ESTALE : hello_oper.write_buf(path, bufv, off, fi);
+
+    if(res < 0) fuse_reply_err(req, -res);
+    else fuse_reply_write(req, res);
+}
+
+
+static void ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    fuse_reply_err(req, llPath(ino, path) != 0 ? ESTALE : -hello_oper.flush(path, fi));
+}
+
+
+static void ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    fuse_reply_err(req, llPath(ino, path) != 0 ? ESTALE : -hello_oper.release(path, fi));
+}
+
+
+static void ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    fuse_reply_err(req, llPath(ino, path) != 0 ? ESTALE : -hello_oper.fsync(path, datasync, fi));
+}
+
+
+static void ll_fallocate(fuse_req_t req, fuse_ino_t ino, int mode, off_t offset, off_t length,
+                         struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    fuse_reply_err(req, llPath(ino, path) != 0 ? ESTALE : -hello_oper.fallocate(path, mode, offset, length, fi));
+}
+
+
+// The answer is the same for every inode, so it doesn't need a path.
+static void ll_statfs(fuse_req_t req, fuse_ino_t ino)
+{
+    struct statvfs st;
+
+    (void) ino;
+
+    int res = hello_oper.statfs("/", &st);
+
+    if(res != 0) fuse_reply_err(req, -res);
+    else fuse_reply_statfs(req, &st);
+}
+
+
+// The filler cs1550_readdir() is given: notes one name. cs1550_readdir() may be holding directory locks, so the names
+// are only looked at once it returns.
+static int llFill(void *buf, const char *name, const struct stat *stbuf, off_t off)
+{
+    ll_dir_buffer *listing = (ll_dir_buffer *) buf;
+
+    (void) stbuf;
+    (void) off;
+
+    if(listing->count == listing->capacity)
+    {
+        int capacity = listing->capacity > 0 ? listing->capacity * 2 : 32;
+        char (*grown)[LOOKUP_PATH] = realloc(listing->names, capacity * sizeof(*grown));
+
+        if(grown == NULL) return 1;
+
+        listing->names = grown;
+        listing->capacity = capacity;
+    }
+
+    snprintf(listing->names[listing->count++], LOOKUP_PATH, "%s", name);
+
+    return 0;
+}
+
+
+// Turns the names in a listing of path into the entries readdir replies with. Returns 0, or -1 if we run out of memory.
+static int llFillEntries(fuse_req_t req, ll_dir_buffer *listing, const char *path)
+{
+    int i;
+
+    for(i = 0; i < listing->count; i++)
+    {
+        const char *name = listing->names[i];
+        char child[LOOKUP_PATH];
+        struct stat st;
+        fuse_ino_t ino;
+
+        // Directories only ever sit in the root, so .. is always the root.
+        if(strcmp(name, ".") == 0) strcpy(child, path);
+        else if(strcmp(name, "..") == 0) strcpy(child, "/");
+        else if(snprintf(child, sizeof(child), "%s/%s", strcmp(path, "/") == 0 ? "" : path, name) >= LOOKUP_PATH)
+        {
+            continue; //no lookup could reach it either
+        }
+
+        // readdir only needs the type and number; anything that has gone in the meantime is left for lookup.
+        memset(&st, 0, sizeof(st));
+
+        if(llStat(child, &st, &ino) != 0) st.st_mode = S_IFREG;
+
+        size_t entry = fuse_add_direntry(req, NULL, 0, name, NULL, 0);
+        char *grown = (char *) realloc(listing->data, listing->size + entry);
+
+        if(grown == NULL) return -1;
+
+        listing->data = grown;
+        fuse_add_direntry(req, listing->data + listing->size, entry, name, &st, listing->size + entry);
+        listing->size += entry;
+    }
+
+    return 0;
+}
+
+
+static void ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    char path[LOOKUP_PATH];
+
+    if(llPath(ino, path) != 0)
+    {
+        fuse_reply_err(req, ESTALE);
+        return;
+    }
+
+    ll_dir_buffer *listing = (ll_dir_buffer *) calloc(1, sizeof(ll_dir_buffer));
+
+    if(listing == NULL)
+    {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+
+    int res = hello_oper.readdir(path, listing, llFill, 0, fi);
+
+    if(res == 0 && llFillEntries(req, listing, path) != 0) res = -ENOMEM;
+
+    free(listing->names);
+    listing->names = NULL;
+
+    if(res != 0)
+    {
+        free(listing->data);
+        free(listing);
+        fuse_reply_err(req, -res);
+        return;
+    }
+
+    fi->fh = (uintptr_t) listing;
+    fuse_reply_open(req, fi);
+}
+
+
+static void ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off, struct fuse_file_info *fi)
+{
+    ll_dir_buffer *listing = (ll_dir_buffer *) (uintptr_t) fi->fh;
+
+    (void) ino;
+
+    if(off >= (off_t) listing->size)
+    {
+        fuse_reply_buf(req, NULL, 0);
+        return;
+    }
+
+    size_t count = listing->size - off;
+
+    if(count > size) count = size;
+
+    fuse_reply_buf(req, listing->data + off, count);
+}
+
+
+static void ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi)
+{
+    ll_dir_buffer *listing = (ll_dir_buffer *) (uintptr_t) fi->fh;
+
+    (void) ino;
+
+    free(listing->data);
+    free(listing);
+
+    fuse_reply_err(req, 0);
+}
+
+
+static struct fuse_lowlevel_ops llOper = {
+        .init = ll_init,
+        .destroy = ll_destroy,
+        .lookup = ll_lookup,
+        .forget = ll_forget,
+        .getattr = ll_getattr,
+        .setattr = ll_setattr,
+        .mknod = ll_mknod,
+        .mkdir = ll_mkdir,
+        .unlink = ll_unlink,
+        .rmdir = ll_rmdir,
+        .open = ll_open,
+        .read = ll_read,
+        .write_buf = ll_write_buf,
+        .flush = ll_flush,
+        .release = ll_release,
+        .fsync = ll_fsync,
+        .statfs = ll_statfs,
+        .fallocate = ll_fallocate,
+        .opendir = ll_opendir,
+        .readdir = ll_readdir,
+        .releasedir = ll_releasedir,
+};
+
+/* * * * * * * * * * * * * * *
+
+             MAIN
+
+ * * * * * * * * * * * * * * */
+
+
+int main(int argc, char *argv[])
+{
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    char *mountpoint = NULL;
+    int multithreaded, foreground;
+    int ret = -1;
+
+    if(fuse_opt_parse(&args, &options, cs1550_opts, NULL) == -1 ||
+       fuse_opt_parse(&args, &llOptions, llOpts, NULL) == -1 ||
+       fuse_parse_cmdline(&args, &mountpoint, &multithreaded, &foreground) == -1)
+    {
+        return 1;
+    }
+
+    locateBackingFiles();
+
+    struct fuse_chan *channel = fuse_mount(mountpoint, &args);
+
+    if(channel != NULL)
+    {
+        llSession = fuse_lowlevel_new(&args, &llOper, sizeof(llOper), NULL);
+
+        if(llSession != NULL)
+        {
+            if(fuse_set_signal_handlers(llSession) != -1)
+            {
+                fuse_session_add_chan(llSession, channel);
+
+                if(fuse_daemonize(foreground) != -1)
+                {
+                    ret = multithreaded ? fuse_session_loop_mt(llSession) : fuse_session_loop(llSession);
+                }
+
+                fuse_remove_signal_handlers(llSession);
+                fuse_session_remove_chan(channel);
+            }
+
+            fuse_session_destroy(llSession);
+        }
+
+        fuse_unmount(mountpoint, channel);
+    }
+
+    free(mountpoint);
+    fuse_opt_free_args(&args);
+
+    return ret == 0 ? 0 : 1;
+}
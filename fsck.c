@@ -0,0 +1,643 @@
+/*
+ * Checks a cs1550 filesystem in the current directory while it isn't mounted, and rebuilds its bitmap.
+ *
+ *     gcc -Wall -O2 -o fsck fsck.c `pkg-config fuse --cflags --libs`
+ *     ./fsck [-n] [-t threads]
+ *
+ * Replays the journal, then walks the inode of every file in .directories, spread over threads (one per CPU unless
+ * -t says otherwise), and works out which blocks are really in use. It reports records claiming more files than a
+ * record holds, files whose start block is out of range or isn't an inode, pointers out of range, blocks that more
+ * than one file claims, blocks a crash left preallocated past the end of a file, and blocks the bitmap gets wrong
+ * either way. Then it fixes what it can: records are cut back to what fits, files without an inode are dropped, bad
+ * pointers and preallocated blocks are cleared and the bitmap is rewritten from what the walk found, along with the
+ * superblock's counts of free blocks and files. Blocks claimed twice are only reported.
+ *
+ * -n only checks, and writes nothing, the journal included. A disk that wasn't unmounted cleanly can then show
+ * problems that replaying the journal would have fixed.
+ *
+ * Exits with 0 if nothing was wrong, 1 if everything wrong was fixed, 4 if problems are left and 8 if the disk
+ * couldn't be checked at all.
+ */
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+/* * * * * * * * * * * * * * *
+
+           DEFINES
+
+ * * * * * * * * * * * * * * */
+#define    FSCK_MAX_THREADS 64
+
+//How many of each kind of problem are printed one by one; the rest are only counted
+#define    FSCK_REPORT_LIMIT 20
+
+//How many files a thread takes at a time
+#define    FSCK_BATCH 64
+
+#define    FSCK_EXIT_CLEAN 0
+#define    FSCK_EXIT_FIXED 1
+#define    FSCK_EXIT_UNFIXED 4
+#define    FSCK_EXIT_ERROR 8
+
+//The bit of a block in the on-disk bitmap: block 0 is the high bit of byte 0
+#define    FSCK_BIT(block) ((unsigned char) (0x80 >> ((block) % 8)))
+
+/* * * * * * * * * * * * * * *
+
+            STRUCTS
+
+ * * * * * * * * * * * * * * */
+enum fsck_problem
+{
+    FSCK_NFILES,        //a record says it holds more files than it can
+    FSCK_BAD_START,     //a file's start block is outside the data blocks
+    FSCK_NOT_INODE,     //a file's start block doesn't hold an inode
+    FSCK_BAD_POINTER,   //an inode or indirect block points outside the data blocks
+    FSCK_OVERLAP,       //a block that something else already claims
+    FSCK_NBLOCKS,       //an inode's count of its blocks is wrong
+    FSCK_PREALLOC,      //blocks preallocated past the end of a file that a crash left behind
+    FSCK_ORPHANED,      //taken in the bitmap, but nothing claims it
+    FSCK_UNMARKED,      //claimed, but free in the bitmap, so it could be handed out again
+    FSCK_COUNTERS,      //the superblock's count of free blocks or of files is wrong
+    FSCK_PROBLEM_COUNT
+};
+
+//One file in .directories
+struct fsck_file
+{
+    int dir;     //which record
+    int index;   //which of its slots
+    int drop;    //set when the file has no inode and has to go
+};
+
+typedef struct fsck_file fsck_file;
+
+//What walking one file's inode found
+struct fsck_walk
+{
+    char path[2 * (MAX_FILENAME + 1) + MAX_EXTENSION + 2];
+    unsigned long owned;     //blocks the file owns, not counting the inode
+    unsigned long pastEnd;   //data blocks after the last byte of the file
+    unsigned long trimmed;   //of those, how many were preallocated on speculation (see INODE_PREALLOC)
+    int speculative;         //does the inode have INODE_PREALLOC?
+    int overlap;             //did it run into blocks something else claims, so owned can't be trusted?
+    long sizeBlocks;         //data blocks the file's size covers
+};
+
+typedef struct fsck_walk fsck_walk;
+
+/* * * * * * * * * * * * * * *
+
+            GLOBALS
+
+ * * * * * * * * * * * * * * */
+static const char *fsckProblemNames[FSCK_PROBLEM_COUNT] = {
+        "records claiming too many files", "start blocks out of range", "start blocks that aren't inodes",
+        "pointers out of range", "blocks claimed twice", "inodes with the wrong block count",
+        "files with preallocated blocks left", "orphaned blocks", "blocks in use but marked free",
+        "wrong superblock counters"
+};
+
+static int fsckRepair = 1;                       //cleared by -n
+static unsigned long fsckProblems[FSCK_PROBLEM_COUNT];
+static unsigned long fsckFixed[FSCK_PROBLEM_COUNT];
+static pthread_mutex_t fsckReportLock = PTHREAD_MUTEX_INITIALIZER;
+
+static cs1550_directory_entry *fsckDirs;         //all of .directories
+static int fsckDirCount;
+static fsck_file *fsckFiles;                     //every file of every directory
+static int fsckFileCount;
+static int fsckNext;                             //the next file a thread should take
+
+static unsigned char *fsckClaimed;               //the bitmap as the walk finds it, laid out as on disk
+static unsigned long fsckPastEnd;                //data blocks past the end of their files, over all files
+
+/* * * * * * * * * * * * * * *
+
+            FSCK
+
+ * * * * * * * * * * * * * * */
+
+// Counts a problem, and prints it if not too many of its kind have been printed yet
+static void fsckReport(int problem, int fixed, const char *fmt, ...)
+{
+    unsigned long count = __atomic_add_fetch(&fsckProblems[problem], 1, __ATOMIC_RELAXED);
+
+    if(fixed) __atomic_fetch_add(&fsckFixed[problem], 1, __ATOMIC_RELAXED);
+
+    if(count > FSCK_REPORT_LIMIT) return;
+
+    va_list ap;
+
+    pthread_mutex_lock(&fsckReportLock);
+
+    va_start(ap, fmt);
+    vprintf(fmt, ap);
+    va_end(ap);
+
+    printf(fixed ? ", fixed\n" : "\n");
+
+    if(count == FSCK_REPORT_LIMIT) printf("(not printing any more %s)\n", fsckProblemNames[problem]);
+
+    pthread_mutex_unlock(&fsckReportLock);
+}
+
+
+// Marks a block as in use. Returns 0, or -1 if something already claimed it.
+static int fsckClaim(unsigned long block)
+{
+    unsigned char bit = FSCK_BIT(block);
+
+    return (__atomic_fetch_or(&fsckClaimed[block / 8], bit, __ATOMIC_RELAXED) & bit) ? -1 : 0;
+}
+
+
+// Gives back a block fsckClaim() claimed.
+static void fsckUnclaim(unsigned long block)
+{
+    __atomic_fetch_and(&fsckClaimed[block / 8], (unsigned char) ~FSCK_BIT(block), __ATOMIC_RELAXED);
+}
+
+
+// Is this a block a file could own?
+static int fsckInData(unsigned long block)
+{
+    return block >= superblock.dataStart && block < (unsigned long) blockCount;
+}
+
+
+// Checks count pointers, which sit in block. Every block they point at is claimed, and indirect blocks (depth > 0) are
+// followed down. Pointers out of range are cleared when repairing, and so are indirect blocks that are left pointing at
+// nothing. firstFileBlock is the block of the file the first pointer leads to, and span how many file blocks each
+// pointer covers. Returns 1 if a pointer was cleared.
+static int fsckPointers(fsck_walk *walk, unsigned long *pointers, int count, unsigned long block, int depth,
+                        long firstFileBlock, long span)
+{
+    int changed = 0;
+    int i;
+
+    for(i = 0; i < count; i++)
+    {
+        unsigned long pointer = pointers[i];
+
+        if(pointer == 0) continue;
+
+        if(!fsckInData(pointer))
+        {
+            fsckReport(FSCK_BAD_POINTER, fsckRepair, "%s: block %lu points at block %lu", walk->path, block, pointer);
+
+            if(fsckRepair)
+            {
+                pointers[i] = 0;
+                changed = 1;
+            }
+
+            continue;
+        }
+
+        // Blocks past the end of a file with INODE_PREALLOC were only ever a guess, and nothing remembers them now.
+        if(depth == 0 && walk->speculative && firstFileBlock + i >= walk->sizeBlocks)
+        {
+            walk->trimmed++;
+
+            if(fsckRepair)
+            {
+                pointers[i] = 0;
+                changed = 1;
+                continue;
+            }
+        }
+
+        walk->owned++;
+
+        if(fsckClaim(pointer) != 0)
+        {
+            // Whatever claimed it first has already walked anything below it.
+            fsckReport(FSCK_OVERLAP, 0, "%s: block %lu is claimed twice", walk->path, pointer);
+            walk->overlap = 1;
+            continue;
+        }
+
+        if(depth == 0)
+        {
+            if(firstFileBlock + i >= walk->sizeBlocks) walk->pastEnd++;
+            continue;
+        }
+
+        unsigned long index[indexPointers];
+
+        if(diskRead(index, blockSize, (off_t) pointer * blockSize) != blockSize)
+        {
+            fsckReport(FSCK_BAD_POINTER, 0, "%s: can't read block %lu", walk->path, pointer);
+            continue;
+        }
+
+        long next = span / indexPointers;
+        long first = firstFileBlock + i * span;
+        int j = 0;
+
+        if(!fsckPointers(walk, index, indexPointers, pointer, depth - 1, first, next)) continue;
+
+        while(j < indexPointers && index[j] == 0) j++;
+
+        // An indirect block that only led to what was just cleared is freed along with it.
+        if(j == indexPointers)
+        {
+            fsckUnclaim(pointer);
+            walk->owned--;
+
+            if(walk->speculative && first >= walk->sizeBlocks) walk->trimmed++;
+
+            pointers[i] = 0;
+            changed = 1;
+        }
+        else if(diskWrite(index, blockSize, (off_t) pointer * blockSize) != blockSize)
+        {
+            LOG_ERROR("Couldn't write block %lu.", pointer);
+        }
+    }
+
+    return changed;
+}
+
+
+// Checks one file: its start block has to be an inode, and everything the inode points at gets claimed.
+static void fsckFile(fsck_file *file)
+{
+    cs1550_directory_entry *dir = &fsckDirs[file->dir];
+    struct cs1550_file_directory *entry = &dir->files[file->index];
+    unsigned long buffer[blockSize / sizeof(unsigned long)];
+    cs1550_inode *inode = (cs1550_inode *) buffer;
+    fsck_walk walk;
+
+    memset(&walk, 0, sizeof(walk));
+
+    snprintf(walk.path, sizeof(walk.path), "/%.*s/%.*s%s%.*s", MAX_FILENAME, dir->dname, MAX_FILENAME, entry->fname,
+             entry->fext[0] != '\0' ? "." : "", MAX_EXTENSION, entry->fext);
+
+    walk.sizeBlocks = (entry->fsize + blockSize - 1) / blockSize;
+
+    if(entry->nStartBlock < 0 || !fsckInData(entry->nStartBlock))
+    {
+        fsckReport(FSCK_BAD_START, fsckRepair, "%s: start block %ld is out of range", walk.path, entry->nStartBlock);
+        file->drop = fsckRepair;
+        return;
+    }
+
+    if(diskRead(buffer, blockSize, (off_t) entry->nStartBlock * blockSize) != blockSize ||
+       inode->magic != INODE_MAGIC)
+    {
+        fsckReport(FSCK_NOT_INODE, fsckRepair, "%s: block %ld isn't an inode", walk.path, entry->nStartBlock);
+        file->drop = fsckRepair;
+        return;
+    }
+
+    if(fsckClaim(entry->nStartBlock) != 0)
+    {
+        fsckReport(FSCK_OVERLAP, 0, "%s: inode %ld is claimed twice", walk.path, entry->nStartBlock);
+        return;
+    }
+
+    long direct = NUM_DIRECT_POINTERS;
+    int changed = 0;
+
+    // An inline file's data is where the pointers would be, and it owns nothing else.
+    if(!(inode->flags & INODE_INLINE))
+    {
+        walk.speculative = (inode->flags & INODE_PREALLOC) != 0;
+
+        changed |= fsckPointers(&walk, inode->pointers, direct, entry->nStartBlock, 0, 0, 1);
+        changed |= fsckPointers(&walk, &inode->pointers[SINGLE_INDIRECT_POINTER], 1, entry->nStartBlock, 1, direct,
+                                indexPointers);
+        changed |= fsckPointers(&walk, &inode->pointers[DOUBLE_INDIRECT_POINTER], 1, entry->nStartBlock, 2,
+                                direct + indexPointers, (long) indexPointers * indexPointers);
+    }
+
+    if(walk.speculative)
+    {
+        if(walk.trimmed > 0)
+        {
+            fsckReport(FSCK_PREALLOC, fsckRepair, "%s: %lu blocks preallocated past the end", walk.path, walk.trimmed);
+        }
+
+        if(fsckRepair)
+        {
+            inode->flags &= ~INODE_PREALLOC;
+            inode->nBlocks -= walk.trimmed;
+            changed = 1;
+        }
+    }
+
+    // Nothing under a block another file claims was walked, so owned is short of what the inode may rightly count.
+    if(inode->nBlocks != walk.owned)
+    {
+        int fixed = fsckRepair && !walk.overlap;
+
+        fsckReport(FSCK_NBLOCKS, fixed, "%s: inode says %lu blocks, but owns %lu", walk.path, inode->nBlocks,
+                   walk.owned);
+
+        if(fixed)
+        {
+            inode->nBlocks = walk.owned;
+            changed = 1;
+        }
+    }
+
+    if(changed && diskWrite(buffer, blockSize, (off_t) entry->nStartBlock * blockSize) != blockSize)
+    {
+        LOG_ERROR("Couldn't write inode %ld.", entry->nStartBlock);
+    }
+
+    __atomic_fetch_add(&fsckPastEnd, walk.pastEnd, __ATOMIC_RELAXED);
+}
+
+
+// Takes files a batch at a time until there are none left
+static void *fsckWorker(void *arg)
+{
+    (void) arg;
+
+    for(;;)
+    {
+        int first = __atomic_fetch_add(&fsckNext, FSCK_BATCH, __ATOMIC_RELAXED);
+        int i;
+
+        if(first >= fsckFileCount) break;
+
+        for(i = first; i < first + FSCK_BATCH && i < fsckFileCount; i++)
+        {
+            fsckFile(&fsckFiles[i]);
+        }
+    }
+
+    return NULL;
+}
+
+
+// Reads every directory record, cuts back any that claim too many files, and lists the files in the slots that are in
+// use. Returns 0, or -1.
+static int fsckLoadDirectories(void)
+{
+    int i, j;
+
+    fsckDirCount = directoriesSize / sizeof(cs1550_directory_entry);
+    fsckDirs = (cs1550_directory_entry *) malloc(directoriesSize + 1);
+
+    if(fsckDirs == NULL || directoriesRead(fsckDirs, directoriesSize, 0) != directoriesSize) return -1;
+
+    for(i = 0; i < fsckDirCount; i++)
+    {
+        int nFiles = fsckDirs[i].nFiles;
+
+        if(nFiles < 0 || nFiles > FILES_PER_RECORD)
+        {
+            fsckReport(FSCK_NFILES, fsckRepair, "/%.*s: a record claims %d files, but holds %d", MAX_FILENAME,
+                       fsckDirs[i].dname, nFiles, FILES_PER_RECORD);
+
+            // Without -n the record is written back with the rest of the changes to .directories.
+            fsckDirs[i].nFiles = nFiles < 0 ? 0 : FILES_PER_RECORD;
+        }
+
+        for(j = 0; j < fsckDirs[i].nFiles; j++)
+        {
+            if(fsckDirs[i].files[j].nStartBlock != 0) fsckFileCount++;
+        }
+    }
+
+    fsckFiles = (fsck_file *) calloc(fsckFileCount + 1, sizeof(fsck_file));
+
+    if(fsckFiles == NULL) return -1;
+
+    fsckFileCount = 0;
+
+    for(i = 0; i < fsckDirCount; i++)
+    {
+        for(j = 0; j < fsckDirs[i].nFiles; j++)
+        {
+            if(fsckDirs[i].files[j].nStartBlock == 0) continue;
+
+            fsckFiles[fsckFileCount].dir = i;
+            fsckFiles[fsckFileCount].index = j;
+            fsckFileCount++;
+        }
+    }
+
+    return 0;
+}
+
+
+// Empties the slots of the files that have to go out of their directories, and writes back every record that changed.
+// Returns 0, or -1.
+static int fsckWriteDirectories(void)
+{
+    cs1550_directory_entry original;
+    int i;
+
+    for(i = 0; i < fsckFileCount; i++)
+    {
+        struct cs1550_file_directory *entry = &fsckDirs[fsckFiles[i].dir].files[fsckFiles[i].index];
+
+        if(fsckFiles[i].drop) memset(entry, 0, sizeof(*entry));
+    }
+
+    for(i = 0; i < fsckDirCount; i++)
+    {
+        cs1550_directory_entry *dir = &fsckDirs[i];
+
+        while(dir->nFiles > 0 && dir->files[dir->nFiles - 1].nStartBlock == 0) dir->nFiles--;
+
+        off_t offset = (off_t) i * sizeof(cs1550_directory_entry);
+
+        if(directoriesRead(&original, sizeof(original), offset) != sizeof(original)) return -1;
+
+        if(memcmp(&original, dir, sizeof(original)) != 0 &&
+           directoriesWrite(dir, sizeof(cs1550_directory_entry), offset) != sizeof(cs1550_directory_entry)) return -1;
+    }
+
+    return 0;
+}
+
+
+// Compares the bitmap on disk with what the walk claimed, and rewrites it if they differ. Returns 0, or -1.
+static int fsckBitmap(void)
+{
+    unsigned char *onDisk = (unsigned char *) malloc(BITMAP_BYTES);
+    off_t at = (off_t) superblock.bitmapStart * blockSize;
+    long block;
+    int ret = 0;
+
+    if(onDisk == NULL || diskRead(onDisk, BITMAP_BYTES, at) != BITMAP_BYTES)
+    {
+        LOG_ERROR("Couldn't read the bitmap from .disk.");
+        free(onDisk);
+        return -1;
+    }
+
+    for(block = 0; block < blockCount; block++)
+    {
+        // Most bytes agree, so skip them whole.
+        if(block % 8 == 0 && onDisk[block / 8] == fsckClaimed[block / 8] && block + 8 <= blockCount)
+        {
+            block += 7;
+            continue;
+        }
+
+        int taken = (onDisk[block / 8] & FSCK_BIT(block)) != 0;
+        int claimed = (fsckClaimed[block / 8] & FSCK_BIT(block)) != 0;
+
+        if(taken && !claimed) fsckReport(FSCK_ORPHANED, fsckRepair, "block %ld is taken, but nothing uses it", block);
+        if(!taken && claimed) fsckReport(FSCK_UNMARKED, fsckRepair, "block %ld is in use, but marked free", block);
+    }
+
+    // Bits past the last block are never used; leave them as they were.
+    if(blockCount % 8 != 0)
+    {
+        unsigned char unused = (unsigned char) (0xFF >> (blockCount % 8));
+        fsckClaimed[blockCount / 8] |= onDisk[blockCount / 8] & unused;
+    }
+
+    if(fsckRepair && memcmp(onDisk, fsckClaimed, BITMAP_BYTES) != 0 &&
+       diskWrite(fsckClaimed, BITMAP_BYTES, at) != BITMAP_BYTES)
+    {
+        LOG_ERROR("Couldn't write the bitmap to .disk.");
+        ret = -1;
+    }
+
+    free(onDisk);
+
+    return ret;
+}
+
+
+// Compares the superblock's counts of free blocks and files with what the walk found, and rewrites them if they
+// differ. A disk without a superblock has no counters. Returns 0, or -1.
+static int fsckSuperblock(void)
+{
+    cs1550_superblock sb;
+    uint64_t used = 0, files = 0;
+    long block;
+    int i;
+
+    if(superblock.magic != SUPERBLOCK_MAGIC) return 0;
+
+    // Replaying the journal may have changed it since superblockLoad() read it.
+    if(diskRead(&sb, sizeof(sb), 0) != sizeof(sb))
+    {
+        LOG_ERROR("Couldn't read the superblock from .disk.");
+        return -1;
+    }
+
+    for(block = 0; block < blockCount; block++)
+    {
+        if(fsckClaimed[block / 8] & FSCK_BIT(block)) used++;
+    }
+
+    for(i = 0; i < fsckFileCount; i++)
+    {
+        if(!fsckFiles[i].drop) files++;
+    }
+
+    if(sb.freeBlocks == blockCount - used && sb.files == files) return 0;
+
+    fsckReport(FSCK_COUNTERS, fsckRepair, "the superblock counts %llu free blocks and %llu files, not %llu and %llu",
+               (unsigned long long) sb.freeBlocks, (unsigned long long) sb.files,
+               (unsigned long long) (blockCount - used), (unsigned long long) files);
+
+    sb.freeBlocks = blockCount - used;
+    sb.files = files;
+
+    if(fsckRepair && diskWrite(&sb, sizeof(sb), 0) != sizeof(sb))
+    {
+        LOG_ERROR("Couldn't write the superblock to .disk.");
+        return -1;
+    }
+
+    return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    int threadCount = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    pthread_t threads[FSCK_MAX_THREADS];
+    int c, i;
+
+    (void) hello_oper; //comes in with cs1550.c, but nothing gets mounted here
+
+    while((c = getopt(argc, argv, "nt:")) != -1)
+    {
+        switch(c)
+        {
+            case 'n': fsckRepair = 0; break;
+            case 't': threadCount = atoi(optarg); break;
+            default:
+                fprintf(stderr, "usage: %s [-n] [-t threads]\n", argv[0]);
+                return FSCK_EXIT_ERROR;
+        }
+    }
+
+    if(threadCount < 1) threadCount = 1;
+    if(threadCount > FSCK_MAX_THREADS) threadCount = FSCK_MAX_THREADS;
+
+    if(storageOpen() != 0 || superblockLoad() != 0 || (fsckRepair && journalReplay() != 0))
+    {
+        fprintf(stderr, "%s: can't open the filesystem\n", argv[0]);
+        return FSCK_EXIT_ERROR;
+    }
+
+    fsckClaimed = (unsigned char *) calloc(BITMAP_BYTES, 1);
+
+    if(fsckClaimed == NULL || fsckLoadDirectories() != 0)
+    {
+        fprintf(stderr, "%s: can't read .directories\n", argv[0]);
+        return FSCK_EXIT_ERROR;
+    }
+
+    // The superblock, the bitmap and the journal
+    for(i = 0; i < (int) superblock.dataStart; i++)
+    {
+        fsckClaim(i);
+    }
+
+    for(i = 0; i < threadCount; i++)
+    {
+        if(pthread_create(&threads[i], NULL, fsckWorker, NULL) != 0) break;
+    }
+
+    // Whatever threads couldn't be started, this one makes up for.
+    if(i == 0) fsckWorker(NULL);
+
+    while(i > 0) pthread_join(threads[--i], NULL);
+
+    if(fsckBitmap() != 0 || fsckSuperblock() != 0 || (fsckRepair && (fsckWriteDirectories() != 0 || storageSync() != 0)))
+    {
+        fprintf(stderr, "%s: couldn't write the repairs\n", argv[0]);
+        return FSCK_EXIT_ERROR;
+    }
+
+    storageClose();
+
+    unsigned long used = 0, problems = 0, fixed = 0;
+
+    for(i = 0; i < (int) BITMAP_BYTES; i++)
+    {
+        used += __builtin_popcount(fsckClaimed[i]);
+    }
+
+    printf("%d directory records, %d files, %lu of %d blocks in use, %lu of them past the end of their files\n",
+           fsckDirCount, fsckFileCount, used, blockCount, fsckPastEnd);
+
+    for(i = 0; i < FSCK_PROBLEM_COUNT; i++)
+    {
+        if(fsckProblems[i] == 0) continue;
+
+        printf("  %lu %s, %lu fixed\n", fsckProblems[i], fsckProblemNames[i], fsckFixed[i]);
+
+        problems += fsckProblems[i];
+        fixed += fsckFixed[i];
+    }
+
+    if(problems == 0) return FSCK_EXIT_CLEAN;
+
+    return fixed == problems ? FSCK_EXIT_FIXED : FSCK_EXIT_UNFIXED;
+}
@@ -0,0 +1,107 @@
+/*
+ * Makes an empty cs1550 filesystem in the current directory.
+ *
+ *     gcc -Wall -o mkfs mkfs.c `pkg-config fuse --cflags --libs`
+ *     ./mkfs [-b block_size] [-j journal_blocks] size[K|M|G]
+ *
+ * Creates .disk as a sparse file of the given size and writes a superblock and bitmap into it, then empties
+ * .directories. -b picks the block size (a power of two from 512 to 65536, default 4096) and -j how many blocks the
+ * journal takes (by default 256K worth, but at least 64 blocks).
+ */
+#define CS1550_NO_MAIN
+#include "cs1550.c"
+
+/* * * * * * * * * * * * * * *
+
+           DEFINES
+
+ * * * * * * * * * * * * * * */
+#define    MKFS_BLOCK_SIZE 4096
+
+/* * * * * * * * * * * * * * *
+
+            MKFS
+
+ * * * * * * * * * * * * * * */
+
+// Parses a size like 64M into bytes. Returns 0 if it isn't one.
+static unsigned long long parseSize(const char *text)
+{
+    char *end;
+    unsigned long long size = strtoull(text, &end, 10);
+
+    switch(*end)
+    {
+        case 'k': case 'K': size <<= 10; end++; break;
+        case 'm': case 'M': size <<= 20; end++; break;
+        case 'g': case 'G': size <<= 30; end++; break;
+    }
+
+    return *end == '\0' ? size : 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+    cs1550_superblock sb;
+    int size = MKFS_BLOCK_SIZE;
+    unsigned long long journal = 0;
+    int c;
+
+    (void) hello_oper; //comes in with cs1550.c, but nothing gets mounted here
+
+    while((c = getopt(argc, argv, "b:j:")) != -1)
+    {
+        switch(c)
+        {
+            case 'b': size = atoi(optarg); break;
+            case 'j': journal = strtoull(optarg, NULL, 10); break;
+            default: optind = argc + 1; break;
+        }
+    }
+
+    if(optind != argc - 1)
+    {
+        fprintf(stderr, "usage: %s [-b block_size] [-j journal_blocks] size[K|M|G]\n", argv[0]);
+        return 1;
+    }
+
+    unsigned long long bytes = parseSize(argv[optind]);
+
+    if(bytes == 0 || size <= 0 || superblockLayout(&sb, size, bytes / size, journal) != 0)
+    {
+        fprintf(stderr, "%s: can't make a filesystem of %s with %d byte blocks\n", argv[0], argv[optind], size);
+        return 1;
+    }
+
+    int fd = open(".disk", O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0 || ftruncate(fd, (off_t) (sb.blockCount * sb.blockSize)) != 0 || makeFilesystem(fd, &sb) != 0 ||
+       fsync(fd) != 0)
+    {
+        perror(".disk");
+        return 1;
+    }
+
+    close(fd);
+
+    fd = open(".directories", O_RDWR | O_CREAT | O_TRUNC, 0644);
+
+    if(fd < 0)
+    {
+        perror(".directories");
+        return 1;
+    }
+
+    close(fd);
+
+    printf("%llu blocks of %u bytes\n", (unsigned long long) sb.blockCount, sb.blockSize);
+    printf("  superblock  0\n");
+    printf("  bitmap      %llu-%llu\n", (unsigned long long) sb.bitmapStart,
+           (unsigned long long) (sb.bitmapStart + sb.bitmapBlocks - 1));
+    printf("  journal     %llu-%llu\n", (unsigned long long) sb.journalStart,
+           (unsigned long long) (sb.journalStart + sb.journalBlocks - 1));
+    printf("  data        %llu-%llu\n", (unsigned long long) sb.dataStart, (unsigned long long) (sb.blockCount - 1));
+
+    return 0;
+}